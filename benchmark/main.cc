@@ -0,0 +1,647 @@
+// Simple microbenchmarks without using any framework
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "access_log.h"
+#include "arena.h"
+#include "form.h"
+#include "http_message.h"
+#include "http_server.h"
+#include "json_writer.h"
+#include "output_buffer.h"
+#include "pubsub.h"
+#include "rate_limiter.h"
+#include "response_writer.h"
+#include "simd_scan.h"
+#include "trace.h"
+
+using namespace high_performance_server;
+
+namespace {
+
+// Keeps the compiler from discarding a result that is otherwise unused
+volatile std::uint64_t sink;
+
+// Runs `body` repeatedly for at least 200ms and prints the time per call
+void Run(const std::string &name, const std::function<void()> &body) {
+  using Clock = std::chrono::steady_clock;
+  std::uint64_t iterations = 0;
+  auto start = Clock::now();
+  auto elapsed = Clock::duration::zero();
+  do {
+    for (int i = 0; i < 1000; i++) body();
+    iterations += 1000;
+    elapsed = Clock::now() - start;
+  } while (elapsed < std::chrono::milliseconds(200));
+
+  double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+  std::printf("%-40s %10.1f ns/op\n", name.c_str(), ns / iterations);
+}
+
+// A typical browser request, about 600 bytes of headers
+std::string SampleRequest() {
+  std::string request;
+  request += "GET /api/v1/items?page=2&sort=desc HTTP/1.1\r\n";
+  request += "Host: www.example.com\r\n";
+  request +=
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+      "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n";
+  request +=
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+      "image/avif,image/webp,*/*;q=0.8\r\n";
+  request += "Accept-Language: en-US,en;q=0.5\r\n";
+  request += "Accept-Encoding: gzip, deflate, br\r\n";
+  request += "Referer: https://www.example.com/api/v1/items?page=1\r\n";
+  request +=
+      "Cookie: session=3f9a1c2b7d8e4f60a1b2c3d4e5f60718; theme=dark; "
+      "tracking=0b1c2d3e4f5a6b7c\r\n";
+  request += "Connection: keep-alive\r\n";
+  request += "Upgrade-Insecure-Requests: 1\r\n";
+  request += "Sec-Fetch-Dest: document\r\n";
+  request += "Sec-Fetch-Mode: navigate\r\n";
+  request += "Cache-Control: max-age=0\r\n\r\n";
+  return request;
+}
+
+void BenchmarkScanKernels(const std::string &request) {
+  std::vector<const scan::ScanKernels *> kernels = {
+      &scan::ScalarKernels(), scan::Sse2Kernels(), scan::Avx2Kernels()};
+  const char *data = request.data();
+  size_t length = request.length();
+  std::string scratch = request;
+  // All header names of the request back to back, as one long token
+  std::string names;
+  for (size_t pos = request.find("\r\n") + 2; pos < length;) {
+    size_t eol = request.find("\r\n", pos);
+    names += request.substr(pos, request.find(':', pos) - pos);
+    pos = eol + 2;
+    if (request.compare(pos, 2, "\r\n") == 0) break;
+  }
+
+  std::cout << "Scan kernels on a " << length << "-byte request" << std::endl;
+  for (const scan::ScanKernels *k : kernels) {
+    if (k == nullptr) continue;
+    std::string prefix = std::string(k->name) + " ";
+    Run(prefix + "find_header_end",
+        [&] { sink = k->find_header_end(data, length); });
+    Run(prefix + "find_byte(':') x13 lines", [&] {
+      size_t pos = 0, total = 0;
+      while (pos < length) {
+        size_t eol = k->find_crlf(data + pos, length - pos);
+        if (eol == scan::kNotFound || eol == 0) break;
+        total += k->find_byte(data + pos, eol, ':');
+        pos += eol + 2;
+      }
+      sink = total;
+    });
+    Run(prefix + "find_invalid_token_char (names)", [&] {
+      sink = k->find_invalid_token_char(names.data(), names.length());
+    });
+    Run(prefix + "to_lower", [&] {
+      k->to_lower(&scratch[0], length);
+      sink = scratch[0];
+    });
+  }
+}
+
+void BenchmarkParser(const std::string &request) {
+  std::cout << "Request parsing (" << scan::ActiveKernels().name
+            << " kernels)" << std::endl;
+  Run("stringToRequest", [&] {
+    HttpRequest parsed = stringToRequest(request);
+    sink = parsed.content_length();
+  });
+  RequestArena arena(64 * 1024);
+  Run("stringToRequest, request arena", [&] {
+    {
+      HttpRequest parsed = stringToRequest(request, arena.resource());
+      sink = parsed.content_length();
+    }
+    arena.Reset();
+  });
+  Run("string_to_method", [&] {
+    sink = static_cast<std::uint64_t>(string_to_method("OPTIONS"));
+  });
+}
+
+void BenchmarkRateLimiter() {
+  std::cout << "Rate limiter" << std::endl;
+  RateLimitOptions options;
+  options.requests_per_second = 1e6;
+  options.burst = 1000;
+  RateLimiter limiter(options);
+  std::uint64_t client = 0, now = 0;
+  Run("Allow, one client", [&] { sink = limiter.Allow(42, now++ >> 10); });
+  Run("Allow, 50k clients", [&] {
+    sink = limiter.Allow(client++ % 50000, now++ >> 10);
+  });
+}
+
+// Appending to the asynchronous log, against writing one line per request
+// from the calling thread
+void BenchmarkAccessLog() {
+  std::cout << "Access log" << std::endl;
+  const char *path = "/tmp/high_performance_server_benchmark.log";
+  AccessLogOptions options;
+  options.path = path;
+  options.max_files = 0;
+  options.flush_interval = std::chrono::milliseconds(1);
+  AccessLogger logger(options, 1);
+  if (!logger.Start()) return;
+  AccessLogRecord record = {};
+  record.method = HttpMethod::GET;
+  record.status = 200;
+  record.SetPath("/api/v1/items");
+  Run("Append", [&] { logger.Append(0, record); });
+  logger.Stop();
+
+  // Appending far outpaces formatting, so the writer's throughput is
+  // measured on a burst that fits in the ring
+  const int burst = 1 << 20;
+  options.ring_capacity = burst;
+  AccessLogger burst_logger(options, 1);
+  if (!burst_logger.Start()) return;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < burst; i++) burst_logger.Append(0, record);
+  burst_logger.Stop();
+  double ns = std::chrono::duration<double, std::nano>(
+                  std::chrono::steady_clock::now() - start).count();
+  std::printf("%-40s %10.1f ns/op\n", "writer thread, per record",
+              ns / burst_logger.written());
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+  std::string line = "time=2026-10-18T10:00:00.123456Z peer=127.0.0.1:52144 "
+                     "method=GET path=\"/api/v1/items\" status=200 bytes=135 "
+                     "parse_us=2.1 handler_us=0.4 total_us=15.3\n";
+  Run("write() per request", [&] { sink = write(fd, line.data(), line.size()); });
+  close(fd);
+  unlink(path);
+}
+
+// What tracing adds to a request: eight timestamps and the decision to keep
+// them or not
+void BenchmarkTracing() {
+  std::cout << "Tracing" << std::endl;
+  TraceOptions options;
+  options.sample_rate = 100;
+  Tracer tracer(options, 1);
+  RequestTrace trace;
+  Run("Tracer::Now", [&] { sink = Tracer::Now(); });
+  Run("request marks + commit, 1 in 100", [&] {
+    trace.Reset();
+    for (int mark = kTraceQueued; mark < kTraceMarkCount; mark++) {
+      trace.Mark(static_cast<TraceMark>(mark));
+    }
+    sink = tracer.CommitRequest(0, trace);
+  });
+}
+
+}  // namespace
+
+// A checkout form with a few escaped values, and an upload of three text
+// fields and a 256 KiB file, as a browser would send them
+std::string SampleUrlEncodedForm() {
+  return "first_name=Ana&last_name=Mar%C3%ADa+L%C3%B3pez&email=ana.lopez%40"
+         "example.com&phone=%2B34+600+123+456&address=Calle+Mayor+12%2C+3%C2%BA"
+         "+B&city=Madrid&postal_code=28013&country=ES&shipping=express&"
+         "gift_wrap=on&notes=Please+leave+at+the+door%2C+thanks%21&coupon=&"
+         "card_name=ANA+M+LOPEZ&terms=accepted&csrf_token=8f14e45fceea167a5a36"
+         "dedd4bea2543";
+}
+
+const char kFormBoundary[] = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+
+std::string SampleMultipartForm() {
+  std::string body, dash = std::string("--") + kFormBoundary;
+  auto field = [&](const std::string &name, const std::string &value) {
+    body += dash + "\r\nContent-Disposition: form-data; name=\"" + name +
+            "\"\r\n\r\n" + value + "\r\n";
+  };
+  field("title", "Quarterly report");
+  field("description", "Figures for Q3, see attached.");
+  field("visibility", "team");
+  body += dash +
+          "\r\nContent-Disposition: form-data; name=\"attachment\"; "
+          "filename=\"report.csv\"\r\nContent-Type: text/csv\r\n\r\n";
+  std::mt19937 generator(7);
+  while (body.length() < 256 * 1024) {
+    body += "2024-09-" + std::to_string(generator() % 30 + 1) + ",region-" +
+            std::to_string(generator() % 50) + "," +
+            std::to_string(generator() % 100000) + ",--,ok\r\n";
+  }
+  body += "\r\n" + dash + "--\r\n";
+  return body;
+}
+
+// Counts what reaches the sink, as a handler streaming a file would
+class CountingSink : public MultipartSink {
+public:
+  void OnPartBegin(const MultipartPart &) override { parts++; }
+  void OnPartData(std::string_view data) override { bytes += data.length(); }
+  void OnPartEnd() override {}
+
+  std::uint64_t parts = 0;
+  std::uint64_t bytes = 0;
+};
+
+void BenchmarkForms() {
+  std::cout << "Form parsing" << std::endl;
+  const std::string form = SampleUrlEncodedForm();
+  RequestArena arena(64 * 1024);
+  Run("urlencoded, copied into std::map", [&] {
+    std::map<std::string, std::string> fields;
+    UrlEncodedParser parser(form);
+    FormField field;
+    while (parser.Next(&field)) {
+      std::string value(field.value.length(), '\0');
+      value.resize(PercentDecode(field.value, &value[0]));
+      fields[std::string(field.name)] = std::move(value);
+    }
+    sink = fields.size();
+  });
+  Run("urlencoded, views + lazy decode", [&] {
+    UrlEncodedParser parser(form);
+    FormField field;
+    std::uint64_t total = 0;
+    while (parser.Next(&field)) {
+      total += PercentDecode(field.value, arena.resource()).length();
+    }
+    arena.Reset();
+    sink = total;
+  });
+  Run("urlencoded, one field by name", [&] {
+    sink = FindFormField(form, "csrf_token")->length();
+  });
+
+  const std::string upload = SampleMultipartForm();
+  const std::string delimiter = std::string("\r\n--") + kFormBoundary;
+  std::printf("multipart body: %zu bytes\n", upload.length());
+  Run("multipart, whole body", [&] {
+    sink = ParseMultipartForm(upload, kFormBoundary).size();
+  });
+  Run("multipart, streamed in 4 KiB pieces", [&] {
+    CountingSink counter;
+    MultipartParser parser(kFormBoundary, &counter);
+    for (size_t pos = 0; pos < upload.length(); pos += 4096) {
+      parser.Feed(std::string_view(upload).substr(pos, 4096));
+    }
+    sink = counter.bytes;
+  });
+  Run("boundary search, std::string_view::find", [&] {
+    sink = std::string_view(upload).find(delimiter, 1024);
+  });
+  std::boyer_moore_horspool_searcher<std::string::const_iterator> horspool(
+      delimiter.begin(), delimiter.end());
+  Run("boundary search, Horspool", [&] {
+    sink = std::search(upload.begin() + 1024, upload.end(), horspool) -
+           upload.begin();
+  });
+  Run("boundary search, scan::FindSubstring", [&] {
+    sink = scan::FindSubstring(upload.data() + 1024, upload.length() - 1024,
+                               delimiter.data(), delimiter.length());
+  });
+}
+
+// A list of items as an API would return it, about 150 KB of JSON
+struct SampleItem {
+  int id;
+  std::string name;
+  std::string description;
+  double price;
+  bool available;
+};
+
+std::vector<SampleItem> SampleItems() {
+  std::vector<SampleItem> items;
+  for (int i = 0; i < 1000; i++) {
+    items.push_back(SampleItem{
+        i, "Item " + std::to_string(i),
+        "A \"quoted\" description of item " + std::to_string(i) +
+            ", long enough to be worth scanning in vector registers",
+        9.99 + i, i % 3 != 0});
+  }
+  return items;
+}
+
+// What a handler without a JSON writer does: escape byte by byte into a
+// string, then copy it into the response and the response into another one
+void AppendEscaped(std::string *out, const std::string &value) {
+  *out += '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      *out += '\\';
+      *out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escape[8];
+      std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+      *out += escape;
+    } else {
+      *out += c;
+    }
+  }
+  *out += '"';
+}
+
+std::string ItemsByConcatenation(const std::vector<SampleItem> &items) {
+  std::string json = "[";
+  for (const SampleItem &item : items) {
+    if (json.length() > 1) json += ',';
+    json += "{\"id\":" + std::to_string(item.id) + ",\"name\":";
+    AppendEscaped(&json, item.name);
+    json += ",\"description\":";
+    AppendEscaped(&json, item.description);
+    json += ",\"price\":" + std::to_string(item.price);
+    json += ",\"available\":";
+    json += item.available ? "true" : "false";
+    json += '}';
+  }
+  json += ']';
+  return json;
+}
+
+void WriteItems(const std::vector<SampleItem> &items, ResponseWriter &writer) {
+  JsonWriter json(writer);
+  json.BeginArray();
+  for (const SampleItem &item : items) {
+    json.BeginObject()
+        .Key("id").Int(item.id)
+        .Key("name").String(item.name)
+        .Key("description").String(item.description)
+        .Key("price").Double(item.price)
+        .Key("available").Bool(item.available)
+        .EndObject();
+  }
+  json.EndArray();
+}
+
+// Stands in for the socket: takes everything, and notes when the first
+// chunk was ready
+struct Drain {
+  OutputChain *chain;
+  std::chrono::steady_clock::time_point first_flush;
+
+  static bool Flush(void *context) {
+    Drain *drain = static_cast<Drain *>(context);
+    if (drain->first_flush == std::chrono::steady_clock::time_point()) {
+      drain->first_flush = std::chrono::steady_clock::now();
+    }
+    drain->chain->Consume(drain->chain->size());
+    return true;
+  }
+};
+
+void BenchmarkJson() {
+  std::cout << "JSON responses" << std::endl;
+  const std::vector<SampleItem> items = SampleItems();
+  std::printf("document: %zu bytes\n", ItemsByConcatenation(items).length());
+  Run("string concatenation + toString", [&] {
+    HttpResponse response(HttpStatusCode::Ok);
+    response.SetHeader("Content-Type", "application/json");
+    response.SetContent(ItemsByConcatenation(items));
+    sink = toString(response).length();
+  });
+
+  BufferPool pool;
+  OutputChain chain;
+  chain.set_pool(&pool);
+  Drain drain{&chain, {}};
+  Run("JsonWriter into the output chain", [&] {
+    ResponseWriter writer(&chain, true, false, &Drain::Flush, &drain);
+    writer.Begin(HttpStatusCode::Ok);
+    writer.SetHeader("Content-Type", "application/json");
+    WriteItems(items, writer);
+    writer.Finish();
+    sink = writer.body_bytes();
+    chain.Clear();
+  });
+  std::printf("output blocks allocated: %llu\n",
+              static_cast<unsigned long long>(pool.allocated()));
+
+  // How long the client waits for the first byte of the body
+  auto start = std::chrono::steady_clock::now();
+  sink = ItemsByConcatenation(items).length();
+  auto whole = std::chrono::steady_clock::now() - start;
+  drain.first_flush = std::chrono::steady_clock::time_point();
+  start = std::chrono::steady_clock::now();
+  {
+    ResponseWriter writer(&chain, true, false, &Drain::Flush, &drain);
+    writer.Begin(HttpStatusCode::Ok);
+    WriteItems(items, writer);
+    writer.Finish();
+    chain.Clear();
+  }
+  auto first_chunk = drain.first_flush - start;
+  std::printf("first body byte: %.1f us built whole, %.1f us streamed\n",
+              std::chrono::duration<double, std::micro>(whole).count(),
+              std::chrono::duration<double, std::micro>(first_chunk).count());
+
+  const std::string text(4096, 'x');
+  Run("JSON escape scan 4 KiB, scalar", [&] {
+    sink = scan::ScalarKernels().find_json_escape(text.data(), text.length());
+  });
+  Run(std::string("JSON escape scan 4 KiB, ") + scan::ActiveKernels().name,
+      [&] { sink = scan::FindJsonEscape(text.data(), text.length()); });
+}
+
+// The subscribers of BenchmarkFanOut, in a process of their own so that
+// neither side runs out of file descriptors. Writes to `report` once every
+// stream has started, then once for each event all subscribers have
+// received in full. Every event is `event_size` bytes.
+void RunSubscribers(const sockaddr_un &address, socklen_t address_length,
+                    int subscribers, size_t event_size, int events,
+                    int report) {
+  const std::string request = "GET /events HTTP/1.1\r\nHost: bench\r\n\r\n";
+  int epoll_fd = epoll_create1(0);
+  std::vector<int> clients;
+  for (int i = 0; i < subscribers; i++) {
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(client, (const sockaddr *)&address, address_length) != 0) {
+      std::perror("connect");
+      _exit(1);
+    }
+    send(client, request.data(), request.length(), 0);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = clients.size();
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &event);
+    clients.push_back(client);
+  }
+
+  // How much of "\r\n\r\n" each stream has matched; the events follow it
+  static const char kHeadEnd[] = "\r\n\r\n";
+  std::vector<int> head_matched(subscribers, 0);
+  int heads = 0;
+  bool started = false;
+  std::uint64_t body_bytes = 0;
+  int reported = 0;
+  std::vector<epoll_event> ready(1024);
+  static char buffer[256 * 1024];
+  while (reported < events) {
+    int count = epoll_wait(epoll_fd, ready.data(),
+                           static_cast<int>(ready.size()), 5000);
+    if (count <= 0) _exit(1);  // stalled, which the parent sees as EOF
+    for (int i = 0; i < count; i++) {
+      size_t index = ready[i].data.u64;
+      ssize_t length = recv(clients[index], buffer, sizeof(buffer), 0);
+      if (length <= 0) _exit(1);
+      ssize_t at = 0;
+      while (head_matched[index] < 4 && at < length) {
+        char c = buffer[at++];
+        head_matched[index] = c == kHeadEnd[head_matched[index]]
+                                  ? head_matched[index] + 1
+                                  : (c == '\r' ? 1 : 0);
+        if (head_matched[index] == 4) heads++;
+      }
+      body_bytes += length - at;
+    }
+    if (!started && heads == subscribers) {
+      started = true;
+      if (write(report, "s", 1) != 1) _exit(1);
+    }
+    while (reported < events &&
+           body_bytes >= (reported + 1ull) * subscribers * event_size) {
+      reported++;
+      if (write(report, "e", 1) != 1) _exit(1);
+    }
+  }
+  _exit(0);
+}
+
+// Server-Sent Events fanned out to 10k subscribers over an abstract Unix
+// domain socket: how long one event takes to reach all of them, and how
+// many deliveries a burst of events gets through per second
+void BenchmarkFanOut() {
+  constexpr int kSubscribers = 10000;
+  constexpr int kRounds = 20;
+  constexpr int kBurst = 100;
+  std::cout << "Event fan-out" << std::endl;
+  const std::string payload(64, 'x');
+  Run("EventMessage::Create, 64 B", [&] {
+    EventMessage *message = EventMessage::Create("ticks", payload);
+    sink = message->bytes().length();
+    message->Unref();
+  });
+  EventMessage *sample = EventMessage::Create("ticks", payload);
+  const size_t event_size = sample->bytes().length();
+  sample->Unref();
+
+  // Each process holds one descriptor per subscriber
+  rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < kSubscribers + 100) {
+    std::printf("skipped, %d file descriptors needed\n", kSubscribers + 100);
+    return;
+  }
+
+  const std::string name = "high_performance_server_benchmark_events";
+  HttpServer server(
+      std::vector<ListenEndpoint>{ListenEndpoint::AbstractUnix(name)});
+  server.RegisterEventStream("/events", "ticks");
+  // Room for the whole burst, so that no subscriber drops any of it
+  EventStreamOptions options;
+  options.max_backlog = kBurst;
+  server.SetEventStreamOptions(options);
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path + 1, name.data(), name.length());
+  socklen_t address_length =
+      offsetof(sockaddr_un, sun_path) + 1 + name.length();
+
+  // Forked before the server has started any thread
+  int report[2];
+  if (pipe(report) != 0) return;
+  pid_t child = fork();
+  if (child == 0) {
+    close(report[0]);
+    RunSubscribers(address, address_length, kSubscribers, event_size,
+                   kRounds + kBurst, report[1]);
+  }
+  close(report[1]);
+  server.Start();
+  char signal;
+  if (read(report[0], &signal, 1) != 1) {
+    std::printf("subscribers failed to connect\n");
+    waitpid(child, nullptr, 0);
+    close(report[0]);
+    server.Stop(std::chrono::milliseconds(100));
+    return;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  std::vector<double> latencies;
+  for (int i = 0; i < kRounds; i++) {
+    auto start = Clock::now();
+    server.Publish("ticks", payload);
+    if (read(report[0], &signal, 1) != 1) break;
+    latencies.push_back(
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count());
+  }
+  std::sort(latencies.begin(), latencies.end());
+  if (!latencies.empty()) {
+    std::printf("one event to %d subscribers: %.2f ms median, %.2f ms max\n",
+                server.stats().subscribers, latencies[latencies.size() / 2],
+                latencies.back());
+  }
+
+  auto total_sends = [&] {
+    std::uint64_t sends = 0;
+    for (const WorkerStats &worker : server.stats().workers) {
+      sends += worker.sends;
+    }
+    return sends;
+  };
+  std::uint64_t sends_before = total_sends();
+  auto start = Clock::now();
+  for (int i = 0; i < kBurst; i++) server.Publish("ticks", payload);
+  int received = 0;
+  while (received < kBurst && read(report[0], &signal, 1) == 1) received++;
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  double deliveries = static_cast<double>(received) * kSubscribers;
+  std::printf("burst of %d events: %.0f deliveries/s, %.1f events per send, "
+              "%llu dropped\n",
+              kBurst, deliveries / seconds,
+              deliveries / std::max<std::uint64_t>(
+                               total_sends() - sends_before, 1),
+              static_cast<unsigned long long>(server.stats().events_dropped));
+
+  waitpid(child, nullptr, 0);
+  close(report[0]);
+  server.Stop(std::chrono::milliseconds(100));
+}
+
+int main(void) {
+  std::string request = SampleRequest();
+  BenchmarkScanKernels(request);
+  BenchmarkParser(request);
+  BenchmarkRateLimiter();
+  BenchmarkAccessLog();
+  BenchmarkTracing();
+  BenchmarkForms();
+  BenchmarkJson();
+  BenchmarkFanOut();
+  return 0;
+}
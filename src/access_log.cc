@@ -0,0 +1,239 @@
+#include "access_log.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+
+namespace {
+
+// Records formatted per ring before moving on to the next worker
+constexpr size_t kBatchSize = 1024;
+// Formatted bytes collected before a write
+constexpr size_t kWriteThreshold = 256 << 10;
+
+void AppendNumber(std::string *out, std::uint64_t value, int min_digits = 1) {
+  char digits[24];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  for (int i = result.ptr - digits; i < min_digits; i++) out->push_back('0');
+  out->append(digits, result.ptr);
+}
+
+// Nanoseconds as microseconds with one decimal, e.g. "12.3"
+void AppendMicroseconds(std::string *out, std::uint64_t ns) {
+  AppendNumber(out, ns / 1000);
+  out->push_back('.');
+  AppendNumber(out, ns / 100 % 10);
+}
+
+// The date and time of day change once a second, so they are only
+// converted when the second changes
+void AppendTime(std::string *out, std::int64_t time_us) {
+  thread_local std::int64_t cached_seconds = -1;
+  thread_local std::string cached_prefix;
+  std::int64_t seconds = time_us / 1000000;
+  if (seconds != cached_seconds) {
+    std::time_t time = seconds;
+    std::tm utc;
+    gmtime_r(&time, &utc);
+    cached_prefix.clear();
+    AppendNumber(&cached_prefix, utc.tm_year + 1900, 4);
+    cached_prefix.push_back('-');
+    AppendNumber(&cached_prefix, utc.tm_mon + 1, 2);
+    cached_prefix.push_back('-');
+    AppendNumber(&cached_prefix, utc.tm_mday, 2);
+    cached_prefix.push_back('T');
+    AppendNumber(&cached_prefix, utc.tm_hour, 2);
+    cached_prefix.push_back(':');
+    AppendNumber(&cached_prefix, utc.tm_min, 2);
+    cached_prefix.push_back(':');
+    AppendNumber(&cached_prefix, utc.tm_sec, 2);
+    cached_prefix.push_back('.');
+    cached_seconds = seconds;
+  }
+  out->append(cached_prefix);
+  AppendNumber(out, time_us % 1000000, 6);
+  out->push_back('Z');
+}
+
+// Quotes a path, escaping what would break the line apart
+void AppendQuoted(std::string *out, const char *data, size_t length) {
+  static const char kHex[] = "0123456789abcdef";
+  out->push_back('"');
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = data[i];
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20 || c == 0x7f) {
+      out->append("\\x");
+      out->push_back(kHex[c >> 4]);
+      out->push_back(kHex[c & 0xF]);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+}  // namespace
+
+namespace high_performance_server {
+
+void AccessLogRecord::SetPeer(const PeerAddress &peer) {
+  peer_family = peer.storage.ss_family;
+  if (peer_family == AF_INET) {
+    const auto *address = reinterpret_cast<const sockaddr_in *>(&peer.storage);
+    peer_port = ntohs(address->sin_port);
+    std::memcpy(peer_address, &address->sin_addr, 4);
+  } else if (peer_family == AF_INET6) {
+    const auto *address =
+        reinterpret_cast<const sockaddr_in6 *>(&peer.storage);
+    peer_port = ntohs(address->sin6_port);
+    std::memcpy(peer_address, &address->sin6_addr, 16);
+  } else {
+    peer_port = 0;
+  }
+}
+
+void AccessLogRecord::SetPath(const std::string &request_path) {
+  path_length = std::min(request_path.length(), kMaxPathLength);
+  std::memcpy(path, request_path.data(), path_length);
+}
+
+AccessLogger::AccessLogger(const AccessLogOptions &options, int num_workers)
+    : options_(options),
+      sample_counters_(std::make_unique<SampleCounter[]>(num_workers)),
+      running_(false), written_(0), dropped_(0), fd_(-1), file_size_(0) {
+  for (int i = 0; i < num_workers; i++) {
+    rings_.push_back(std::make_unique<SpscRing<AccessLogRecord>>(
+        options.ring_capacity));
+  }
+}
+
+AccessLogger::~AccessLogger() { Stop(); }
+
+bool AccessLogger::Start() {
+  fd_ = open(options_.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+             0644);
+  if (fd_ < 0) return false;
+  file_size_ = lseek(fd_, 0, SEEK_END);
+  buffer_.reserve(kWriteThreshold + 4096);
+  running_ = true;
+  writer_thread_ = std::thread(&AccessLogger::Run, this);
+  return true;
+}
+
+void AccessLogger::Stop() {
+  if (!running_.exchange(false)) return;
+  writer_thread_.join();
+  while (Drain() > 0) {
+  }
+  Flush();
+  close(fd_);
+  fd_ = -1;
+}
+
+void AccessLogger::Run() {
+  while (running_) {
+    if (Drain() == 0) {
+      Flush();
+      std::this_thread::sleep_for(options_.flush_interval);
+    }
+  }
+}
+
+size_t AccessLogger::Drain() {
+  size_t drained = 0;
+  for (auto &ring : rings_) {
+    drained += ring->PopBatch(
+        kBatchSize, [this](const AccessLogRecord &record) { Format(record); });
+    if (buffer_.size() >= kWriteThreshold) Flush();
+  }
+  written_.fetch_add(drained, std::memory_order_relaxed);
+  return drained;
+}
+
+// time=2026-10-18T10:00:00.123456Z peer=203.0.113.7:52144 method=GET
+// path="/welcome" status=200 bytes=135 parse_us=2.1 handler_us=0.4
+// total_us=15.3 (on one line)
+void AccessLogger::Format(const AccessLogRecord &record) {
+  std::string &out = buffer_;
+  out.append("time=");
+  AppendTime(&out, record.time_us);
+  out.append(" peer=");
+  if (record.peer_family == AF_INET || record.peer_family == AF_INET6) {
+    char host[INET6_ADDRSTRLEN];
+    inet_ntop(record.peer_family, record.peer_address, host, sizeof(host));
+    if (record.peer_family == AF_INET6) out.push_back('[');
+    out.append(host);
+    if (record.peer_family == AF_INET6) out.push_back(']');
+    out.push_back(':');
+    AppendNumber(&out, record.peer_port);
+  } else {
+    out.append(record.peer_family == AF_UNIX ? "unix" : "-");
+  }
+  out.append(" method=");
+  out.append(to_string(record.method));
+  out.append(" path=");
+  AppendQuoted(&out, record.path, record.path_length);
+  out.append(" status=");
+  AppendNumber(&out, record.status);
+  out.append(" bytes=");
+  AppendNumber(&out, record.bytes);
+  out.append(" parse_us=");
+  AppendMicroseconds(&out, record.parse_ns);
+  out.append(" handler_us=");
+  AppendMicroseconds(&out, record.handler_ns);
+  out.append(" total_us=");
+  AppendMicroseconds(&out, record.total_ns);
+  out.push_back('\n');
+}
+
+void AccessLogger::Flush() {
+  if (buffer_.empty() || fd_ < 0) return;
+  if (options_.max_file_size > 0 && file_size_ > 0 &&
+      file_size_ + buffer_.size() > options_.max_file_size) {
+    Rotate();
+  }
+  size_t offset = 0;
+  while (offset < buffer_.size()) {
+    ssize_t count = write(fd_, buffer_.data() + offset, buffer_.size() - offset);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      break;  // the log is best effort; never let it stop the server
+    }
+    offset += count;
+  }
+  file_size_ += offset;
+  buffer_.clear();
+}
+
+void AccessLogger::Rotate() {
+  const std::string &path = options_.path;
+  for (int i = options_.max_files - 1; i >= 1; i--) {
+    rename((path + '.' + std::to_string(i)).c_str(),
+           (path + '.' + std::to_string(i + 1)).c_str());
+  }
+  if (options_.max_files > 0) {
+    rename(path.c_str(), (path + ".1").c_str());
+  } else {
+    unlink(path.c_str());
+  }
+  close(fd_);
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_TRUNC | O_CLOEXEC,
+             0644);
+  file_size_ = 0;
+}
+
+}  // namespace high_performance_server
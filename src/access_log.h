@@ -0,0 +1,115 @@
+// Asynchronous access log. Workers append fixed-size records to their own
+// ring buffer without allocating or blocking; a background thread formats
+// them in batches and writes them with large write calls.
+
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http_message.h"
+#include "socket.h"
+#include "spsc_ring.h"
+
+namespace high_performance_server {
+
+struct AccessLogOptions {
+  std::string path;
+  // Log one request in `sample_rate`
+  std::uint32_t sample_rate = 1;
+  // When the file would grow past `max_file_size` bytes it is renamed to
+  // path.1 (path.1 to path.2, and so on) and a new file is started. At most
+  // `max_files` old files are kept. 0 disables rotation.
+  size_t max_file_size = 100 << 20;
+  int max_files = 5;
+  // Records buffered per worker. When a ring is full, records are dropped.
+  size_t ring_capacity = 8192;
+  std::chrono::milliseconds flush_interval{100};
+};
+
+// One request, as captured by a worker. Paths longer than kMaxPathLength
+// are truncated.
+struct AccessLogRecord {
+  static constexpr size_t kMaxPathLength = 256;
+
+  std::int64_t time_us;  // completion time, microseconds since the epoch
+  std::uint64_t parse_ns;
+  std::uint64_t handler_ns;
+  std::uint64_t total_ns;  // from receiving the request to sending the reply
+  std::uint64_t bytes;     // response bytes sent
+  std::uint16_t status;
+  HttpMethod method;
+  std::uint16_t peer_family;
+  std::uint16_t peer_port;
+  std::uint8_t peer_address[16];
+  std::uint16_t path_length;
+  char path[kMaxPathLength];
+
+  void SetPeer(const PeerAddress &peer);
+  void SetPath(const std::string &path);
+};
+
+class AccessLogger {
+public:
+  AccessLogger(const AccessLogOptions &options, int num_workers);
+  ~AccessLogger();
+
+  AccessLogger(const AccessLogger &) = delete;
+  AccessLogger &operator=(const AccessLogger &) = delete;
+
+  // Opens the log file and starts the writer thread
+  bool Start();
+  // Writes everything still buffered and stops the writer thread
+  void Stop();
+
+  // Called by worker `worker_id` only: whether to capture its next request
+  bool Sample(int worker_id) {
+    if (++sample_counters_[worker_id].value < options_.sample_rate) {
+      return false;
+    }
+    sample_counters_[worker_id].value = 0;
+    return true;
+  }
+  // Called by worker `worker_id` only. Never blocks.
+  void Append(int worker_id, const AccessLogRecord &record) {
+    if (!rings_[worker_id]->TryPush(record)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  std::uint64_t written() const { return written_; }
+  std::uint64_t dropped() const { return dropped_; }
+
+private:
+  struct alignas(64) SampleCounter {
+    std::uint32_t value = 0;
+  };
+
+  AccessLogOptions options_;
+  std::vector<std::unique_ptr<SpscRing<AccessLogRecord>>> rings_;
+  std::unique_ptr<SampleCounter[]> sample_counters_;
+  std::atomic<bool> running_;
+  std::atomic<std::uint64_t> written_;
+  std::atomic<std::uint64_t> dropped_;
+  std::thread writer_thread_;
+  int fd_;
+  size_t file_size_;
+  std::string buffer_;
+
+  void Run();
+  size_t Drain();
+  void Format(const AccessLogRecord &record);
+  void Flush();
+  void Rotate();
+};
+
+}  // namespace high_performance_server
+
+#endif  // ACCESS_LOG_H_
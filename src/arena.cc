@@ -0,0 +1,45 @@
+#include "arena.h"
+
+#include <stdexcept>
+
+#include "response_writer.h"
+
+namespace high_performance_server {
+
+RequestArena::RequestArena(size_t capacity)
+    : buffer_(new std::byte[capacity]),
+      resource_(buffer_.get(), capacity, &upstream_), overflows_(0) {}
+
+void RequestArena::Reset() {
+  // Back to the start of the buffer; heap blocks are returned
+  resource_.release();
+  if (upstream_.used) {
+    upstream_.used = false;
+    overflows_.store(overflows_.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+  }
+}
+
+void *RequestArena::Upstream::do_allocate(size_t bytes, size_t alignment) {
+  used = true;
+  return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void RequestArena::Upstream::do_deallocate(void *pointer, size_t bytes,
+                                           size_t alignment) {
+  std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+}
+
+ResponseWriter &RequestContext::Stream(HttpStatusCode status,
+                                       std::string_view content_type) {
+  if (writer_ == nullptr) {
+    throw std::logic_error("This request cannot be streamed");
+  }
+  if (!writer_->started()) {
+    writer_->Begin(status);
+    if (!content_type.empty()) writer_->SetHeader("Content-Type", content_type);
+  }
+  return *writer_;
+}
+
+}  // namespace high_performance_server
@@ -0,0 +1,125 @@
+// Memory that lives as long as one request. Each worker owns an arena that
+// handlers reach through their RequestContext and allocate from with
+// std::pmr: allocating is a pointer bump, and the worker frees everything at
+// once when the request is done.
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "cancellation.h"
+#include "http_message.h"
+
+namespace high_performance_server {
+
+class ResponseWriter;
+
+class RequestArena {
+public:
+  // Requests are served from a buffer of `capacity` bytes allocated once.
+  // Those that need more get further blocks from the heap, freed on Reset().
+  explicit RequestArena(size_t capacity);
+  ~RequestArena() = default;
+
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  std::pmr::memory_resource *resource() { return &resource_; }
+  // Frees everything allocated since the previous reset. Called by the
+  // owning thread only.
+  void Reset();
+  // Requests that outgrew the buffer. Safe to read from any thread.
+  std::uint64_t overflows() const {
+    return overflows_.load(std::memory_order_relaxed);
+  }
+
+private:
+  // The heap, noting whether the current request needed it
+  class Upstream : public std::pmr::memory_resource {
+  public:
+    bool used = false;
+
+  private:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *pointer, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const
+        noexcept override {
+      return this == &other;
+    }
+  };
+
+  std::unique_ptr<std::byte[]> buffer_;
+  Upstream upstream_;
+  std::pmr::monotonic_buffer_resource resource_;
+  std::atomic<std::uint64_t> overflows_;
+};
+
+// What a handler has besides the request. Valid until the handler returns:
+// the worker resets the arena behind it once the response is serialized.
+class RequestContext {
+public:
+  // Without a `cancellation` token the request is never cancelled
+  RequestContext(std::pmr::memory_resource *resource, int worker_id,
+                 ResponseWriter *writer = nullptr,
+                 CancellationToken *cancellation = nullptr)
+      : resource_(resource), worker_id_(worker_id), writer_(writer),
+        cancellation_(cancellation != nullptr ? cancellation
+                                              : &never_cancelled_) {}
+
+  RequestContext(const RequestContext &) = delete;
+  RequestContext &operator=(const RequestContext &) = delete;
+
+  // For std::pmr containers, and for messages, e.g.
+  // HttpResponse response(HttpStatusCode::Ok, context.resource())
+  std::pmr::memory_resource *resource() const { return resource_; }
+  template <typename T = std::byte>
+  std::pmr::polymorphic_allocator<T> allocator() const {
+    return std::pmr::polymorphic_allocator<T>(resource_);
+  }
+  // Constructs a T in the arena. It is never destroyed, only forgotten
+  // with the rest of the arena.
+  template <typename T, typename... Args> T *Make(Args &&...args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Arena objects are never destroyed");
+    void *memory = resource_->allocate(sizeof(T), alignof(T));
+    return new (memory) T(std::forward<Args>(args)...);
+  }
+
+  // Streams the response instead of returning it: the head is sent with
+  // "Transfer-Encoding: chunked" and the body goes out in chunks as the
+  // handler writes it. Headers can be added to the writer until the first
+  // body byte. Whatever the handler returns afterwards is ignored, and an
+  // exception thrown after this closes the connection. Throws
+  // std::logic_error when the request is not served by an HttpServer.
+  ResponseWriter &Stream(HttpStatusCode status,
+                         std::string_view content_type = std::string_view());
+
+  // The worker serving the request, 0 to the number of workers - 1
+  int worker_id() const { return worker_id_; }
+
+  // Cancelled once the request's deadline passes or its client goes away.
+  // Once a handler has seen its request cancelled by the deadline, what it
+  // returns is replaced by the server's timeout response; a streamed
+  // response is cut off instead.
+  CancellationToken &cancellation() { return *cancellation_; }
+
+private:
+  std::pmr::memory_resource *resource_;
+  int worker_id_;
+  ResponseWriter *writer_;
+  CancellationToken *cancellation_;
+  CancellationToken never_cancelled_;
+};
+
+}  // namespace high_performance_server
+
+#endif  // ARENA_H_
@@ -0,0 +1,57 @@
+#include "cancellation.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace high_performance_server {
+
+CancellationToken::CancellationToken(Clock::time_point deadline,
+                                     PeerProbe probe, void *probe_context)
+    : deadline_(deadline), next_probe_(Clock::time_point::min()),
+      probe_(probe), probe_context_(probe_context),
+      reason_(CancelReason::None) {}
+
+CancellationToken::Clock::duration CancellationToken::remaining() const {
+  if (deadline_ == Clock::time_point::max()) return Clock::duration::max();
+  return std::max(deadline_ - Clock::now(), Clock::duration::zero());
+}
+
+void CancellationToken::ShortenDeadline(Clock::time_point deadline) {
+  deadline_ = std::min(deadline_, deadline);
+}
+
+void CancellationToken::OnCancel(std::function<void()> callback) {
+  if (cancelled()) {
+    callback();
+    return;
+  }
+  callbacks_.push_back(std::move(callback));
+}
+
+void CancellationToken::Cancel(CancelReason reason) {
+  if (reason_ != CancelReason::None) return;
+  reason_ = reason;
+  // A callback may subscribe another, which then runs right away
+  std::vector<std::function<void()>> callbacks;
+  callbacks.swap(callbacks_);
+  for (auto &callback : callbacks) callback();
+}
+
+bool CancellationToken::Check() {
+  if (deadline_ == Clock::time_point::max() && probe_ == nullptr) return false;
+  auto now = Clock::now();
+  if (now >= deadline_) {
+    Cancel(CancelReason::Deadline);
+    return true;
+  }
+  if (probe_ != nullptr && now >= next_probe_) {
+    next_probe_ = now + kProbeInterval;
+    if (probe_(probe_context_)) {
+      Cancel(CancelReason::PeerClosed);
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace high_performance_server
@@ -0,0 +1,80 @@
+// Deadlines and cancellation of requests. A handler runs to completion on
+// its worker, so cancellation is cooperative: a handler doing long work asks
+// its token now and then whether the request is still wanted, and may
+// subscribe callbacks, e.g. to abort work it started elsewhere.
+//
+//   for (const auto &item : items) {
+//     if (context.cancellation().cancelled()) return HttpResponse();
+//     ...
+//   }
+
+#ifndef CANCELLATION_H_
+#define CANCELLATION_H_
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+namespace high_performance_server {
+
+enum class CancelReason {
+  None,
+  Deadline,   // the request's deadline passed
+  PeerClosed  // the client shut down its side or went away
+};
+
+class CancellationToken {
+public:
+  using Clock = std::chrono::steady_clock;
+  // Tells whether the client of the request has gone away
+  using PeerProbe = bool (*)(void *context);
+
+  // The connection is probed at most this often
+  static constexpr Clock::duration kProbeInterval =
+      std::chrono::milliseconds(1);
+
+  // Never cancelled unless Cancel() is called
+  CancellationToken()
+      : CancellationToken(Clock::time_point::max(), nullptr, nullptr) {}
+  // Cancelled at `deadline`, or once `probe` finds the client gone
+  CancellationToken(Clock::time_point deadline, PeerProbe probe,
+                    void *probe_context);
+
+  CancellationToken(const CancellationToken &) = delete;
+  CancellationToken &operator=(const CancellationToken &) = delete;
+
+  // Checks the deadline, and the connection every kProbeInterval. Cheap
+  // enough to call in an inner loop.
+  bool cancelled() {
+    if (reason_ != CancelReason::None) return true;
+    return Check();
+  }
+  CancelReason reason() const { return reason_; }
+
+  Clock::time_point deadline() const { return deadline_; }
+  // Time left until the deadline, zero once it has passed
+  Clock::duration remaining() const;
+  // Only moves the deadline earlier
+  void ShortenDeadline(Clock::time_point deadline);
+
+  // Runs `callback` on the worker once the request is cancelled, right away
+  // if it already is. Callbacks run from cancelled() or from the server, so
+  // before the handler returns or not at all.
+  void OnCancel(std::function<void()> callback);
+  // Cancels the request unless it already is, and runs the callbacks
+  void Cancel(CancelReason reason);
+
+private:
+  Clock::time_point deadline_;
+  Clock::time_point next_probe_;
+  PeerProbe probe_;
+  void *probe_context_;
+  CancelReason reason_;
+  std::vector<std::function<void()>> callbacks_;
+
+  bool Check();
+};
+
+}  // namespace high_performance_server
+
+#endif  // CANCELLATION_H_
@@ -0,0 +1,332 @@
+#include "form.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "simd_scan.h"
+
+namespace high_performance_server {
+
+namespace {
+
+// RFC 2046 limit
+constexpr size_t kMaxBoundaryLength = 70;
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool IsSpace(char c) { return c == ' ' || c == '\t'; }
+
+std::string_view Trim(std::string_view text) {
+  while (!text.empty() && IsSpace(text.front())) text.remove_prefix(1);
+  while (!text.empty() && IsSpace(text.back())) text.remove_suffix(1);
+  return text;
+}
+
+bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  return a.length() == b.length() &&
+         strncasecmp(a.data(), b.data(), a.length()) == 0;
+}
+
+// Reads the next "; name=value" parameter of a header value, starting at
+// `*pos`. Quoted values are returned without their quotes (escapes inside
+// them are left as sent). Returns false when there are no more.
+bool NextParameter(std::string_view header, size_t *pos,
+                   std::string_view *name, std::string_view *value) {
+  const size_t length = header.length();
+  size_t at = *pos;
+  while (at < length && (header[at] == ';' || IsSpace(header[at]))) at++;
+  if (at >= length) return false;
+
+  size_t name_begin = at;
+  while (at < length && header[at] != '=' && header[at] != ';') at++;
+  *name = Trim(header.substr(name_begin, at - name_begin));
+  *value = std::string_view();
+  if (at < length && header[at] == '=') {
+    at++;
+    while (at < length && IsSpace(header[at])) at++;
+    if (at < length && header[at] == '"') {
+      size_t value_begin = ++at;
+      while (at < length && header[at] != '"') {
+        if (header[at] == '\\' && at + 1 < length) at++;
+        at++;
+      }
+      *value = header.substr(value_begin, at - value_begin);
+      while (at < length && header[at] != ';') at++;
+    } else {
+      size_t value_begin = at;
+      while (at < length && header[at] != ';') at++;
+      *value = Trim(header.substr(value_begin, at - value_begin));
+    }
+  }
+  *pos = at;
+  return true;
+}
+
+// Collects the parts of a body parsed in one piece, where every part's
+// content arrives as a single view into the body
+class FieldCollector : public MultipartSink {
+public:
+  explicit FieldCollector(std::vector<MultipartField> *fields)
+      : fields_(fields) {}
+
+  void OnPartBegin(const MultipartPart &part) override {
+    fields_->push_back(MultipartField{part, std::string_view()});
+  }
+  void OnPartData(std::string_view data) override {
+    fields_->back().content = data;
+  }
+  void OnPartEnd() override {}
+
+private:
+  std::vector<MultipartField> *fields_;
+};
+
+}  // namespace
+
+bool UrlEncodedParser::Next(FormField *field) {
+  while (pos_ < body_.length()) {
+    size_t end = scan::FindByte(body_.data() + pos_, body_.length() - pos_,
+                                '&');
+    end = end == scan::kNotFound ? body_.length() : pos_ + end;
+    std::string_view pair = body_.substr(pos_, end - pos_);
+    pos_ = end + 1;
+    if (pair.empty()) continue;  // "a=1&&b=2"
+
+    size_t equals = scan::FindByte(pair.data(), pair.length(), '=');
+    if (equals == scan::kNotFound) {
+      field->name = pair;
+      field->value = std::string_view();
+    } else {
+      field->name = pair.substr(0, equals);
+      field->value = pair.substr(equals + 1);
+    }
+    return true;
+  }
+  return false;
+}
+
+std::optional<std::string_view> FindFormField(std::string_view body,
+                                              std::string_view name) {
+  UrlEncodedParser parser(body);
+  FormField field;
+  while (parser.Next(&field)) {
+    if (field.name == name) return field.value;
+  }
+  return std::nullopt;
+}
+
+size_t PercentDecode(std::string_view value, char *out) {
+  size_t length = 0;
+  for (size_t i = 0; i < value.length(); i++) {
+    char c = value[i];
+    if (c == '+') {
+      c = ' ';
+    } else if (c == '%' && i + 2 < value.length()) {
+      int high = HexValue(value[i + 1]), low = HexValue(value[i + 2]);
+      if (high >= 0 && low >= 0) {
+        c = static_cast<char>(high << 4 | low);
+        i += 2;
+      }
+    }
+    out[length++] = c;
+  }
+  return length;
+}
+
+std::string_view PercentDecode(std::string_view value,
+                               std::pmr::memory_resource *resource) {
+  if (value.find_first_of("%+") == std::string_view::npos) return value;
+  char *out = static_cast<char *>(resource->allocate(value.length(), 1));
+  return std::string_view(out, PercentDecode(value, out));
+}
+
+std::string_view MultipartBoundary(std::string_view content_type) {
+  size_t pos = content_type.find(';');
+  if (pos == std::string_view::npos) return std::string_view();
+  std::string_view name, value;
+  while (NextParameter(content_type, &pos, &name, &value)) {
+    if (EqualsIgnoreCase(name, "boundary")) {
+      if (value.empty() || value.length() > kMaxBoundaryLength) break;
+      return value;
+    }
+  }
+  return std::string_view();
+}
+
+MultipartParser::MultipartParser(std::string_view boundary,
+                                 MultipartSink *sink)
+    : sink_(sink), state_(State::Preamble) {
+  if (boundary.empty() || boundary.length() > kMaxBoundaryLength) {
+    throw std::invalid_argument("Invalid multipart boundary");
+  }
+  delimiter_ = "\r\n--";
+  delimiter_.append(boundary.data(), boundary.length());
+}
+
+void MultipartParser::Feed(std::string_view data) {
+  if (!pending_.empty()) {
+    // Decide the held bytes with as much of `data` as that can take, then
+    // go on with the rest of `data` in place. Only part headers need more
+    // than a delimiter and some padding.
+    size_t held = pending_.length();
+    size_t lookahead = delimiter_.length() + 64;
+    if (state_ == State::Headers) lookahead += kMaxPartHeaders;
+    lookahead = std::min(data.length(), lookahead);
+    pending_.append(data.data(), lookahead);
+    size_t consumed = Consume(pending_.data(), pending_.length());
+    if (consumed < held) {
+      pending_.erase(0, consumed);
+      pending_.append(data.data() + lookahead, data.length() - lookahead);
+      return;
+    }
+    data.remove_prefix(consumed - held);
+    pending_.clear();
+  }
+  size_t consumed = Consume(data.data(), data.length());
+  pending_.assign(data.data() + consumed, data.length() - consumed);
+}
+
+// Parses as much of `data` as can be decided, and returns how much that was
+size_t MultipartParser::Consume(const char *data, size_t length) {
+  const size_t delimiter_length = delimiter_.length();
+  size_t pos = 0;
+  while (true) {
+    switch (state_) {
+      case State::Preamble: {
+        // The first boundary may open the body, without a CRLF before it
+        const char *dash_boundary = delimiter_.data() + 2;
+        size_t dash_boundary_length = delimiter_length - 2;
+        size_t found = scan::FindSubstring(data + pos, length - pos,
+                                           dash_boundary,
+                                           dash_boundary_length);
+        if (found == scan::kNotFound) {
+          if (length - pos >= dash_boundary_length) {
+            pos = length - (dash_boundary_length - 1);
+          }
+          return pos;
+        }
+        pos += found + dash_boundary_length;
+        state_ = State::Boundary;
+        break;
+      }
+      case State::Boundary: {
+        // "--" closes the body, CRLF starts a part. RFC 2046 allows
+        // whitespace before either.
+        size_t at = pos;
+        while (at < length && IsSpace(data[at])) at++;
+        if (at - pos > 64) {
+          throw std::invalid_argument("Malformed multipart boundary");
+        }
+        if (length - at < 2) return pos;
+        if (data[at] == '-' && data[at + 1] == '-') {
+          state_ = State::Epilogue;
+        } else if (data[at] == '\r' && data[at + 1] == '\n') {
+          state_ = State::Headers;
+        } else {
+          throw std::invalid_argument("Malformed multipart boundary");
+        }
+        pos = at + 2;
+        break;
+      }
+      case State::Headers: {
+        if (length - pos >= 2 && data[pos] == '\r' && data[pos + 1] == '\n') {
+          ParsePartHeaders(std::string_view());
+          pos += 2;
+          state_ = State::Content;
+          break;
+        }
+        size_t end = scan::FindHeaderEnd(data + pos, length - pos);
+        if (end == scan::kNotFound) {
+          if (length - pos > kMaxPartHeaders) {
+            throw std::invalid_argument("Multipart part headers too long");
+          }
+          return pos;
+        }
+        if (end > kMaxPartHeaders) {
+          throw std::invalid_argument("Multipart part headers too long");
+        }
+        ParsePartHeaders(std::string_view(data + pos, end + 2));
+        pos += end + 4;
+        state_ = State::Content;
+        break;
+      }
+      case State::Content: {
+        size_t found = scan::FindSubstring(data + pos, length - pos,
+                                           delimiter_.data(),
+                                           delimiter_length);
+        if (found == scan::kNotFound) {
+          // The last bytes may be the start of the delimiter
+          if (length - pos >= delimiter_length) {
+            size_t safe = length - pos - (delimiter_length - 1);
+            sink_->OnPartData(std::string_view(data + pos, safe));
+            pos += safe;
+          }
+          return pos;
+        }
+        if (found > 0) sink_->OnPartData(std::string_view(data + pos, found));
+        sink_->OnPartEnd();
+        pos += found + delimiter_length;
+        state_ = State::Boundary;
+        break;
+      }
+      case State::Epilogue:
+        return length;
+    }
+  }
+}
+
+// `headers` holds complete lines, each ending with CRLF
+void MultipartParser::ParsePartHeaders(std::string_view headers) {
+  MultipartPart part;
+  size_t pos = 0;
+  while (pos < headers.length()) {
+    size_t end = scan::FindCrlf(headers.data() + pos, headers.length() - pos);
+    if (end == scan::kNotFound) break;
+    std::string_view line = headers.substr(pos, end);
+    pos += end + 2;
+
+    size_t colon = scan::FindByte(line.data(), line.length(), ':');
+    if (colon == scan::kNotFound) {
+      throw std::invalid_argument("Invalid multipart header field");
+    }
+    std::string_view name = line.substr(0, colon);
+    std::string_view value = Trim(line.substr(colon + 1));
+    if (EqualsIgnoreCase(name, "Content-Disposition")) {
+      size_t parameter = value.find(';');
+      std::string_view parameter_name, parameter_value;
+      while (parameter != std::string_view::npos &&
+             NextParameter(value, &parameter, &parameter_name,
+                           &parameter_value)) {
+        if (EqualsIgnoreCase(parameter_name, "name")) {
+          part.name = parameter_value;
+        } else if (EqualsIgnoreCase(parameter_name, "filename")) {
+          part.filename = parameter_value;
+        }
+      }
+    } else if (EqualsIgnoreCase(name, "Content-Type")) {
+      part.content_type = value;
+    }
+  }
+  sink_->OnPartBegin(part);
+}
+
+std::vector<MultipartField> ParseMultipartForm(std::string_view body,
+                                               std::string_view boundary) {
+  std::vector<MultipartField> fields;
+  FieldCollector collector(&fields);
+  MultipartParser parser(boundary, &collector);
+  parser.Feed(body);
+  if (!parser.done()) {
+    throw std::invalid_argument("Truncated multipart body");
+  }
+  return fields;
+}
+
+}  // namespace high_performance_server
@@ -0,0 +1,119 @@
+// Parsers for HTML form bodies: application/x-www-form-urlencoded and
+// multipart/form-data. Fields are views into the body rather than copies,
+// and values are only percent-decoded when asked for. The multipart parser
+// takes the body in pieces of any size and streams the content of each part
+// to a sink, so file uploads never need to be held whole.
+
+#ifndef FORM_H_
+#define FORM_H_
+
+#include <cstddef>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace high_performance_server {
+
+// One field of a urlencoded body, still encoded
+struct FormField {
+  std::string_view name;
+  std::string_view value;
+};
+
+// Walks "name=value&name=value" one field at a time, without allocating
+class UrlEncodedParser {
+public:
+  explicit UrlEncodedParser(std::string_view body) : body_(body), pos_(0) {}
+
+  // Stores the next field in `field`. Returns false once there is none.
+  bool Next(FormField *field);
+
+private:
+  std::string_view body_;
+  size_t pos_;
+};
+
+// The still-encoded value of the first field called `name`, compared as
+// sent
+std::optional<std::string_view> FindFormField(std::string_view body,
+                                              std::string_view name);
+
+// Decodes "%XX" escapes and '+' into `out`, which must have room for
+// value.length() bytes. Returns the decoded length. Malformed escapes are
+// kept as they are.
+size_t PercentDecode(std::string_view value, char *out);
+// `value` itself when it has nothing to decode. Otherwise a decoded copy in
+// memory from `resource` that is never freed on its own, so `resource`
+// should be a request arena (RequestContext::resource()).
+std::string_view PercentDecode(std::string_view value,
+                               std::pmr::memory_resource *resource);
+
+// The boundary parameter of a multipart Content-Type header, empty if there
+// is none
+std::string_view MultipartBoundary(std::string_view content_type);
+
+// Headers of one part of a multipart/form-data body
+struct MultipartPart {
+  std::string_view name;
+  std::string_view filename;  // empty unless the part is a file
+  std::string_view content_type;
+};
+
+// Receives the parts of a multipart body as it is parsed. Views passed to
+// the sink are only valid during the call.
+class MultipartSink {
+public:
+  virtual ~MultipartSink() = default;
+
+  virtual void OnPartBegin(const MultipartPart &part) = 0;
+  // The next piece of the current part's content. A part may arrive in any
+  // number of pieces, including none.
+  virtual void OnPartData(std::string_view data) = 0;
+  virtual void OnPartEnd() = 0;
+};
+
+class MultipartParser {
+public:
+  // `boundary` as returned by MultipartBoundary(), at most 70 bytes
+  MultipartParser(std::string_view boundary, MultipartSink *sink);
+
+  // Parses the next piece of the body. The few bytes at the end of a piece
+  // that could be the start of a boundary, or an incomplete block of part
+  // headers, are kept until the next call; everything else reaches the sink
+  // straight from `data`. Throws std::invalid_argument on a malformed body.
+  void Feed(std::string_view data);
+
+  // Whether the closing boundary has been parsed
+  bool done() const { return state_ == State::Epilogue; }
+
+  // Part headers bigger than this are refused
+  static constexpr size_t kMaxPartHeaders = 8192;
+
+private:
+  enum class State { Preamble, Boundary, Headers, Content, Epilogue };
+
+  std::string delimiter_;  // "\r\n--" boundary
+  MultipartSink *sink_;
+  State state_;
+  std::string pending_;  // undecided bytes of the previous pieces
+
+  size_t Consume(const char *data, size_t length);
+  void ParsePartHeaders(std::string_view headers);
+};
+
+// A field of a multipart body that was parsed whole
+struct MultipartField {
+  MultipartPart part;
+  std::string_view content;
+};
+
+// Parses a complete multipart body. The views point into `body`. Throws
+// std::invalid_argument if the body is malformed or truncated.
+std::vector<MultipartField> ParseMultipartForm(std::string_view body,
+                                               std::string_view boundary);
+
+}  // namespace high_performance_server
+
+#endif  // FORM_H_
@@ -2,14 +2,18 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cstdint>
 #include <iterator>
 #include <map>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <utility>
 
+#include "simd_scan.h"
+
 namespace high_performance_server {
 
 std::string to_string(HttpMethod method) {
@@ -72,52 +76,82 @@ std::string to_string(HttpStatusCode status_code) {
       return "Not Found";
     case HttpStatusCode::MethodNotAllowed:
       return "Method Not Allowed";
+    case HttpStatusCode::RequestTimeout:
+      return "Request Timeout";
     case HttpStatusCode::ImATeapot:
       return "I'm a Teapot";
+    case HttpStatusCode::TooManyRequests:
+      return "Too Many Requests";
     case HttpStatusCode::InternalServerError:
       return "Internal Server Error";
     case HttpStatusCode::NotImplemented:
       return "Not Implemented";
     case HttpStatusCode::BadGateway:
       return "Bad Gateway";
+    case HttpStatusCode::ServiceUnvailable:
+      return "Service Unavailable";
+    case HttpStatusCode::GatewayTimeout:
+      return "Gateway Timeout";
     default:
       return std::string();
   }
 }
 
-HttpMethod string_to_method(const std::string& method_string) {
-  std::string method_string_uppercase;
-  std::transform(method_string.begin(), method_string.end(),
-                 std::back_inserter(method_string_uppercase),
-                 [](char c) { return toupper(c); });
-  if (method_string_uppercase == "GET") {
-    return HttpMethod::GET;
-  } else if (method_string_uppercase == "HEAD") {
-    return HttpMethod::HEAD;
-  } else if (method_string_uppercase == "POST") {
-    return HttpMethod::POST;
-  } else if (method_string_uppercase == "PUT") {
-    return HttpMethod::PUT;
-  } else if (method_string_uppercase == "DELETE") {
-    return HttpMethod::DELETE;
-  } else if (method_string_uppercase == "CONNECT") {
-    return HttpMethod::CONNECT;
-  } else if (method_string_uppercase == "OPTIONS") {
-    return HttpMethod::OPTIONS;
-  } else if (method_string_uppercase == "TRACE") {
-    return HttpMethod::TRACE;
-  } else if (method_string_uppercase == "PATCH") {
-    return HttpMethod::PATCH;
-  } else {
+namespace {
+
+// Methods are at most 7 bytes long, so each one is a single packed word. Its
+// length goes in the top byte: packing pads with zeros, and "GET\0" must not
+// match "GET".
+constexpr std::uint64_t MethodKey(std::uint64_t packed, size_t length) {
+  return packed | static_cast<std::uint64_t>(length) << 56;
+}
+
+template <size_t N>
+constexpr std::uint64_t MethodKey(const char (&name)[N]) {
+  return MethodKey(scan::PackLiteral(name, N - 1), N - 1);
+}
+
+}  // namespace
+
+HttpMethod string_to_method(std::string_view method_string) {
+  if (method_string.length() > 7) {
     throw std::invalid_argument("Unexpected HTTP method");
   }
+  switch (MethodKey(
+      scan::PackUpper(method_string.data(), method_string.length()),
+      method_string.length())) {
+    case MethodKey("GET"):
+      return HttpMethod::GET;
+    case MethodKey("HEAD"):
+      return HttpMethod::HEAD;
+    case MethodKey("POST"):
+      return HttpMethod::POST;
+    case MethodKey("PUT"):
+      return HttpMethod::PUT;
+    case MethodKey("DELETE"):
+      return HttpMethod::DELETE;
+    case MethodKey("CONNECT"):
+      return HttpMethod::CONNECT;
+    case MethodKey("OPTIONS"):
+      return HttpMethod::OPTIONS;
+    case MethodKey("TRACE"):
+      return HttpMethod::TRACE;
+    case MethodKey("PATCH"):
+      return HttpMethod::PATCH;
+    default:
+      throw std::invalid_argument("Unexpected HTTP method");
+  }
 }
 
-HttpVersion string_to_version(const std::string& version_string) {
-  std::string version_string_uppercase;
-  std::transform(version_string.begin(), version_string.end(),
-                 std::back_inserter(version_string_uppercase),
-                 [](char c) { return toupper(c); });
+HttpVersion string_to_version(std::string_view version_string) {
+  char uppercase[8];
+  if (version_string.length() > sizeof(uppercase)) {
+    throw std::invalid_argument("Unexpected HTTP version");
+  }
+  std::copy(version_string.begin(), version_string.end(), uppercase);
+  scan::ToUpperAscii(uppercase, version_string.length());
+  std::string_view version_string_uppercase(uppercase,
+                                            version_string.length());
   if (version_string_uppercase == "HTTP/0.9") {
     return HttpVersion::HTTP_0_9;
   } else if (version_string_uppercase == "HTTP/1.0") {
@@ -160,62 +194,85 @@ std::string toString(const HttpResponse& response, bool send_content) {
   return oss.str();
 }
 
-HttpRequest stringToRequest(const std::string& request_string) {
-  std::string start_line, header_lines, message_body;
-  std::istringstream iss;
-  HttpRequest request;
-  std::string line, method, path, version;  // used for first line
-  std::string key, value;                   // used for header fields
-  Uri uri;
-  size_t left_pos = 0, right_pos = 0;
-
-  right_pos = request_string.find("\r\n", left_pos);
-  if (right_pos == std::string::npos) {
+namespace {
+
+// The next word of the start line, after `*pos`. Empty when there is none.
+std::string_view NextWord(std::string_view line, size_t* pos) {
+  while (*pos < line.length() && (line[*pos] == ' ' || line[*pos] == '\t'))
+    ++*pos;
+  size_t begin = *pos;
+  while (*pos < line.length() && line[*pos] != ' ' && line[*pos] != '\t')
+    ++*pos;
+  return line.substr(begin, *pos - begin);
+}
+
+}  // namespace
+
+HttpRequest stringToRequest(std::string_view request_string,
+                            std::pmr::memory_resource* resource) {
+  const char* data = request_string.data();
+  const size_t length = request_string.length();
+  std::string_view start_line;
+  HttpRequest request(resource);
+  size_t left_pos = 0, right_pos = 0, header_end = 0;
+
+  right_pos = scan::FindCrlf(data, length);
+  if (right_pos == scan::kNotFound) {
     throw std::invalid_argument("Could not find request start line");
   }
 
-  start_line = request_string.substr(left_pos, right_pos - left_pos);
+  start_line = request_string.substr(0, right_pos);
   left_pos = right_pos + 2;
-  right_pos = request_string.find("\r\n\r\n", left_pos);
-  if (right_pos != std::string::npos) {  // has header
-    header_lines = request_string.substr(left_pos, right_pos - left_pos);
-    left_pos = right_pos + 4;
-    right_pos = request_string.length();
-    if (left_pos < right_pos) {
-      message_body = request_string.substr(left_pos, right_pos - left_pos);
-    }
-  }
+  // The header block ends at the first empty line, so searching from the
+  // end of the start line also finds it when there are no headers at all
+  header_end = scan::FindHeaderEnd(data + right_pos, length - right_pos);
+  if (header_end != scan::kNotFound) header_end += right_pos;
 
-  iss.clear();  // parse the start line
-  iss.str(start_line);
-  iss >> method >> path >> version;
-  if (!iss.good() && !iss.eof()) {
-    throw std::invalid_argument("Invalid start line format");
-  }
+  size_t word_pos = 0;  // parse the start line
+  std::string_view method = NextWord(start_line, &word_pos);
+  std::string_view path = NextWord(start_line, &word_pos);
+  std::string_view version = NextWord(start_line, &word_pos);
   request.SetMethod(string_to_method(method));
-  request.SetUri(Uri(path));
+  request.SetUri(Uri(std::string(path)));
   if (string_to_version(version) != request.version()) {
     throw std::logic_error("HTTP version not supported");
   }
+  if (header_end == scan::kNotFound) {
+    request.SetContent(std::string_view());
+    return request;
+  }
+
+  // parse header fields, one "name: value" line at a time
+  while (left_pos < header_end + 2) {
+    right_pos = scan::FindCrlf(data + left_pos, header_end + 2 - left_pos) +
+                left_pos;
+    const char* line = data + left_pos;
+    size_t line_length = right_pos - left_pos;
+    left_pos = right_pos + 2;
 
-  iss.clear();  // parse header fields
-  iss.str(header_lines);
-  while (std::getline(iss, line)) {
-    std::istringstream header_stream(line);
-    std::getline(header_stream, key, ':');
-    std::getline(header_stream, value);
-
-    // remove whitespaces from the two strings
-    key.erase(std::remove_if(key.begin(), key.end(),
-                             [](char c) { return std::isspace(c); }),
-              key.end());
-    value.erase(std::remove_if(value.begin(), value.end(),
-                               [](char c) { return std::isspace(c); }),
-                value.end());
-    request.SetHeader(key, value);
+    size_t colon = scan::FindByte(line, line_length, ':');
+    if (colon == scan::kNotFound || !scan::IsToken(line, colon)) {
+      throw std::invalid_argument("Invalid header field");
+    }
+    // remove the optional whitespace around the field value
+    size_t value_begin = colon + 1, value_end = line_length;
+    while (value_begin < value_end &&
+           (line[value_begin] == ' ' || line[value_begin] == '\t'))
+      value_begin++;
+    while (value_end > value_begin &&
+           (line[value_end - 1] == ' ' || line[value_end - 1] == '\t'))
+      value_end--;
+    request.SetHeader(std::string_view(line, colon),
+                      std::string_view(line + value_begin,
+                                       value_end - value_begin));
   }
 
-  request.SetContent(message_body);
+  left_pos = header_end + 4;
+  if (left_pos < length) {
+    request.SetContent(request_string.substr(left_pos));
+  } else {
+    request.SetContent(std::string_view());
+  }
 
   return request;
 }
@@ -4,14 +4,19 @@
 #ifndef HTTP_MESSAGE_H_
 #define HTTP_MESSAGE_H_
 
+#include <functional>
 #include <map>
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <utility>
 
 #include "uri.h"
 
 namespace high_performance_server {
 
+struct PeerAddress;
+
 // HTTP methods defined in the following document:
 // https://developer.mozilla.org/en-US/docs/Web/HTTP/Methods
 enum class HttpMethod {
@@ -59,6 +64,7 @@ enum class HttpStatusCode {
   MethodNotAllowed = 405,
   RequestTimeout = 408,
   ImATeapot = 418,
+  TooManyRequests = 429,
   InternalServerError = 500,
   NotImplemented = 501,
   BadGateway = 502,
@@ -71,23 +77,54 @@ enum class HttpStatusCode {
 std::string to_string(HttpMethod method);
 std::string to_string(HttpVersion version);
 std::string to_string(HttpStatusCode status_code);
-HttpMethod string_to_method(const std::string& method_string);
-HttpVersion string_to_version(const std::string& version_string);
+HttpMethod string_to_method(std::string_view method_string);
+HttpVersion string_to_version(std::string_view version_string);
+
+using HttpHeaders =
+    std::pmr::map<std::pmr::string, std::pmr::string, std::less<>>;
 
 // Defines the common interface of an HTTP request and HTTP response.
 // Each message will have an HTTP version, collection of header fields,
 // and message content. The collection of headers and content can be empty.
+// Headers and content are allocated from the memory resource the message is
+// constructed with, e.g. the request arena of a RequestContext. Copies use
+// the default resource, so they may outlive the request.
 class HttpMessageInterface {
  public:
-  HttpMessageInterface() : version_(HttpVersion::HTTP_1_1) {}
+  explicit HttpMessageInterface(
+      std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+      : version_(HttpVersion::HTTP_1_1), headers_(resource),
+        content_(resource) {}
   virtual ~HttpMessageInterface() = default;
 
-  void SetHeader(const std::string& key, const std::string& value) {
-    headers_[key] = std::move(value);
+  HttpMessageInterface(const HttpMessageInterface&) = default;
+  HttpMessageInterface(HttpMessageInterface&&) = default;
+  HttpMessageInterface& operator=(const HttpMessageInterface&) = default;
+  HttpMessageInterface& operator=(HttpMessageInterface&&) = default;
+
+  void SetHeader(std::string_view key, std::string_view value) {
+    auto it = headers_.find(key);
+    if (it != headers_.end()) {
+      it->second.assign(value);
+    } else {
+      headers_.emplace(key, value);
+    }
+  }
+  void RemoveHeader(std::string_view key) {
+    auto it = headers_.find(key);
+    if (it != headers_.end()) headers_.erase(it);
   }
-  void RemoveHeader(const std::string& key) { headers_.erase(key); }
   void ClearHeader() { headers_.clear(); }
-  void SetContent(const std::string& content) {
+  void SetContent(std::string_view content) {
+    content_.assign(content);
+    SetContentLength();
+  }
+  void SetContent(const char* content) {
+    SetContent(std::string_view(content));
+  }
+  // Takes the string over without copying when it was built from the same
+  // memory resource as the message
+  void SetContent(std::pmr::string&& content) {
     content_ = std::move(content);
     SetContentLength();
   }
@@ -97,18 +134,23 @@ class HttpMessageInterface {
   }
 
   HttpVersion version() const { return version_; }
-  std::string header(const std::string& key) const {
-    if (headers_.count(key) > 0) return headers_.at(key);
-    return std::string();
+  // Empty if the header is absent
+  std::string_view header(std::string_view key) const {
+    auto it = headers_.find(key);
+    if (it != headers_.end()) return it->second;
+    return std::string_view();
   }
-  std::map<std::string, std::string> headers() const { return headers_; }
-  std::string content() const { return content_; }
+  const HttpHeaders& headers() const { return headers_; }
+  const std::pmr::string& content() const { return content_; }
   size_t content_length() const { return content_.length(); }
+  std::pmr::memory_resource* resource() const {
+    return headers_.get_allocator().resource();
+  }
 
  protected:
   HttpVersion version_;
-  std::map<std::string, std::string> headers_;
-  std::string content_;
+  HttpHeaders headers_;
+  std::pmr::string content_;
 
   void SetContentLength() {
     SetHeader("Content-Length", std::to_string(content_.length()));
@@ -120,21 +162,32 @@ class HttpMessageInterface {
 // the corresponding resource and action
 class HttpRequest : public HttpMessageInterface {
  public:
-  HttpRequest() : method_(HttpMethod::GET) {}
+  explicit HttpRequest(
+      std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+      : HttpMessageInterface(resource), method_(HttpMethod::GET),
+        peer_address_(nullptr) {}
   ~HttpRequest() = default;
 
   void SetMethod(HttpMethod method) { method_ = method; }
   void SetUri(const Uri& uri) { uri_ = std::move(uri); }
+  void SetPeerAddress(const PeerAddress* peer_address) {
+    peer_address_ = peer_address;
+  }
 
   HttpMethod method() const { return method_; }
-  Uri uri() const { return uri_; }
+  const Uri& uri() const { return uri_; }
+  // The client that sent the request, owned by its connection. Null for
+  // requests that did not come from a connection.
+  const PeerAddress* peer_address() const { return peer_address_; }
 
   friend std::string toString(const HttpRequest& request);
-  friend HttpRequest stringToRequest(const std::string& request_string);
+  friend HttpRequest stringToRequest(std::string_view request_string,
+                                     std::pmr::memory_resource* resource);
 
  private:
   HttpMethod method_;
   Uri uri_;
+  const PeerAddress* peer_address_;
 };
 
 // An HTTPResponse object represents a single HTTP response
@@ -143,7 +196,10 @@ class HttpRequest : public HttpMessageInterface {
 class HttpResponse : public HttpMessageInterface {
  public:
   HttpResponse() : status_code_(HttpStatusCode::Ok) {}
-  HttpResponse(HttpStatusCode status_code) : status_code_(status_code) {}
+  HttpResponse(
+      HttpStatusCode status_code,
+      std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+      : HttpMessageInterface(resource), status_code_(status_code) {}
   ~HttpResponse() = default;
 
   void SetStatusCode(HttpStatusCode status_code) { status_code_ = status_code; }
@@ -160,7 +216,9 @@ class HttpResponse : public HttpMessageInterface {
 // Utility functions to convert HTTP message objects to string and vice versa
 std::string toString(const HttpRequest& request);
 std::string toString(const HttpResponse& response, bool send_content = true);
-HttpRequest stringToRequest(const std::string& request_string);
+HttpRequest stringToRequest(
+    std::string_view request_string,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 HttpResponse stringToResponse(const std::string& response_string);
 
 }  // namespace high_performance_server
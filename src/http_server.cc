@@ -1,58 +1,384 @@
 #include "http_server.h"
 
 #include <arpa/inet.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <strings.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <charconv>
+#include <cmath>
 #include <chrono>
 #include <cstring>
 #include <functional>
 #include <map>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 
 #include "http_message.h"
+#include "response_writer.h"
 #include "uri.h"
 
+// Tracing hooks cost nothing unless tracing is built in, and a branch
+// unless it is enabled. Each is one statement, safe before an else.
+#ifdef HIGH_PERFORMANCE_SERVER_TRACING
+#define TRACE(...)   \
+  do {               \
+    if (tracer_) {   \
+      __VA_ARGS__;   \
+    }                \
+  } while (0)
+#else
+#define TRACE(...) \
+  do {             \
+  } while (0)
+#endif
+
 namespace high_performance_server {
 
+namespace {
+
+// Counters written by a single thread and read by others need no atomic
+// read-modify-write, only a store that readers cannot see torn
+template <typename T>
+void AddSingleWriter(std::atomic<T> &counter, T delta) {
+  counter.store(counter.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+}
+
+// Workers this busy or less never give connections away
+constexpr int kMinMigrationBusyPermille = 200;
+// Workers whose busy time differs by less than this are considered equally
+// busy, so that new connections do not all go to one worker between two
+// load measurements
+constexpr int kBusyPermilleResolution = 50;
+// Connections stay registered for both directions from accept to close, so
+// serving a request takes no epoll_ctl call. Edge-triggered events only
+// report changes, which the worker then handles to completion.
+constexpr std::uint32_t kConnectionEvents =
+    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+// Output blocks sent by one sendmsg, 256 KiB
+constexpr int kMaxSendBlocks = 16;
+// Events sent to a subscriber by one sendmsg
+constexpr int kMaxSendEvents = 64;
+
+std::uint64_t NowMilliseconds() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Canned 429 answer, asking the client to wait for about one token
+std::string RateLimitedResponse(const RateLimitOptions &options) {
+  HttpResponse response(HttpStatusCode::TooManyRequests);
+  double wait = 1.0 / std::max(options.requests_per_second, 1e-3);
+  response.SetHeader("Retry-After",
+                     std::to_string(static_cast<long>(std::ceil(wait))));
+  response.SetContent(std::string());
+  return toString(response);
+}
+
+ssize_t Receive(EventData *data) {
+  if (data->tls) return data->tls->Read(data->buffer, kMaxBufferSize);
+  return recv(data->file_descriptor, data->buffer, kMaxBufferSize, 0);
+}
+
+// Once the kernel encrypts for a TLS connection, plaintext written to its
+// socket goes out as records, so only the handshake and connections without
+// kernel TLS need OpenSSL to write
+bool WritesThroughOpenSsl(const EventData *data) {
+  return data->tls && !data->tls->kernel_tls_send();
+}
+
+// Output goes out in one sendmsg however many blocks it spans, without
+// raising SIGPIPE when the client has gone. OpenSSL takes one buffer at a
+// time.
+ssize_t Send(EventData *data) {
+  if (WritesThroughOpenSsl(data)) {
+    std::string_view pending = data->output.Front();
+    return data->tls->Write(pending.data(), pending.length());
+  }
+  iovec vectors[kMaxSendBlocks];
+  msghdr message = {};
+  message.msg_iov = vectors;
+  message.msg_iovlen = data->output.Fill(vectors, kMaxSendBlocks);
+  return sendmsg(data->file_descriptor, &message, MSG_NOSIGNAL);
+}
+
+// The target in the request line of an unparsed request, or an empty view
+std::string_view RequestTarget(std::string_view request) {
+  size_t begin = request.find(' ');
+  if (begin == std::string_view::npos) return std::string_view();
+  while (begin < request.length() && request[begin] == ' ') begin++;
+  size_t end = request.find_first_of(" \r", begin);
+  if (end == std::string_view::npos) return std::string_view();
+  return request.substr(begin, end - begin);
+}
+
+bool WantsClose(const HttpRequest &request) {
+  std::string_view connection = request.header("Connection");
+  return connection.length() == 5 &&
+         strncasecmp(connection.data(), "close", 5) == 0;
+}
+
+// Answer to a request that ran out of time, with a body the client can
+// tell the end of on a kept-alive connection
+HttpResponse TimeoutResponse(HttpStatusCode status,
+                             std::pmr::memory_resource *resource) {
+  HttpResponse response(status, resource);
+  response.SetContent(std::string_view());
+  return response;
+}
+
+// Longest deadline a client may ask for. Longer ones are cut to it, which
+// also keeps the deadline within the range of a time_point.
+constexpr std::chrono::milliseconds kMaxRequestedTimeout =
+    std::chrono::hours(24);
+
+// A timeout header: a whole number of milliseconds
+std::chrono::milliseconds ParseTimeout(std::string_view value) {
+  std::int64_t milliseconds = 0;
+  auto result =
+      std::from_chars(value.data(), value.data() + value.length(), milliseconds);
+  if (result.ec != std::errc() || result.ptr != value.data() + value.length() ||
+      milliseconds < 0) {
+    throw std::invalid_argument("Invalid request timeout");
+  }
+  return std::min(std::chrono::milliseconds(milliseconds),
+                  kMaxRequestedTimeout);
+}
+
+std::vector<std::unique_ptr<Socket>> MakeSockets(
+    const std::vector<ListenEndpoint> &endpoints) {
+  std::vector<std::unique_ptr<Socket>> sockets;
+  for (const ListenEndpoint &endpoint : endpoints) {
+    sockets.push_back(std::make_unique<Socket>(endpoint));
+  }
+  return sockets;
+}
+
+std::vector<std::unique_ptr<Socket>> AdoptSockets(
+    const std::vector<int> &listener_fds,
+    const std::vector<ListenEndpoint> &endpoints) {
+  std::vector<std::unique_ptr<Socket>> sockets;
+  for (int fd : listener_fds) {
+    auto endpoint = std::find_if(
+        endpoints.begin(), endpoints.end(),
+        [fd](const ListenEndpoint &endpoint) { return endpoint.BoundTo(fd); });
+    if (endpoint == endpoints.end()) {
+      sockets.push_back(std::make_unique<Socket>(fd));
+    } else {
+      sockets.push_back(std::make_unique<Socket>(fd, *endpoint));
+    }
+  }
+  return sockets;
+}
+
+}  // namespace
+
 HttpServer::HttpServer(const std::string &host, std::uint16_t port)
-    : running_(false), worker_epoll_fd_(),
+    : HttpServer(MakeSockets({ListenEndpoint::Tcp(host, port)})) {}
+
+HttpServer::HttpServer(const std::vector<ListenEndpoint> &endpoints)
+    : HttpServer(MakeSockets(endpoints)) {}
+
+HttpServer::HttpServer(int listener_fd)
+    : HttpServer(AdoptSockets({listener_fd}, {})) {}
+
+HttpServer::HttpServer(const std::vector<int> &listener_fds)
+    : HttpServer(AdoptSockets(listener_fds, {})) {}
+
+HttpServer::HttpServer(const std::vector<int> &listener_fds,
+                       const std::vector<ListenEndpoint> &endpoints)
+    : HttpServer(AdoptSockets(listener_fds, endpoints)) {}
+
+HttpServer::HttpServer(std::vector<std::unique_ptr<Socket>> sockets)
+    : sockets_(std::move(sockets)), running_(false),
+      accepting_(false), draining_(false), active_connections_(0),
+      requests_in_flight_(0), requests_shed_(0), accept_pauses_(0),
+      drain_timeout_(kDefaultDrainTimeout), worker_epoll_fd_(),
+      worker_connection_count_(), worker_requests_in_flight_(),
+      worker_busy_permille_(), worker_requests_(), worker_migrated_in_(),
+      worker_migrated_out_(), worker_epoll_waits_(), worker_epoll_ctls_(),
+      worker_receives_(), worker_sends_(), worker_priority_stats_(),
+      worker_busy_time_(), worker_drain_closed_(), worker_drain_target_(),
+      worker_subscribers_(),
+      requests_rate_limited_(0), requests_expired_(0), requests_cancelled_(0),
+      events_published_(0), events_dropped_(0), subscribers_disconnected_(0),
+      tls_handshakes_(0), tls_sessions_resumed_(0), tls_kernel_offloaded_(0),
+      tls_connections_failed_(0),
       random_generator_(std::chrono::steady_clock::now().time_since_epoch().count()),
-      sleep_times_(10, 100), socket_(std::make_unique<Socket>(host, port)) {}
+      sleep_times_(10, 100) {}
 
 void HttpServer::Start() {
-  if (!socket_->Start()) {
-    throw std::runtime_error("Failed to set socket");
+  for (auto &socket : sockets_) {
+    if (!socket->Start()) {
+      throw std::runtime_error("Failed to set socket: " + socket->error());
+    }
+  }
+
+  HttpResponse overload_response(HttpStatusCode::ServiceUnvailable);
+  overload_response.SetHeader(
+      "Retry-After", std::to_string(overload_options_.retry_after.count()));
+  overload_response.SetContent(std::string());
+  overload_response_ = toString(overload_response);
+  overload_response.SetHeader("Connection", "close");
+  overload_close_response_ = toString(overload_response);
+  priority_routes_.clear();
+  for (const auto &entry : request_handlers_) {
+    if (entry.second.priority != RequestPriority::Normal) {
+      priority_routes_.emplace_back(entry.first.path(), entry.second.priority);
+    }
+  }
+  for (int i = 0; i < kThreadPoolSize; i++) {
+    worker_shedders_[i] = LoadShedder(overload_options_);
+    worker_arenas_[i] = std::make_unique<RequestArena>(kArenaSize);
+    worker_output_pools_[i] = std::make_unique<BufferPool>();
+  }
+
+#ifdef HIGH_PERFORMANCE_SERVER_TRACING
+  if (trace_options_) {
+    tracer_ = std::make_unique<Tracer>(*trace_options_, kThreadPoolSize);
+  }
+#endif
+
+  if (access_log_options_) {
+    access_logger_ =
+        std::make_unique<AccessLogger>(*access_log_options_, kThreadPoolSize);
+    if (!access_logger_->Start()) {
+      throw std::runtime_error("Failed to open access log");
+    }
   }
 
   SetUpEpoll();
   running_ = true;
+  accepting_ = true;
   listener_thread_ = std::thread(&HttpServer::Listen, this);
   for (int i = 0; i < kThreadPoolSize; i++) {
     worker_threads_[i] = std::thread(&HttpServer::ProcessEvents, this, i);
   }
 }
 
-void HttpServer::Stop() {
-  running_ = false;
+void HttpServer::Stop(std::chrono::milliseconds drain_timeout) {
+  // Connections still in the kernel accept queue are left there, so that a
+  // process that took over the listening socket can accept them
+  accepting_ = false;
   listener_thread_.join();
+  for (int fd : listener_fds()) close(fd);
+
+  drain_timeout_ = drain_timeout;
+  drain_start_ = std::chrono::steady_clock::now();
+  draining_ = true;
+  auto deadline = drain_start_ + drain_timeout;
+  while (active_connections_ > 0 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  running_ = false;
   for (int i = 0; i < kThreadPoolSize; i++) {
     worker_threads_[i].join();
   }
   for (int i = 0; i < kThreadPoolSize; i++) {
+    RegisterPendingConnections(i);
+    while (!worker_connections_[i].empty()) {
+      CloseConnection(i, worker_connections_[i].begin()->second);
+    }
     close(worker_epoll_fd_[i]);
+    // Publish() checks running_ under the same lock, so nothing comes after
+    std::lock_guard<std::mutex> lock(worker_inbox_mutex_[i]);
+    for (EventMessage *message : worker_inbox_[i]) message->Unref();
+    worker_inbox_[i].clear();
+  }
+  if (access_logger_) access_logger_->Stop();
+}
+
+void HttpServer::SetRateLimit(const std::string &path,
+                              const RateLimitOptions &options) {
+  Route &route = request_handlers_[Uri(path)];
+  route.rate_limiter = std::make_unique<RateLimiter>(options);
+  route.rate_limited_response = RateLimitedResponse(options);
+}
+
+void HttpServer::SetRateLimit(const RateLimitOptions &options) {
+  rate_limiter_ = std::make_unique<RateLimiter>(options);
+  rate_limited_response_ = RateLimitedResponse(options);
+}
+
+std::vector<int> HttpServer::listener_fds() const {
+  std::vector<int> fds;
+  for (const auto &socket : sockets_) fds.push_back(socket->GetSocketFd());
+  return fds;
+}
+
+std::string HttpServer::ExportTrace() const {
+  if (tracer_) return tracer_->ExportChromeTrace();
+  return "{\"traceEvents\":[]}\n";
+}
+
+ServerStats HttpServer::stats() const {
+  ServerStats stats;
+  stats.connections = active_connections_;
+  stats.requests_in_flight = requests_in_flight_;
+  stats.requests_shed = requests_shed_;
+  stats.requests_rate_limited = requests_rate_limited_;
+  stats.requests_expired = requests_expired_;
+  stats.requests_cancelled = requests_cancelled_;
+  stats.subscribers = 0;
+  for (const auto &subscribers : worker_subscribers_) {
+    stats.subscribers += subscribers;
+  }
+  stats.events_published = events_published_;
+  stats.events_dropped = events_dropped_;
+  stats.subscribers_disconnected = subscribers_disconnected_;
+  stats.accept_pauses = accept_pauses_;
+  stats.access_log_written = access_logger_ ? access_logger_->written() : 0;
+  stats.access_log_dropped = access_logger_ ? access_logger_->dropped() : 0;
+  stats.tls_handshakes = tls_handshakes_;
+  stats.tls_sessions_resumed = tls_sessions_resumed_;
+  stats.tls_kernel_offloaded = tls_kernel_offloaded_;
+  stats.tls_connections_failed = tls_connections_failed_;
+  for (int priority = 0; priority < kRequestPriorities; priority++) {
+    PriorityStats &total = stats.priorities[priority];
+    total = PriorityStats();
+    for (int i = 0; i < kThreadPoolSize; i++) {
+      const PriorityCounters &counters = worker_priority_stats_[i][priority];
+      total.requests += counters.requests;
+      total.deferred += counters.deferred;
+      total.queue_ns_total += counters.queue_ns_total;
+      total.queue_ns_max = std::max<std::uint64_t>(total.queue_ns_max,
+                                                   counters.queue_ns_max);
+    }
+  }
+  for (int i = 0; i < kThreadPoolSize; i++) {
+    WorkerStats worker;
+    worker.connections = worker_connection_count_[i];
+    worker.requests_in_flight = worker_requests_in_flight_[i];
+    worker.busy = worker_busy_permille_[i] / 1000.0;
+    worker.requests = worker_requests_[i];
+    worker.connections_migrated_in = worker_migrated_in_[i];
+    worker.connections_migrated_out = worker_migrated_out_[i];
+    worker.epoll_waits = worker_epoll_waits_[i];
+    worker.epoll_ctls = worker_epoll_ctls_[i];
+    worker.receives = worker_receives_[i];
+    worker.sends = worker_sends_[i];
+    worker.arena_overflows =
+        worker_arenas_[i] ? worker_arenas_[i]->overflows() : 0;
+    stats.workers.push_back(worker);
   }
-  close(socket_->GetSocketFd());
+  return stats;
 }
 
 void HttpServer::SetUpEpoll() {
   for (int i = 0; i < kThreadPoolSize; i++) {
-    if ((worker_epoll_fd_[i] = epoll_create1(0)) < 0) {
+    if ((worker_epoll_fd_[i] = epoll_create1(EPOLL_CLOEXEC)) < 0) {
       throw std::runtime_error(
           "Failed to create epoll file descriptor for worker");
     }
@@ -61,19 +387,41 @@ void HttpServer::SetUpEpoll() {
 
 void HttpServer::Listen() {
   EventData *client_data;
-  sockaddr_in client_address;
-  socklen_t client_len = sizeof(client_address);
+  PeerAddress client_address;
   int client_fd;
+  Socket *listener;
+  size_t current_listener = 0;
   int current_worker = 0;
   bool active = true;
+  bool paused = false;
 
-  while (running_) {
+  while (accepting_) {
     if (!active) {
       std::this_thread::sleep_for(
           std::chrono::microseconds(sleep_times_(random_generator_)));
     }
-    client_fd = accept4(socket_->GetSocketFd(), (sockaddr *)&client_address,
-                        &client_len, SOCK_NONBLOCK);
+    // At a connection cap, leave new connections in the kernel backlog so
+    // that clients see backpressure instead of an overloaded server
+    int worker = NextWorker(current_worker);
+    if (worker < 0) {
+      if (!paused) accept_pauses_++;
+      paused = true;
+      active = false;
+      continue;
+    }
+    paused = false;
+
+    // Listeners take turns, so that a busy one cannot starve the others
+    client_fd = -1;
+    for (size_t i = 0; i < sockets_.size() && client_fd < 0; i++) {
+      listener = sockets_[current_listener].get();
+      current_listener = (current_listener + 1) % sockets_.size();
+      client_address.length = sizeof(client_address.storage);
+      client_fd = accept4(listener->GetSocketFd(),
+                          (sockaddr *)&client_address.storage,
+                          &client_address.length,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+    }
     if (client_fd < 0) {
       active = false;
       continue;
@@ -82,27 +430,112 @@ void HttpServer::Listen() {
     active = true;
     client_data = new EventData();
     client_data->file_descriptor = client_fd;
-    controlEpollEvent(worker_epoll_fd_[current_worker], EPOLL_CTL_ADD,
-                      client_fd, EPOLLIN, client_data);
-    current_worker++;
+    client_data->peer_address = client_address;
+    if (tls_context_ && listener->endpoint().options.tls) {
+      // Out of memory in OpenSSL costs this connection, not the listener
+      try {
+        client_data->tls =
+            std::make_unique<TlsConnection>(*tls_context_, client_fd);
+      } catch (const std::runtime_error &) {
+        tls_connections_failed_++;
+        delete client_data;
+        close(client_fd);
+        continue;
+      }
+    }
+    active_connections_++;
+    worker_connection_count_[worker]++;
+    {
+      std::lock_guard<std::mutex> lock(worker_pending_mutex_[worker]);
+      worker_pending_[worker].push_back(client_data);
+    }
+    current_worker = worker + 1;
     if (current_worker == HttpServer::kThreadPoolSize)
       current_worker = 0;
   }
 }
 
+// Round-robin from `current_worker`, skipping workers at their connection
+// cap, unless a load-aware balancing mode is set. Returns -1 when no new
+// connection should be accepted.
+int HttpServer::NextWorker(int current_worker) const {
+  const OverloadOptions &options = overload_options_;
+  if (options.max_connections > 0 &&
+      active_connections_ >= options.max_connections) {
+    return -1;
+  }
+  if (balancing_options_.mode != BalancingMode::RoundRobin) {
+    return LeastLoadedWorker(current_worker);
+  }
+  if (options.max_connections_per_worker <= 0) return current_worker;
+  for (int i = 0; i < kThreadPoolSize; i++) {
+    int worker = (current_worker + i) % kThreadPoolSize;
+    if (worker_connection_count_[worker] <
+        options.max_connections_per_worker) {
+      return worker;
+    }
+  }
+  return -1;
+}
+
+// Ties go to the first worker from `current_worker`, so that equally loaded
+// workers still take turns
+int HttpServer::LeastLoadedWorker(int current_worker) const {
+  const int cap = overload_options_.max_connections_per_worker;
+  int best = -1;
+  long best_load = 0;
+  for (int i = 0; i < kThreadPoolSize; i++) {
+    int worker = (current_worker + i) % kThreadPoolSize;
+    long connections = worker_connection_count_[worker];
+    if (cap > 0 && connections >= cap) continue;
+    long load = connections;
+    if (balancing_options_.mode == BalancingMode::LeastBusy) {
+      load += (worker_busy_permille_[worker] / kBusyPermilleResolution) *
+              (1L << 32);
+    }
+    if (best < 0 || load < best_load) {
+      best = worker;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
 void HttpServer::ProcessEvents(int worker_id) {
   EventData *data;
-  int epoll_fd = worker_epoll_fd_[worker_id];
   bool active = true;
 
+  worker_last_poll_[worker_id] = std::chrono::steady_clock::now();
+  worker_load_tick_[worker_id] = worker_last_poll_[worker_id];
+  TRACE(worker_poll_ticks_[worker_id] = Tracer::Now());
   while (running_) {
     if (!active) {
       std::this_thread::sleep_for(
           std::chrono::microseconds(sleep_times_(random_generator_)));
     }
+    RegisterPendingConnections(worker_id);
+    DeliverEvents(worker_id);
+    if (draining_) {
+      CloseIdleConnections(worker_id);
+    }
+    auto poll_time = std::chrono::steady_clock::now();
+    UpdateLoad(worker_id, poll_time);
+    TRACE(worker_queued_ticks_[worker_id] = worker_poll_ticks_[worker_id];
+          worker_poll_ticks_[worker_id] = Tracer::Now();
+          worker_trace_kept_[worker_id] = false);
+    AddSingleWriter<std::uint64_t>(worker_epoll_waits_[worker_id], 1);
     int num_events = epoll_wait(worker_epoll_fd_[worker_id],
                           worker_events_[worker_id], HttpServer::kMaxEvents, 0);
-    if (num_events <= 0) {
+    // Events returned now became ready after the previous poll at the
+    // earliest; that bounds how long their requests have been queued
+    worker_queued_since_[worker_id] = worker_last_poll_[worker_id];
+    worker_last_poll_[worker_id] = poll_time;
+    auto &queues = worker_queues_[worker_id];
+    if (num_events <= 0 && worker_ready_[worker_id].empty() &&
+        std::all_of(std::begin(queues), std::end(queues),
+                    [](const std::deque<EventData *> &queue) {
+                      return queue.empty();
+                    })) {
       active = false;
       continue;
     }
@@ -111,127 +544,849 @@ void HttpServer::ProcessEvents(int worker_id) {
     for (int i = 0; i < num_events; i++) {
       const epoll_event &current_event = worker_events_[worker_id][i];
       data = reinterpret_cast<EventData *>(current_event.data.ptr);
-      if ((current_event.events & EPOLLHUP) ||
-          (current_event.events & EPOLLERR)) {
-        controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, data->file_descriptor);
-        close(data->file_descriptor);
-        delete data;
-      } else if ((current_event.events == EPOLLIN) ||
-                 (current_event.events == EPOLLOUT)) {
-        HandleEpollEvent(epoll_fd, data, current_event.events);
+      if (current_event.events & (EPOLLHUP | EPOLLERR)) {
+        CloseConnection(worker_id, data);
       } else {
-        controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, data->file_descriptor);
-        close(data->file_descriptor);
-        delete data;
+        if (current_event.events & EPOLLRDHUP) data->peer_shutdown = true;
+        HandleEpollEvent(worker_id, data);
       }
     }
+    // Taken only now, since handling the events may close queued connections
+    std::vector<EventData *> ready;
+    ready.swap(worker_ready_[worker_id]);
+    for (EventData *ready_data : ready) {
+      ready_data->ready_queued = false;
+      HandleEpollEvent(worker_id, ready_data);
+    }
+    ServeQueuedRequests(worker_id);
+    worker_busy_time_[worker_id] += std::chrono::steady_clock::now() - poll_time;
+    TRACE(tracer_->CommitIteration(worker_id, worker_poll_ticks_[worker_id],
+                                   Tracer::Now(),
+                                   worker_trace_kept_[worker_id]));
   }
 }
 
-void HttpServer::HandleEpollEvent(int epoll_fd, EventData *data,
-                                  std::uint32_t events) {
-  int fd = data->file_descriptor;
-  EventData *request, *response;
+void HttpServer::UpdateLoad(int worker_id,
+                            std::chrono::steady_clock::time_point now) {
+  auto elapsed = now - worker_load_tick_[worker_id];
+  if (elapsed < kLoadInterval) return;
 
-  if (events == EPOLLIN) {
-    request = data;
-    ssize_t byte_count = recv(fd, request->buffer, kMaxBufferSize, 0);
-    if (byte_count > 0) {
-      response = new EventData();
-      response->file_descriptor = fd;
-      HandleHttpData(*request, response);
-      controlEpollEvent(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, response);
-      delete request;
-    } else if (byte_count == 0) {
-      controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, fd);
-      close(fd);
-      delete request;
-    } else {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        request->file_descriptor = fd;
-        controlEpollEvent(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLIN, request);
-      } else {
-        controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, fd);
-        close(fd);
-        delete request;
+  // Smooth over two intervals so that one burst does not move connections
+  int busy = static_cast<int>(1000 * worker_busy_time_[worker_id] / elapsed);
+  worker_busy_permille_[worker_id] =
+      (worker_busy_permille_[worker_id] + std::min(busy, 1000)) / 2;
+  worker_busy_time_[worker_id] = std::chrono::steady_clock::duration::zero();
+  worker_load_tick_[worker_id] = now;
+  if (balancing_options_.migrate_connections && !draining_) {
+    MigrateConnections(worker_id);
+  }
+}
+
+// Gives idle connections to the least busy worker when this worker is well
+// above average. The connections that sent the most requests recently go
+// first, until they account for about this worker's share of the excess.
+// Between requests a connection has no state outside its EventData, so it
+// only needs to be re-registered with the other worker's epoll instance.
+void HttpServer::MigrateConnections(int worker_id) {
+  auto &connections = worker_connections_[worker_id];
+  int busy = worker_busy_permille_[worker_id];
+  int target = worker_id, total_busy = 0;
+  for (int i = 0; i < kThreadPoolSize; i++) {
+    total_busy += worker_busy_permille_[i];
+    if (worker_busy_permille_[i] < worker_busy_permille_[target]) target = i;
+  }
+  double average = static_cast<double>(total_busy) / kThreadPoolSize;
+  const int cap = overload_options_.max_connections_per_worker;
+
+  if (target != worker_id && busy >= kMinMigrationBusyPermille &&
+      busy > average * balancing_options_.migration_threshold) {
+    std::vector<EventData *> candidates;
+    std::uint64_t recent_requests = 0;
+    for (const auto &entry : connections) {
+      EventData *data = entry.second;
+      recent_requests += data->recent_requests;
+      if (!data->busy && !data->ready_queued && !data->request_queued &&
+          !data->subscription && data->recent_requests > 0) {
+        candidates.push_back(data);
+      }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const EventData *a, const EventData *b) {
+                return a->recent_requests > b->recent_requests;
+              });
+
+    double quota = recent_requests * (busy - average) / busy;
+    std::uint64_t moved_requests = 0;
+    std::vector<EventData *> moved;
+    for (EventData *data : candidates) {
+      if (moved_requests >= quota ||
+          static_cast<int>(moved.size()) >=
+              balancing_options_.max_migrations_per_interval ||
+          (cap > 0 && worker_connection_count_[target] >= cap)) {
+        break;
       }
+      moved_requests += data->recent_requests;
+      controlEpollEvent(worker_id, EPOLL_CTL_DEL, data);
+      connections.erase(data->file_descriptor);
+      worker_connection_count_[worker_id]--;
+      worker_connection_count_[target]++;
+      moved.push_back(data);
+    }
+    if (!moved.empty()) {
+      AddSingleWriter<std::uint64_t>(worker_migrated_out_[worker_id],
+                                     moved.size());
+      worker_migrated_in_[target] += moved.size();
+      std::lock_guard<std::mutex> lock(worker_pending_mutex_[target]);
+      worker_pending_[target].insert(worker_pending_[target].end(),
+                                     moved.begin(), moved.end());
     }
+    for (EventData *data : moved) data->recent_requests = 0;
+  }
+
+  for (const auto &entry : connections) entry.second->recent_requests = 0;
+}
+
+void HttpServer::RegisterPendingConnections(int worker_id) {
+  std::vector<EventData *> pending;
+  {
+    std::lock_guard<std::mutex> lock(worker_pending_mutex_[worker_id]);
+    if (worker_pending_[worker_id].empty()) return;
+    pending.swap(worker_pending_[worker_id]);
+  }
+  for (EventData *data : pending) {
+    // Idle connections hold no output blocks, so moving one to another
+    // worker leaves nothing behind in the old pool
+    data->output.set_pool(worker_output_pools_[worker_id].get());
+    worker_connections_[worker_id][data->file_descriptor] = data;
+    controlEpollEvent(worker_id, EPOLL_CTL_ADD, data, kConnectionEvents);
+  }
+}
+
+// Closing the socket also removes it from the epoll instance
+void HttpServer::CloseConnection(int worker_id, EventData *data) {
+  if (data->ready_queued) {
+    auto &ready = worker_ready_[worker_id];
+    ready.erase(std::find(ready.begin(), ready.end(), data));
+  }
+  if (data->request_queued) {
+    auto &queue =
+        worker_queues_[worker_id][static_cast<int>(data->priority)];
+    queue.erase(std::find(queue.begin(), queue.end(), data));
+  }
+  if (data->subscription) Unsubscribe(worker_id, data);
+  if (data->tls) data->tls->Shutdown();
+  close(data->file_descriptor);
+  if (data->busy) EndRequest(worker_id, data);
+  worker_connections_[worker_id].erase(data->file_descriptor);
+  delete data;
+  active_connections_--;
+  worker_connection_count_[worker_id]--;
+}
+
+// Closing every idle connection at once would make all those clients
+// reconnect at the same moment. Instead the connections this worker had when
+// draining started are closed at a steady pace over half the drain timeout.
+void HttpServer::CloseIdleConnections(int worker_id) {
+  auto &connections = worker_connections_[worker_id];
+  if (worker_drain_target_[worker_id] == 0) {
+    worker_drain_target_[worker_id] = connections.size() + 1;
+  }
+  double ramp = std::max<double>(drain_timeout_.count() / 2.0, 1.0);
+  double elapsed = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - drain_start_)
+                       .count();
+  size_t due = static_cast<size_t>(worker_drain_target_[worker_id] *
+                                   std::min(elapsed / ramp, 1.0)) + 1;
+
+  auto it = connections.begin();
+  while (worker_drain_closed_[worker_id] < due && it != connections.end()) {
+    EventData *data = it->second;
+    ++it;
+    if (data->busy || data->request_queued) continue;
+    CloseConnection(worker_id, data);
+    worker_drain_closed_[worker_id]++;
+  }
+}
+
+// Flushes the pending response, then reads the next request and queues it
+// by priority. It is served, and the connection read further, once the
+// worker has received the requests of every event of this iteration. A
+// connection whose request is still queued is not read meanwhile, but the
+// event is noted, so that it is read once the request is served: the edge
+// will not be reported again.
+void HttpServer::HandleEpollEvent(int worker_id, EventData *data) {
+  if (data->subscription) {
+    HandleSubscriberEvent(worker_id, data);
+    return;
+  }
+  if (data->request_queued) {
+    data->more_input = true;
+    return;
+  }
+  if (data->tls && !data->tls->handshake_done()) {
+    if (!ContinueTlsHandshake(worker_id, data)) return;
+  }
+  if (data->busy && !FlushResponse(worker_id, data)) return;
+  data->pipelined = 0;
+  ReceiveRequest(worker_id, data);
+}
+
+void HttpServer::ReceiveRequest(int worker_id, EventData *data) {
+  TRACE(data->trace.Reset();
+        data->trace.marks[kTraceQueued] = worker_queued_ticks_[worker_id];
+        data->trace.Mark(kTraceReceiveStart));
+  AddSingleWriter<std::uint64_t>(worker_receives_[worker_id], 1);
+  ssize_t byte_count = Receive(data);
+  if (byte_count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  if (byte_count <= 0) {
+    CloseConnection(worker_id, data);
+    return;
+  }
+
+  TRACE(data->trace.Mark(kTraceReceiveEnd));
+  data->length = byte_count;
+  // A short read means the socket was drained, and new data will raise a
+  // new edge. That does not hold for bytes OpenSSL has buffered, nor for
+  // the end of the stream once the peer has shut down its side.
+  data->more_input = data->tls || data->peer_shutdown ||
+                     static_cast<size_t>(byte_count) == kMaxBufferSize;
+  data->queued_since = worker_queued_since_[worker_id];
+  data->received_at = std::chrono::steady_clock::now();
+  data->priority = ClassifyRequest(data);
+  data->request_queued = true;
+  worker_queues_[worker_id][static_cast<int>(data->priority)].push_back(data);
+}
+
+// Matches the request target against the routes that have a priority, the
+// way routing will once the request is parsed
+RequestPriority HttpServer::ClassifyRequest(const EventData *data) const {
+  if (priority_routes_.empty()) return RequestPriority::Normal;
+  std::string_view target =
+      RequestTarget(std::string_view(data->buffer, data->length));
+  if (target.empty()) return RequestPriority::Normal;
+  for (const auto &route : priority_routes_) {
+    if (route.first.length() == target.length() &&
+        strncasecmp(route.first.data(), target.data(), target.length()) == 0) {
+      return route.second;
+    }
+  }
+  return RequestPriority::Normal;
+}
+
+// Serves the queued requests from the highest class down, each class up to
+// its budget. Pipelined requests read meanwhile join the back of their
+// class's queue.
+void HttpServer::ServeQueuedRequests(int worker_id) {
+  const int budgets[kRequestPriorities] = {0, priority_options_.normal_budget,
+                                           priority_options_.low_budget};
+  for (int priority = 0; priority < kRequestPriorities; priority++) {
+    auto &queue = worker_queues_[worker_id][priority];
+    int budget = budgets[priority];
+    for (int served = 0; !queue.empty() && (budget <= 0 || served < budget);
+         served++) {
+      EventData *data = queue.front();
+      queue.pop_front();
+      data->request_queued = false;
+      TRACE(data->trace.Mark(kTraceDequeued));
+      ServeRequest(worker_id, data);
+    }
+    if (!queue.empty()) {
+      AddSingleWriter<std::uint64_t>(
+          worker_priority_stats_[worker_id][priority].deferred, queue.size());
+    }
+  }
+}
+
+// Answers the request in the connection's buffer, then reads the next one
+// unless the socket is drained or the connection has had its share of this
+// iteration
+void HttpServer::ServeRequest(int worker_id, EventData *data) {
+  auto now = std::chrono::steady_clock::now();
+  PriorityCounters &counters =
+      worker_priority_stats_[worker_id][static_cast<int>(data->priority)];
+  std::uint64_t queue_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          now - data->queued_since).count();
+  AddSingleWriter<std::uint64_t>(counters.requests, 1);
+  AddSingleWriter(counters.queue_ns_total, queue_ns);
+  if (queue_ns > counters.queue_ns_max.load(std::memory_order_relaxed)) {
+    counters.queue_ns_max.store(queue_ns, std::memory_order_relaxed);
+  }
+
+  data->log_pending = access_logger_ && access_logger_->Sample(worker_id);
+  if (data->log_pending) data->request_start = now;
+  // The request is in flight from here until its response is written, so
+  // that the limits also count the handlers running on other workers
+  bool shed = ShouldShedRequest(worker_id, data, now);
+  BeginRequest(worker_id, data);
+  if (shed) {
+    ShedHttpData(data);
   } else {
-    response = data;
-    ssize_t byte_count =
-        send(fd, response->buffer + response->cursor, response->length, 0);
-    if (byte_count >= 0) {
-      if (byte_count < response->length) {
-        response->cursor += byte_count;
-        response->length -= byte_count;
-        controlEpollEvent(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, response);
-      } else {
-        request = new EventData();
-        request->file_descriptor = fd;
-        controlEpollEvent(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLIN, request);
-        delete response;
+    bool respond = HandleHttpData(worker_id, data);
+    worker_arenas_[worker_id]->Reset();
+    if (!respond) {
+      CloseConnection(worker_id, data);
+      return;
+    }
+  }
+  if (!FlushResponse(worker_id, data)) return;
+  if (data->subscription) {
+    // Events published since it subscribed were held back for the head
+    if (!SendEvents(worker_id, data)) CloseConnection(worker_id, data);
+    return;
+  }
+  if (!data->more_input) return;
+
+  if (++data->pipelined < kMaxRequestsPerEvent) {
+    ReceiveRequest(worker_id, data);
+  } else {
+    // More may be waiting, but no new edge will say so
+    data->ready_queued = true;
+    worker_ready_[worker_id].push_back(data);
+  }
+}
+
+// Writes as much of the pending response as the socket takes. Returns true
+// once it is all sent and the connection can read its next request; false
+// if the rest has to wait for EPOLLOUT, or the connection was closed.
+bool HttpServer::FlushResponse(int worker_id, EventData *data) {
+  TRACE(if (data->trace.marks[kTraceSendStart] == 0) {
+    data->trace.Mark(kTraceSendStart);
+  });
+  if (!SendOutput(worker_id, data)) {
+    CloseConnection(worker_id, data);
+    return false;
+  }
+  if (!data->output.empty()) return false;
+
+  TRACE(TraceRequestDone(worker_id, data));
+  if (data->log_pending) LogRequest(worker_id, data);
+  if (data->close_after_write) {
+    CloseConnection(worker_id, data);
+    return false;
+  }
+  EndRequest(worker_id, data);
+  return true;
+}
+
+// Sends pending output until it is all sent or the socket is full. Returns
+// false if the connection failed.
+bool HttpServer::SendOutput(int worker_id, EventData *data) {
+  while (!data->output.empty()) {
+    AddSingleWriter<std::uint64_t>(worker_sends_[worker_id], 1);
+    ssize_t byte_count = Send(data);
+    if (byte_count < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+    data->output.Consume(byte_count);
+  }
+  return true;
+}
+
+// Called by a streaming handler's writer with each complete chunk. What the
+// socket does not take now stays queued behind the rest of the response.
+bool HttpServer::FlushStream(void *target) {
+  StreamTarget *stream = static_cast<StreamTarget *>(target);
+  HttpServer *server = stream->server;
+#ifdef HIGH_PERFORMANCE_SERVER_TRACING
+  if (server->tracer_ && stream->data->trace.marks[kTraceSendStart] == 0) {
+    stream->data->trace.Mark(kTraceSendStart);
+  }
+#endif
+  if (server->SendOutput(stream->worker_id, stream->data)) return true;
+  if (stream->cancellation != nullptr) {
+    stream->cancellation->Cancel(CancelReason::PeerClosed);
+  }
+  return false;
+}
+
+// The probe of a request's cancellation token. Epoll cannot report the
+// client going away while the worker runs the handler, so the socket is
+// polled directly.
+bool HttpServer::PeerGone(void *target) {
+  EventData *data = static_cast<EventData *>(target);
+  if (data->peer_shutdown) return true;
+  pollfd descriptor = {data->file_descriptor, POLLRDHUP, 0};
+  if (poll(&descriptor, 1, 0) <= 0) return false;
+  data->peer_shutdown = (descriptor.revents & POLLRDHUP) != 0;
+  return (descriptor.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+// Answers an event stream request with the head of a chunked response that
+// does not end, and subscribes the connection to the topic. Events published
+// meanwhile wait in its backlog until the head is sent.
+HttpResponse HttpServer::StartEventStream(int worker_id, EventData *data,
+                                          const HttpRequest &request,
+                                          const Route &route) {
+  std::pmr::memory_resource *resource = worker_arenas_[worker_id]->resource();
+  std::string topic = route.event_topic(request);
+  if (topic.empty()) return HttpResponse(HttpStatusCode::NotFound, resource);
+  HttpResponse response(HttpStatusCode::Ok, resource);
+  response.SetHeader("Content-Type", "text/event-stream");
+  response.SetHeader("Cache-Control", "no-cache");
+  response.SetHeader("Transfer-Encoding", "chunked");
+  if (request.method() != HttpMethod::GET) return response;
+
+  auto &subscribers = worker_topics_[worker_id][topic];
+  data->subscription = std::make_unique<EventSubscription>(
+      std::move(topic), event_stream_options_.max_backlog);
+  data->subscription->index = subscribers.size();
+  subscribers.push_back(data);
+  worker_subscribers_[worker_id]++;
+  return response;
+}
+
+// Subscribers are never in the flush list here: it is emptied in the same
+// DeliverEvents() call that fills it.
+void HttpServer::Unsubscribe(int worker_id, EventData *data) {
+  EventSubscription &subscription = *data->subscription;
+  auto &topics = worker_topics_[worker_id];
+  auto topic = topics.find(subscription.topic);
+  auto &subscribers = topic->second;
+  // The last subscriber takes its place, so that leaving takes constant time
+  subscribers[subscription.index] = subscribers.back();
+  subscribers[subscription.index]->subscription->index = subscription.index;
+  subscribers.pop_back();
+  if (subscribers.empty()) topics.erase(topic);
+  data->subscription.reset();
+  worker_subscribers_[worker_id]--;
+}
+
+// Hands the events published since the last iteration to this worker's
+// subscribers. Every event is queued first, so that each subscriber is then
+// sent all of its new events at once.
+void HttpServer::DeliverEvents(int worker_id) {
+  std::vector<EventMessage *> inbox;
+  {
+    std::lock_guard<std::mutex> lock(worker_inbox_mutex_[worker_id]);
+    if (worker_inbox_[worker_id].empty()) return;
+    inbox.swap(worker_inbox_[worker_id]);
+  }
+  auto &topics = worker_topics_[worker_id];
+  std::uint64_t dropped = 0;
+  for (EventMessage *message : inbox) {
+    auto topic = topics.find(std::string(message->topic()));
+    if (topic != topics.end()) {
+      for (EventData *subscriber : topic->second) {
+        if (QueueEvent(worker_id, subscriber, message)) dropped++;
       }
+    }
+    message->Unref();
+  }
+  if (dropped > 0) events_dropped_ += dropped;
+
+  // Closing a connection does not touch this list
+  auto &flushes = worker_flushes_[worker_id];
+  for (EventData *subscriber : flushes) {
+    EventSubscription &subscription = *subscriber->subscription;
+    subscription.flush_pending = false;
+    if (subscription.overflowed) {
+      subscribers_disconnected_++;
+      CloseConnection(worker_id, subscriber);
+    } else if (!subscriber->busy && !SendEvents(worker_id, subscriber)) {
+      CloseConnection(worker_id, subscriber);
+    }
+  }
+  flushes.clear();
+}
+
+// Queues `message` for `data` and lists the subscriber to be flushed.
+// Returns true if an event was dropped because the backlog was full.
+bool HttpServer::QueueEvent(int worker_id, EventData *data,
+                            EventMessage *message) {
+  EventSubscription &subscription = *data->subscription;
+  if (subscription.overflowed) return false;
+  if (!subscription.flush_pending) {
+    subscription.flush_pending = true;
+    worker_flushes_[worker_id].push_back(data);
+  }
+  EventBacklog &backlog = subscription.backlog;
+  if (!backlog.full()) {
+    backlog.Push(message);
+    return false;
+  }
+  if (event_stream_options_.slow_subscriber_action ==
+      SlowSubscriberAction::Disconnect) {
+    subscription.overflowed = true;
+    return false;
+  }
+  // With only a partly sent event queued, the new one is dropped instead
+  if (backlog.DropOldest()) backlog.Push(message);
+  return true;
+}
+
+// Sends queued events from their shared buffers until the backlog is empty
+// or the socket is full. Returns false if the connection failed.
+bool HttpServer::SendEvents(int worker_id, EventData *data) {
+  EventBacklog &backlog = data->subscription->backlog;
+  while (!backlog.empty()) {
+    AddSingleWriter<std::uint64_t>(worker_sends_[worker_id], 1);
+    ssize_t byte_count;
+    if (WritesThroughOpenSsl(data)) {
+      std::string_view pending = backlog.Front();
+      byte_count = data->tls->Write(pending.data(), pending.length());
     } else {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        controlEpollEvent(epoll_fd, EPOLL_CTL_ADD, fd, EPOLLOUT, response);
-      } else {
-        controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, fd);
-        close(fd);
-        delete response;
-      }
+      iovec vectors[kMaxSendEvents];
+      msghdr message = {};
+      message.msg_iov = vectors;
+      message.msg_iovlen = backlog.Fill(vectors, kMaxSendEvents);
+      byte_count = sendmsg(data->file_descriptor, &message, MSG_NOSIGNAL);
     }
+    if (byte_count < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+      // OpenSSL holds the record it made of these bytes until the retry
+      if (WritesThroughOpenSsl(data)) backlog.PinFront();
+      return true;
+    }
+    backlog.Consume(byte_count);
+  }
+  return true;
+}
+
+// An event stream only flows to the client. What the client sends is read
+// and discarded, and the end of its side closes the connection.
+void HttpServer::HandleSubscriberEvent(int worker_id, EventData *data) {
+  if (data->busy && !FlushResponse(worker_id, data)) return;
+  if (!SendEvents(worker_id, data)) {
+    CloseConnection(worker_id, data);
+    return;
+  }
+  bool read_to_end = data->tls || data->peer_shutdown;
+  while (true) {
+    ssize_t byte_count = Receive(data);
+    if (byte_count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (byte_count <= 0) {
+      CloseConnection(worker_id, data);
+      return;
+    }
+    if (!read_to_end && static_cast<size_t>(byte_count) < kMaxBufferSize) {
+      return;
+    }
+  }
+}
+
+void HttpServer::Publish(std::string_view topic, std::string_view data,
+                         std::string_view event, std::string_view id) {
+  if (!running_) return;
+  events_published_++;
+  EventMessage *message = nullptr;
+  for (int i = 0; i < kThreadPoolSize; i++) {
+    if (worker_subscribers_[i] == 0) continue;
+    if (message == nullptr) {
+      message = EventMessage::Create(topic, data, event, id);
+    }
+    std::lock_guard<std::mutex> lock(worker_inbox_mutex_[i]);
+    if (!running_) break;
+    message->Ref();
+    worker_inbox_[i].push_back(message);
   }
+  if (message != nullptr) message->Unref();
 }
 
-void HttpServer::HandleHttpData(const EventData &raw_request,
-                                EventData *raw_response) {
-  std::string request_string(raw_request.buffer), response_string;
-  HttpRequest http_request;
-  HttpResponse http_response;
+// Returns true once the handshake is done. Until then the connection waits
+// for the next edge in whichever direction OpenSSL needs, and is closed if
+// the handshake fails.
+bool HttpServer::ContinueTlsHandshake(int worker_id, EventData *data) {
+  TlsConnection &tls = *data->tls;
+  switch (tls.Handshake()) {
+    case TlsConnection::HandshakeStatus::Done:
+      tls_handshakes_++;
+      if (tls.session_reused()) tls_sessions_resumed_++;
+      if (tls.kernel_tls_send()) tls_kernel_offloaded_++;
+      return true;
+    case TlsConnection::HandshakeStatus::WantRead:
+    case TlsConnection::HandshakeStatus::WantWrite:
+      return false;
+    default:
+      CloseConnection(worker_id, data);
+      return false;
+  }
+}
+
+// High-priority requests are only refused by the hard limits, so that health
+// checks keep passing while bulk traffic is shed
+bool HttpServer::ShouldShedRequest(int worker_id, const EventData *data,
+                                   std::chrono::steady_clock::time_point now) {
+  const OverloadOptions &options = overload_options_;
+  if ((options.max_requests_in_flight > 0 &&
+       requests_in_flight_ >= options.max_requests_in_flight) ||
+      (options.max_requests_in_flight_per_worker > 0 &&
+       worker_requests_in_flight_[worker_id] >=
+           options.max_requests_in_flight_per_worker)) {
+    return true;
+  }
+  if (!options.adaptive_shedding ||
+      data->priority == RequestPriority::High) {
+    return false;
+  }
+  return worker_shedders_[worker_id].ShouldShed(now - data->queued_since, now);
+}
+
+void HttpServer::BeginRequest(int worker_id, EventData *data) {
+  data->busy = true;
+  data->recent_requests++;
+  AddSingleWriter(worker_requests_in_flight_[worker_id], 1);
+  AddSingleWriter<std::uint64_t>(worker_requests_[worker_id], 1);
+  requests_in_flight_++;
+}
+
+void HttpServer::EndRequest(int worker_id, EventData *data) {
+  data->busy = false;
+  AddSingleWriter(worker_requests_in_flight_[worker_id], -1);
+  requests_in_flight_--;
+}
+
+void HttpServer::ShedHttpData(EventData *data) {
+  const std::string &response =
+      draining_ ? overload_close_response_ : overload_response_;
+  data->close_after_write = draining_;
+  data->output.Append(response);
+  requests_shed_++;
+  if (data->log_pending) {
+    data->log_record.parse_ns = 0;
+    data->log_record.handler_ns = 0;
+    RecordRefusedRequest(data, HttpStatusCode::ServiceUnvailable,
+                         response.length());
+  }
+}
+
+// Returns false if the connection should be closed without a response
+// Everything the request allocates comes from the worker's arena, which the
+// caller resets once the response has been written to the connection's output
+bool HttpServer::HandleHttpData(int worker_id, EventData *data) {
+  // Phase timings are only taken for requests that will be logged
+  AccessLogRecord &record = data->log_record;
+  std::chrono::steady_clock::time_point mark;
+  if (data->log_pending) {
+    record.parse_ns = 0;
+    record.handler_ns = 0;
+    mark = std::chrono::steady_clock::now();
+  }
+  if (rate_limiter_ &&
+      !rate_limiter_->Allow(data->peer_address.Key(), NowMilliseconds())) {
+    return RateLimitHttpData(data, *rate_limiter_, rate_limited_response_);
+  }
+
+  std::pmr::memory_resource *resource = worker_arenas_[worker_id]->resource();
+  std::string_view request_string(data->buffer, data->length);
+  HttpRequest http_request(resource);
+  HttpResponse http_response(HttpStatusCode::Ok, resource);
+  // Set up once the request is parsed, for handlers that stream
+  StreamTarget stream_target{this, worker_id, data, nullptr};
+  std::optional<ResponseWriter> writer;
+  bool streamed = false;
 
   try {
-    http_request = stringToRequest(request_string);
-    http_response = HandleHttpRequest(http_request);
+    http_request = stringToRequest(request_string, resource);
+    TRACE(data->trace.Mark(kTraceParseEnd));
+    if (data->log_pending) {
+      auto now = std::chrono::steady_clock::now();
+      record.parse_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            now - mark).count();
+      mark = now;
+    }
+    http_request.SetPeerAddress(&data->peer_address);
+    const Route *route = nullptr;
+    auto it = request_handlers_.find(http_request.uri());
+    if (it != request_handlers_.end()) route = &it->second;
+    if (route != nullptr && route->rate_limiter) {
+      const RateLimiter &limiter = *route->rate_limiter;
+      std::uint64_t key =
+          limiter.options().per_client ? data->peer_address.Key() : 0;
+      if (!route->rate_limiter->Allow(key, NowMilliseconds())) {
+        return RateLimitHttpData(data, limiter, route->rate_limited_response);
+      }
+    }
+
+    // Counted from when the request was received, so that time spent queued
+    // behind other requests counts too
+    const DeadlineOptions &deadlines = deadline_options_;
+    auto timeout = deadlines.request_timeout;
+    bool client_deadline = false;
+    if (!deadlines.timeout_header.empty()) {
+      std::string_view value = http_request.header(deadlines.timeout_header);
+      if (!value.empty()) {
+        auto requested = ParseTimeout(value);
+        if (timeout.count() == 0 || requested < timeout) {
+          timeout = requested;
+          client_deadline = true;
+        }
+      }
+    }
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (timeout.count() > 0 || client_deadline) {
+      deadline = data->received_at + timeout;
+    }
+    HttpStatusCode timeout_status = client_deadline
+                                        ? HttpStatusCode::GatewayTimeout
+                                        : HttpStatusCode::RequestTimeout;
+    CancellationToken cancellation(deadline, &PeerGone, data);
+    if (deadline != std::chrono::steady_clock::time_point::max() &&
+        std::chrono::steady_clock::now() >= deadline) {
+      requests_expired_++;
+      http_response = TimeoutResponse(timeout_status, resource);
+    } else {
+      if (data->peer_shutdown) cancellation.Cancel(CancelReason::PeerClosed);
+      stream_target.cancellation = &cancellation;
+      writer.emplace(&data->output, http_request.method() != HttpMethod::HEAD,
+                     draining_ || WantsClose(http_request), &FlushStream,
+                     &stream_target);
+      RequestContext context(resource, worker_id, &*writer, &cancellation);
+      if (route != nullptr && route->event_topic &&
+          (http_request.method() == HttpMethod::GET ||
+           http_request.method() == HttpMethod::HEAD)) {
+        http_response = StartEventStream(worker_id, data, http_request, *route);
+      } else {
+        http_response = HandleHttpRequest(http_request, route, context);
+      }
+      streamed = writer->started();
+      stream_target.cancellation = nullptr;
+      TRACE(data->trace.Mark(kTraceHandleEnd));
+      if (data->log_pending) {
+        record.handler_ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - mark).count();
+      }
+      // A handler that saw the deadline pass may have returned anything.
+      // Part of a streamed response may be sent already, so the only way
+      // to tell the client is to cut it off.
+      if (cancellation.reason() != CancelReason::None) requests_cancelled_++;
+      if (cancellation.reason() == CancelReason::Deadline) {
+        if (streamed) return false;
+        http_response = TimeoutResponse(timeout_status, resource);
+      }
+    }
   } catch (const std::invalid_argument &e) {
-    http_response = HttpResponse(HttpStatusCode::BadRequest);
+    http_response = HttpResponse(HttpStatusCode::BadRequest, resource);
     http_response.SetContent(e.what());
   } catch (const std::logic_error &e) {
-    http_response = HttpResponse(HttpStatusCode::HttpVersionNotSupported);
+    http_response =
+        HttpResponse(HttpStatusCode::HttpVersionNotSupported, resource);
     http_response.SetContent(e.what());
   } catch (const std::exception &e) {
-    http_response = HttpResponse(HttpStatusCode::InternalServerError);
+    http_response = HttpResponse(HttpStatusCode::InternalServerError, resource);
     http_response.SetContent(e.what());
   }
 
-  response_string =
-      toString(http_response, http_request.method() != HttpMethod::HEAD);
-  memcpy(raw_response->buffer, response_string.c_str(), kMaxBufferSize);
-  raw_response->length = response_string.length();
+  if (writer && writer->started()) {
+    // Part of the response may be sent already, so an exception cannot
+    // replace it, and a failed connection cannot take the rest
+    if (!streamed) return false;
+    writer->Finish();
+    if (writer->failed()) return false;
+    TRACE(data->trace.Mark(kTraceSerializeEnd));
+    data->close_after_write = writer->closes_connection();
+    if (data->log_pending) {
+      record.status = static_cast<std::uint16_t>(writer->status());
+      record.method = http_request.method();
+      record.bytes = writer->body_bytes();
+      record.SetPath(http_request.uri().path());
+    }
+    return true;
+  }
+
+  // While draining, tell the client to take its next request elsewhere
+  if (draining_ || WantsClose(http_request)) {
+    http_response.SetHeader("Connection", "close");
+    data->close_after_write = true;
+  }
+
+  size_t response_bytes = data->output.size();
+  WriteResponse(http_response, http_request.method() != HttpMethod::HEAD,
+                &data->output);
+  TRACE(data->trace.Mark(kTraceSerializeEnd));
+  if (data->log_pending) {
+    record.status = static_cast<std::uint16_t>(http_response.status_code());
+    record.method = http_request.method();
+    record.bytes = data->output.size() - response_bytes;
+    record.SetPath(http_request.uri().path());
+  }
+  return true;
+}
+
+#ifdef HIGH_PERFORMANCE_SERVER_TRACING
+void HttpServer::TraceRequestDone(int worker_id, EventData *data) {
+  data->trace.Mark(kTraceSendEnd);
+  if (tracer_->CommitRequest(worker_id, data->trace)) {
+    worker_trace_kept_[worker_id] = true;
+  }
 }
+#endif
 
-HttpResponse HttpServer::HandleHttpRequest(const HttpRequest &request) {
-  auto it = request_handlers_.find(request.uri());
-  if (it == request_handlers_.end()) {
-    return HttpResponse(HttpStatusCode::NotFound);
+// Completes the record of the request whose response was just sent and hands
+// it to the access log
+void HttpServer::LogRequest(int worker_id, EventData *data) {
+  AccessLogRecord &record = data->log_record;
+  record.total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - data->request_start)
+                        .count();
+  record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+  record.SetPeer(data->peer_address);
+  access_logger_->Append(worker_id, record);
+  data->log_pending = false;
+}
+
+bool HttpServer::RateLimitHttpData(EventData *data, const RateLimiter &limiter,
+                                   const std::string &response) {
+  requests_rate_limited_++;
+  if (limiter.options().action == RateLimitAction::Close) {
+    data->log_pending = false;  // nothing was answered
+    return false;
   }
-  auto callback_it = it->second.find(request.method());
-  if (callback_it == it->second.end()) {
-    return HttpResponse(HttpStatusCode::MethodNotAllowed);
+  data->close_after_write = draining_;
+  data->output.Append(response);
+  if (data->log_pending) {
+    RecordRefusedRequest(data, HttpStatusCode::TooManyRequests,
+                         response.length());
   }
-  return callback_it->second(request);
+  return true;
 }
 
-void HttpServer::controlEpollEvent(int epoll_fd, int op, int fd,
-                                   std::uint32_t events, void *data) {
+// Refused requests are answered without being parsed, so their method and
+// path are read from the request line. One that cannot be read is not logged.
+void HttpServer::RecordRefusedRequest(EventData *data, HttpStatusCode status,
+                                      size_t bytes) {
+  AccessLogRecord &record = data->log_record;
+  std::string_view request(data->buffer, data->length);
+  std::string_view target = RequestTarget(request);
+  try {
+    if (target.empty()) throw std::invalid_argument("No request target");
+    record.method = string_to_method(request.substr(0, request.find(' ')));
+  } catch (const std::invalid_argument &) {
+    data->log_pending = false;
+    return;
+  }
+  record.status = static_cast<std::uint16_t>(status);
+  record.bytes = bytes;
+  record.SetPath(Uri(std::string(target)).path());
+}
+
+HttpResponse HttpServer::HandleHttpRequest(const HttpRequest &request,
+                                           const Route *route,
+                                           RequestContext &context) {
+  if (route == nullptr) {
+    return HttpResponse(HttpStatusCode::NotFound, context.resource());
+  }
+  auto callback_it = route->handlers.find(request.method());
+  if (callback_it == route->handlers.end()) {
+    return HttpResponse(HttpStatusCode::MethodNotAllowed, context.resource());
+  }
+  return callback_it->second(request, context);
+}
+
+void HttpServer::controlEpollEvent(int worker_id, int op, EventData *data,
+                                   std::uint32_t events) {
+  int epoll_fd = worker_epoll_fd_[worker_id];
+  AddSingleWriter<std::uint64_t>(worker_epoll_ctls_[worker_id], 1);
   if (op == EPOLL_CTL_DEL) {
-    if (epoll_ctl(epoll_fd, op, fd, nullptr) < 0) {
+    if (epoll_ctl(epoll_fd, op, data->file_descriptor, nullptr) < 0) {
       throw std::runtime_error("Failed to remove file descriptor");
     }
   } else {
     epoll_event ev;
     ev.events = events;
     ev.data.ptr = data;
-    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+    if (epoll_ctl(epoll_fd, op, data->file_descriptor, &ev) < 0) {
       throw std::runtime_error("Failed to add file descriptor");
     }
   }
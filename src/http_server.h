@@ -5,33 +5,196 @@
 
 #include <sys/epoll.h>
 
+#include <atomic>
 #include <chrono>
+#include <deque>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include "access_log.h"
+#include "arena.h"
+#include "cancellation.h"
 #include "http_message.h"
+#include "output_buffer.h"
+#include "overload.h"
+#include "pubsub.h"
+#include "rate_limiter.h"
 #include "socket.h"
+#include "tls.h"
+#include "trace.h"
 #include "uri.h"
 
 namespace high_performance_server {
 
-// Maximum HTTP message size per socket read/write operation
+// Maximum HTTP request size per socket read operation
 constexpr size_t kMaxBufferSize = 4096;
 
+// Workers serve the requests received in an event-loop iteration in order of
+// their route's priority class
+enum class RequestPriority { High, Normal, Low };
+constexpr int kRequestPriorities = 3;
+
+// Per-connection state, for the lifetime of the connection. Requests are
+// read into `buffer`; responses are written to `output`, which holds blocks
+// of its worker's pool only while a response is pending.
 struct EventData {
-  EventData() : file_descriptor(0), length(0), cursor(0), buffer() {}
+  EventData()
+      : file_descriptor(0), length(0), busy(false), close_after_write(false),
+        log_pending(false), ready_queued(false), request_queued(false),
+        more_input(false), peer_shutdown(false), pipelined(0),
+        priority(RequestPriority::Normal), recent_requests(0), buffer() {}
   int file_descriptor;
-  size_t length;
-  size_t cursor;
+  size_t length;  // of the request in `buffer`
+  bool busy;               // a response is pending or being written
+  bool close_after_write;  // close once the pending response is sent
+  bool log_pending;        // log_record is filled in and logged once sent
+  bool ready_queued;       // in its worker's ready list
+  bool request_queued;     // `buffer` holds a request waiting to be served
+  bool more_input;         // the last read may not have drained the socket
+  bool peer_shutdown;      // the client shut down its side (EPOLLRDHUP)
+  int pipelined;           // requests served since the last event
+  RequestPriority priority;  // of the request in `buffer`
+  std::uint32_t recent_requests;  // since the last load measurement
+  // The worker's poll before the one that returned the request: it has
+  // been waiting since then at most
+  std::chrono::steady_clock::time_point queued_since;
+  // When the request was read, which its deadline counts from
+  std::chrono::steady_clock::time_point received_at;
+  PeerAddress peer_address;
+  std::chrono::steady_clock::time_point request_start;
+  AccessLogRecord log_record;
+  std::unique_ptr<TlsConnection> tls;  // null on plaintext connections
+  // Null unless the connection is an event stream
+  std::unique_ptr<EventSubscription> subscription;
+#ifdef HIGH_PERFORMANCE_SERVER_TRACING
+  RequestTrace trace;
+#endif
+  OutputChain output;
   char buffer[kMaxBufferSize];
 };
 
+// How the listener picks a worker for a new connection
+enum class BalancingMode {
+  RoundRobin,
+  LeastConnections,  // fewest open connections
+  LeastBusy          // lowest recent event-loop busy time
+};
+
+struct BalancingOptions {
+  BalancingMode mode = BalancingMode::RoundRobin;
+  // Move idle keep-alive connections from workers much busier than average
+  // to the least busy worker, so that hot clients do not stay pinned
+  bool migrate_connections = false;
+  // A worker gives connections away when its busy time exceeds the average
+  // by this factor
+  double migration_threshold = 1.25;
+  int max_migrations_per_interval = 64;
+};
+
+// Requests of each class a worker serves per event-loop iteration, 0 for no
+// limit. The rest wait until the worker has polled again and served the
+// higher classes, so that bulk traffic cannot hold up health checks for
+// long. High-priority requests are never limited.
+struct PriorityOptions {
+  int normal_budget = 0;
+  int low_budget = 16;
+};
+
+// Requests are due `request_timeout` after they were received, 0 for no
+// limit. A client may shorten, never extend, its request's time with the
+// `timeout_header` (milliseconds), e.g. a gateway passing on what is left of
+// its own budget. A request still queued at its deadline is answered without
+// running its handler: 504 Gateway Timeout if the client set the deadline,
+// 408 Request Timeout otherwise.
+struct DeadlineOptions {
+  std::chrono::milliseconds request_timeout{0};
+  std::string timeout_header = "X-Request-Timeout";  // empty to ignore it
+};
+
+// What happens to a subscriber whose backlog is full when an event comes
+enum class SlowSubscriberAction {
+  DropOldest,  // the oldest queued event that is not partly sent is dropped
+  Disconnect   // the connection is closed, and the client may reconnect
+};
+
+struct EventStreamOptions {
+  // Events queued per subscriber that the socket did not take yet
+  size_t max_backlog = 64;
+  SlowSubscriberAction slow_subscriber_action =
+      SlowSubscriberAction::DropOldest;
+};
+
+struct PriorityStats {
+  std::uint64_t requests;
+  std::uint64_t deferred;  // times requests were left for the next iteration
+  // Time from the poll before a request arrived until it was served
+  std::uint64_t queue_ns_total;
+  std::uint64_t queue_ns_max;
+};
+
+struct WorkerStats {
+  int connections;
+  int requests_in_flight;
+  double busy;  // fraction of recent time spent handling events, 0 to 1
+  std::uint64_t requests;
+  std::uint64_t connections_migrated_in;
+  std::uint64_t connections_migrated_out;
+  // System calls made by the worker
+  std::uint64_t epoll_waits;
+  std::uint64_t epoll_ctls;
+  std::uint64_t receives;
+  std::uint64_t sends;
+  std::uint64_t arena_overflows;  // requests that needed heap memory
+};
+
+// Snapshot of server-wide counters
+struct ServerStats {
+  int connections;
+  int requests_in_flight;
+  std::uint64_t requests_shed;  // answered with 503 by overload protection
+  std::uint64_t requests_rate_limited;
+  std::uint64_t requests_expired;  // past their deadline before the handler
+  std::uint64_t requests_cancelled;  // handlers that saw their request cancelled
+  std::uint64_t accept_pauses;  // times accepting stopped at a connection cap
+  std::uint64_t access_log_written;
+  std::uint64_t access_log_dropped;  // lost because a worker's ring was full
+  std::uint64_t tls_handshakes;
+  std::uint64_t tls_sessions_resumed;
+  std::uint64_t tls_kernel_offloaded;  // handshakes followed by kTLS sending
+  // Accepted connections closed because their TLS state could not be set up
+  std::uint64_t tls_connections_failed;
+  PriorityStats priorities[kRequestPriorities];  // indexed by RequestPriority
+  int subscribers;  // open event streams
+  std::uint64_t events_published;
+  std::uint64_t events_dropped;  // from the backlogs of slow subscribers
+  std::uint64_t subscribers_disconnected;  // for being too slow
+  std::vector<WorkerStats> workers;
+};
+
 // A request handler should expect a request as argument and returns a response
 using HttpRequestHandler_t = std::function<HttpResponse(const HttpRequest &)>;
+// Same, with the context of the request, e.g. to allocate from its arena
+using HttpContextHandler_t =
+    std::function<HttpResponse(const HttpRequest &, RequestContext &)>;
+// The topic an event stream request subscribes to, empty to answer 404
+using EventTopicHandler_t = std::function<std::string(const HttpRequest &)>;
+
+// Everything registered for one URI
+struct Route {
+  std::map<HttpMethod, HttpContextHandler_t> handlers;
+  RequestPriority priority = RequestPriority::Normal;
+  std::unique_ptr<RateLimiter> rate_limiter;
+  std::string rate_limited_response;
+  EventTopicHandler_t event_topic;  // set for event streams
+};
 
 // HTTP server with multi-threaded architecture:
 // - Main thread for user interaction
@@ -40,49 +203,291 @@ using HttpRequestHandler_t = std::function<HttpResponse(const HttpRequest &)>;
 class HttpServer {
 public:
   explicit HttpServer(const std::string &host, std::uint16_t port);
+  // Listens on every endpoint. All listeners feed the same workers and
+  // the same routes.
+  explicit HttpServer(const std::vector<ListenEndpoint> &endpoints);
+  // Serves on listening sockets handed over by another process
+  explicit HttpServer(int listener_fd);
+  explicit HttpServer(const std::vector<int> &listener_fds);
+  // Same, with the options of the configured endpoint each socket is bound
+  // to, e.g. whether it serves TLS. Sockets bound elsewhere get the defaults.
+  HttpServer(const std::vector<int> &listener_fds,
+             const std::vector<ListenEndpoint> &endpoints);
   ~HttpServer() = default;
 
   HttpServer() = default;
   HttpServer(HttpServer &&) = default;
   HttpServer &operator=(HttpServer &&) = default;
 
+  // Must be called before Start()
+  void SetOverloadOptions(const OverloadOptions &options) {
+    overload_options_ = options;
+  }
+  void SetBalancingOptions(const BalancingOptions &options) {
+    balancing_options_ = options;
+  }
+  void SetPriorityOptions(const PriorityOptions &options) {
+    priority_options_ = options;
+  }
+  void SetDeadlineOptions(const DeadlineOptions &options) {
+    deadline_options_ = options;
+  }
+  void SetEventStreamOptions(const EventStreamOptions &options) {
+    event_stream_options_ = options;
+  }
+  // Logs requests to `options.path` from a background thread. Workers only
+  // copy a fixed-size record into a ring buffer, so logging never blocks
+  // them; records that do not fit are dropped and counted in stats().
+  void EnableAccessLog(const AccessLogOptions &options) {
+    access_log_options_ = std::make_unique<AccessLogOptions>(options);
+  }
+  // Records the phases of sampled and slow requests, for ExportTrace().
+  // Does nothing unless built with HIGH_PERFORMANCE_SERVER_TRACING.
+  void EnableTracing(const TraceOptions &options) {
+    trace_options_ = std::make_unique<TraceOptions>(options);
+  }
+  // Serves HTTPS instead of HTTP. Throws std::runtime_error if the
+  // certificate cannot be loaded or TLS support was not built.
+  void EnableTls(const TlsOptions &options) {
+    tls_context_ = std::make_unique<TlsContext>(options);
+  }
+
   void Start();
-  void Stop();
-  void RegisterHttpRequestHandler(const std::string &path, HttpMethod method,
-                                  const HttpRequestHandler_t callback) {
-    Uri uri(path);
-    request_handlers_[uri].insert(std::make_pair(method, std::move(callback)));
+  // Stops accepting and drains open connections: in-flight requests are
+  // answered with "Connection: close" and idle keep-alive connections are
+  // closed gradually, so that clients do not all reconnect at once. Whatever
+  // is still open when `drain_timeout` expires is closed.
+  void Stop(std::chrono::milliseconds drain_timeout = kDefaultDrainTimeout);
+  // `priority` applies to the whole route, for every method. Must be
+  // called before Start().
+  void RegisterHttpRequestHandler(
+      const std::string &path, HttpMethod method,
+      const HttpRequestHandler_t callback,
+      RequestPriority priority = RequestPriority::Normal) {
+    RegisterHttpRequestHandler(Uri(path), method, callback, priority);
+  }
+  void RegisterHttpRequestHandler(
+      const Uri &uri, HttpMethod method, const HttpRequestHandler_t callback,
+      RequestPriority priority = RequestPriority::Normal) {
+    RegisterHttpRequestHandler(
+        uri, method,
+        [callback](const HttpRequest &request, RequestContext &) {
+          return callback(request);
+        },
+        priority);
+  }
+  void RegisterHttpRequestHandler(
+      const std::string &path, HttpMethod method,
+      const HttpContextHandler_t callback,
+      RequestPriority priority = RequestPriority::Normal) {
+    RegisterHttpRequestHandler(Uri(path), method, callback, priority);
+  }
+  void RegisterHttpRequestHandler(
+      const Uri &uri, HttpMethod method, const HttpContextHandler_t callback,
+      RequestPriority priority = RequestPriority::Normal) {
+    Route &route = request_handlers_[uri];
+    route.handlers.insert(std::make_pair(method, std::move(callback)));
+    if (priority != RequestPriority::Normal) route.priority = priority;
   }
-  void RegisterHttpRequestHandler(const Uri &uri, HttpMethod method,
-                                  const HttpRequestHandler_t callback) {
-    request_handlers_[uri].insert(std::make_pair(method, std::move(callback)));
+  // Server-Sent Events: GET requests to `path` get a text/event-stream
+  // response that stays open, and receive what is published to the topic.
+  // Must be called before Start().
+  void RegisterEventStream(const std::string &path, const std::string &topic) {
+    RegisterEventStream(path, [topic](const HttpRequest &) { return topic; });
   }
+  void RegisterEventStream(const std::string &path,
+                           EventTopicHandler_t topic_handler) {
+    request_handlers_[Uri(path)].event_topic = std::move(topic_handler);
+  }
+  // Sends an event to the subscribers of `topic` on every worker. The event
+  // is encoded once, whatever the number of subscribers. Callable from any
+  // thread; does nothing while the server is not running.
+  void Publish(std::string_view topic, std::string_view data,
+               std::string_view event = std::string_view(),
+               std::string_view id = std::string_view());
+  // Limits the request rate of a route, or of the whole server. Over-limit
+  // requests never reach a handler. Must be called before Start().
+  void SetRateLimit(const std::string &path, const RateLimitOptions &options);
+  void SetRateLimit(const RateLimitOptions &options);
 
   bool running() const { return running_; }
+  int active_connections() const { return active_connections_; }
+  ServerStats stats() const;
+  // Recent traces as Chrome trace event JSON (chrome://tracing, Perfetto)
+  std::string ExportTrace() const;
+  // The listening sockets, e.g. to hand them over to a new process
+  std::vector<int> listener_fds() const;
+
+  static constexpr std::chrono::milliseconds kDefaultDrainTimeout{10000};
 
 private:
   static constexpr int kMaxEvents = 10000;
   static constexpr int kThreadPoolSize = 5;
+  // Requests a connection may serve per event before the others get a turn
+  static constexpr int kMaxRequestsPerEvent = 16;
+  // Size of each worker's request arena. Bigger requests spill to the heap.
+  static constexpr size_t kArenaSize = 64 * 1024;
+  // How often workers measure their load and consider migrating connections
+  static constexpr std::chrono::milliseconds kLoadInterval{100};
 
-  std::unique_ptr<Socket> socket_;
-  bool running_;
+  std::vector<std::unique_ptr<Socket>> sockets_;
+  std::atomic<bool> running_;
+  std::atomic<bool> accepting_;
+  std::atomic<bool> draining_;
+  std::atomic<int> active_connections_;
+  std::atomic<int> requests_in_flight_;
+  std::atomic<std::uint64_t> requests_shed_;
+  std::atomic<std::uint64_t> accept_pauses_;
+  OverloadOptions overload_options_;
+  // Canned 503 responses, so that shedding a request costs no parsing
+  std::string overload_response_;
+  std::string overload_close_response_;
+  std::chrono::steady_clock::time_point drain_start_;
+  std::chrono::milliseconds drain_timeout_;
   std::thread listener_thread_;
   std::thread worker_threads_[kThreadPoolSize];
   int worker_epoll_fd_[kThreadPoolSize];
   epoll_event worker_events_[kThreadPoolSize][kMaxEvents];
-  std::map<Uri, std::map<HttpMethod, HttpRequestHandler_t>> request_handlers_;
+  // Connections accepted by the listener, waiting to be registered by their
+  // worker. Everything else about a connection is only touched by its worker.
+  std::mutex worker_pending_mutex_[kThreadPoolSize];
+  std::vector<EventData *> worker_pending_[kThreadPoolSize];
+  std::unordered_map<int, EventData *> worker_connections_[kThreadPoolSize];
+  // Connections that still had data to read when they used up their share
+  // of an iteration. Edge-triggered epoll will not report them again.
+  std::vector<EventData *> worker_ready_[kThreadPoolSize];
+  // Requests received and not served yet, by priority class
+  std::deque<EventData *> worker_queues_[kThreadPoolSize][kRequestPriorities];
+  std::atomic<int> worker_connection_count_[kThreadPoolSize];
+  std::atomic<int> worker_requests_in_flight_[kThreadPoolSize];
+  // Load of each worker, written by the worker and read by the listener and
+  // by the other workers
+  BalancingOptions balancing_options_;
+  std::atomic<int> worker_busy_permille_[kThreadPoolSize];
+  std::atomic<std::uint64_t> worker_requests_[kThreadPoolSize];
+  std::atomic<std::uint64_t> worker_migrated_in_[kThreadPoolSize];
+  std::atomic<std::uint64_t> worker_migrated_out_[kThreadPoolSize];
+  std::atomic<std::uint64_t> worker_epoll_waits_[kThreadPoolSize];
+  std::atomic<std::uint64_t> worker_epoll_ctls_[kThreadPoolSize];
+  std::atomic<std::uint64_t> worker_receives_[kThreadPoolSize];
+  std::atomic<std::uint64_t> worker_sends_[kThreadPoolSize];
+  struct PriorityCounters {
+    std::atomic<std::uint64_t> requests;
+    std::atomic<std::uint64_t> deferred;
+    std::atomic<std::uint64_t> queue_ns_total;
+    std::atomic<std::uint64_t> queue_ns_max;
+  };
+  PriorityCounters worker_priority_stats_[kThreadPoolSize][kRequestPriorities];
+  std::unique_ptr<RequestArena> worker_arenas_[kThreadPoolSize];
+  std::unique_ptr<BufferPool> worker_output_pools_[kThreadPoolSize];
+  std::chrono::steady_clock::duration worker_busy_time_[kThreadPoolSize];
+  std::chrono::steady_clock::time_point worker_load_tick_[kThreadPoolSize];
+  LoadShedder worker_shedders_[kThreadPoolSize];
+  // When each worker last polled for events, and when it polled before the
+  // batch it is processing: requests in that batch were queued since then
+  std::chrono::steady_clock::time_point worker_last_poll_[kThreadPoolSize];
+  std::chrono::steady_clock::time_point worker_queued_since_[kThreadPoolSize];
+  size_t worker_drain_closed_[kThreadPoolSize];
+  size_t worker_drain_target_[kThreadPoolSize];
+  std::map<Uri, Route> request_handlers_;
+  PriorityOptions priority_options_;
+  DeadlineOptions deadline_options_;
+  EventStreamOptions event_stream_options_;
+  // Published events, waiting for each worker to hand them to its
+  // subscribers. Workers without subscribers are not sent any.
+  std::mutex worker_inbox_mutex_[kThreadPoolSize];
+  std::vector<EventMessage *> worker_inbox_[kThreadPoolSize];
+  std::atomic<int> worker_subscribers_[kThreadPoolSize];
+  std::unordered_map<std::string, std::vector<EventData *>>
+      worker_topics_[kThreadPoolSize];
+  // Subscribers given events in this iteration, sent them once all are in
+  std::vector<EventData *> worker_flushes_[kThreadPoolSize];
+  // Request targets of the routes that are not of normal priority, in lower
+  // case, so that requests can be classified before they are parsed
+  std::vector<std::pair<std::string, RequestPriority>> priority_routes_;
+  std::unique_ptr<RateLimiter> rate_limiter_;
+  std::string rate_limited_response_;
+  std::atomic<std::uint64_t> requests_rate_limited_;
+  std::atomic<std::uint64_t> requests_expired_;
+  std::atomic<std::uint64_t> requests_cancelled_;
+  std::atomic<std::uint64_t> events_published_;
+  std::atomic<std::uint64_t> events_dropped_;
+  std::atomic<std::uint64_t> subscribers_disconnected_;
+  std::unique_ptr<AccessLogOptions> access_log_options_;
+  std::unique_ptr<AccessLogger> access_logger_;
+  std::unique_ptr<TlsContext> tls_context_;
+  std::unique_ptr<TraceOptions> trace_options_;
+  std::unique_ptr<Tracer> tracer_;
+#ifdef HIGH_PERFORMANCE_SERVER_TRACING
+  // Timestamps of each worker's current and previous poll, and whether a
+  // request was traced during the current iteration
+  std::uint64_t worker_poll_ticks_[kThreadPoolSize];
+  std::uint64_t worker_queued_ticks_[kThreadPoolSize];
+  bool worker_trace_kept_[kThreadPoolSize];
+#endif
+  std::atomic<std::uint64_t> tls_handshakes_;
+  std::atomic<std::uint64_t> tls_sessions_resumed_;
+  std::atomic<std::uint64_t> tls_kernel_offloaded_;
+  std::atomic<std::uint64_t> tls_connections_failed_;
   std::mt19937 random_generator_;
   std::uniform_int_distribution<int> sleep_times_;
 
+  // Where a streaming handler's writer sends its chunks
+  struct StreamTarget {
+    HttpServer *server;
+    int worker_id;
+    EventData *data;
+    CancellationToken *cancellation;  // cancelled when a flush fails
+  };
+
+  explicit HttpServer(std::vector<std::unique_ptr<Socket>> sockets);
+
   void SetUpEpoll();
   void Listen();
   void ProcessEvents(int worker_id);
-  void HandleEpollEvent(int epoll_fd, EventData *event, std::uint32_t events);
-  void HandleHttpData(const EventData &request, EventData *response);
-  HttpResponse HandleHttpRequest(const HttpRequest &request);
+  int NextWorker(int current_worker) const;
+  int LeastLoadedWorker(int current_worker) const;
+  void UpdateLoad(int worker_id, std::chrono::steady_clock::time_point now);
+  void MigrateConnections(int worker_id);
+  void RegisterPendingConnections(int worker_id);
+  void CloseConnection(int worker_id, EventData *data);
+  void CloseIdleConnections(int worker_id);
+  void HandleEpollEvent(int worker_id, EventData *data);
+  void ReceiveRequest(int worker_id, EventData *data);
+  RequestPriority ClassifyRequest(const EventData *data) const;
+  void ServeQueuedRequests(int worker_id);
+  void ServeRequest(int worker_id, EventData *data);
+  bool FlushResponse(int worker_id, EventData *data);
+  bool SendOutput(int worker_id, EventData *data);
+  static bool FlushStream(void *target);
+  static bool PeerGone(void *data);
+  bool ContinueTlsHandshake(int worker_id, EventData *data);
+  HttpResponse StartEventStream(int worker_id, EventData *data,
+                                const HttpRequest &request, const Route &route);
+  void Unsubscribe(int worker_id, EventData *data);
+  void DeliverEvents(int worker_id);
+  bool QueueEvent(int worker_id, EventData *data, EventMessage *message);
+  bool SendEvents(int worker_id, EventData *data);
+  void HandleSubscriberEvent(int worker_id, EventData *data);
+  bool ShouldShedRequest(int worker_id, const EventData *data,
+                         std::chrono::steady_clock::time_point now);
+  void BeginRequest(int worker_id, EventData *data);
+  void EndRequest(int worker_id, EventData *data);
+  bool HandleHttpData(int worker_id, EventData *data);
+  void LogRequest(int worker_id, EventData *data);
+#ifdef HIGH_PERFORMANCE_SERVER_TRACING
+  void TraceRequestDone(int worker_id, EventData *data);
+#endif
+  void ShedHttpData(EventData *data);
+  bool RateLimitHttpData(EventData *data, const RateLimiter &limiter,
+                         const std::string &response);
+  void RecordRefusedRequest(EventData *data, HttpStatusCode status,
+                            size_t bytes);
+  HttpResponse HandleHttpRequest(const HttpRequest &request,
+                                 const Route *route, RequestContext &context);
 
-  void controlEpollEvent(int epoll_fd, int op, int fd,
-                         std::uint32_t events = 0, void *data = nullptr);
+  void controlEpollEvent(int worker_id, int op, EventData *data,
+                         std::uint32_t events = 0);
 };
 
 } // namespace high_performance_server
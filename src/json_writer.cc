@@ -0,0 +1,177 @@
+#include "json_writer.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "simd_scan.h"
+
+namespace high_performance_server {
+
+// A comma goes before every value but the first of its container, except
+// after a key, where the colon was already written. Returns whether one is
+// needed; the caller writes it together with the value.
+bool JsonWriter::NeedsComma() {
+  if (after_key_) {
+    after_key_ = false;
+    return false;
+  }
+  if (depth_ == 0) return false;
+  std::uint64_t bit = std::uint64_t{1} << (depth_ - 1);
+  bool comma = (has_items_ & bit) != 0;
+  has_items_ |= bit;
+  return comma;
+}
+
+// Writes `text`, after a comma if needed
+void JsonWriter::WriteToken(std::string_view text) {
+  if (!NeedsComma()) {
+    output_->Write(text);
+    return;
+  }
+  char *out = output_->Reserve(text.length() + 1);
+  out[0] = ',';
+  std::memcpy(out + 1, text.data(), text.length());
+  output_->Commit(text.length() + 1);
+}
+
+void JsonWriter::Open(char bracket) {
+  if (depth_ == kMaxDepth) throw std::runtime_error("JSON nesting too deep");
+  WriteToken(std::string_view(&bracket, 1));
+  depth_++;
+  has_items_ &= ~(std::uint64_t{1} << (depth_ - 1));
+}
+
+void JsonWriter::Close(char bracket) {
+  depth_--;
+  output_->Write(std::string_view(&bracket, 1));
+}
+
+JsonWriter &JsonWriter::BeginObject() {
+  Open('{');
+  return *this;
+}
+
+JsonWriter &JsonWriter::EndObject() {
+  Close('}');
+  return *this;
+}
+
+JsonWriter &JsonWriter::BeginArray() {
+  Open('[');
+  return *this;
+}
+
+JsonWriter &JsonWriter::EndArray() {
+  Close(']');
+  return *this;
+}
+
+JsonWriter &JsonWriter::Key(std::string_view name) {
+  WriteString(NeedsComma(), name, true);
+  after_key_ = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::String(std::string_view value) {
+  WriteString(NeedsComma(), value, false);
+  return *this;
+}
+
+// Numbers are formatted in place, after the comma if there is one
+template <typename T>
+void JsonWriter::WriteNumber(T value) {
+  constexpr size_t kMaxLength = 32;  // a double takes at most 24
+  bool comma = NeedsComma();
+  char *out = output_->Reserve(kMaxLength + 1);
+  char *end = out;
+  if (comma) *end++ = ',';
+  end = std::to_chars(end, out + kMaxLength + 1, value).ptr;
+  output_->Commit(end - out);
+}
+
+JsonWriter &JsonWriter::Int(std::int64_t value) {
+  WriteNumber(value);
+  return *this;
+}
+
+JsonWriter &JsonWriter::Uint(std::uint64_t value) {
+  WriteNumber(value);
+  return *this;
+}
+
+// The shortest form that reads back as the same double
+JsonWriter &JsonWriter::Double(double value) {
+  if (!std::isfinite(value)) return Null();
+  WriteNumber(value);
+  return *this;
+}
+
+JsonWriter &JsonWriter::Bool(bool value) {
+  WriteToken(value ? std::string_view("true") : std::string_view("false"));
+  return *this;
+}
+
+JsonWriter &JsonWriter::Null() {
+  WriteToken("null");
+  return *this;
+}
+
+// Most keys and many values are short and need no escaping. Those are
+// written in one piece with their quotes, comma and colon.
+void JsonWriter::WriteString(bool comma, std::string_view value, bool key) {
+  size_t length = value.length() + 2 + comma + key;
+  if (length <= ResponseWriter::kMaxReserve &&
+      scan::FindJsonEscape(value.data(), value.length()) == scan::kNotFound) {
+    char *out = output_->Reserve(length);
+    char *end = out;
+    if (comma) *end++ = ',';
+    *end++ = '"';
+    std::memcpy(end, value.data(), value.length());
+    end += value.length();
+    *end++ = '"';
+    if (key) *end++ = ':';
+    output_->Commit(length);
+    return;
+  }
+  if (comma) output_->Write(",");
+  WriteEscaped(value);
+  if (key) output_->Write(":");
+}
+
+// Copies the runs between bytes that need escaping whole. Text is passed
+// through as is otherwise, so it should be UTF-8.
+void JsonWriter::WriteEscaped(std::string_view value) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  output_->Write("\"");
+  while (!value.empty()) {
+    size_t run = scan::FindJsonEscape(value.data(), value.length());
+    if (run == scan::kNotFound) run = value.length();
+    output_->Write(value.substr(0, run));
+    if (run == value.length()) break;
+
+    unsigned char c = static_cast<unsigned char>(value[run]);
+    char escape[6] = {'\\', 0, '0', '0', 0, 0};
+    size_t length = 2;
+    switch (c) {
+      case '"': escape[1] = '"'; break;
+      case '\\': escape[1] = '\\'; break;
+      case '\b': escape[1] = 'b'; break;
+      case '\f': escape[1] = 'f'; break;
+      case '\n': escape[1] = 'n'; break;
+      case '\r': escape[1] = 'r'; break;
+      case '\t': escape[1] = 't'; break;
+      default:
+        escape[1] = 'u';
+        escape[4] = kHexDigits[c >> 4];
+        escape[5] = kHexDigits[c & 0xF];
+        length = 6;
+    }
+    output_->Write(std::string_view(escape, length));
+    value.remove_prefix(run + 1);
+  }
+  output_->Write("\"");
+}
+
+}  // namespace high_performance_server
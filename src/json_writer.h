@@ -0,0 +1,63 @@
+// JSON serialization straight into a streamed response. Nothing is built in
+// an intermediate string: strings are escaped in place, with runs that need
+// no escaping found by the vector scan kernels and copied whole, and numbers
+// are formatted with std::to_chars into the output buffer.
+//
+//   JsonWriter json(context.Stream(HttpStatusCode::Ok, "application/json"));
+//   json.BeginObject().Key("id").Int(42).Key("tags").BeginArray();
+//   for (const auto &tag : tags) json.String(tag);
+//   json.EndArray().EndObject();
+
+#ifndef JSON_WRITER_H_
+#define JSON_WRITER_H_
+
+#include <cstdint>
+#include <string_view>
+
+#include "response_writer.h"
+
+namespace high_performance_server {
+
+// Commas and colons are written by the writer; the caller only has to nest
+// the calls properly, which is not checked.
+class JsonWriter {
+public:
+  explicit JsonWriter(ResponseWriter &output)
+      : output_(&output), depth_(0), has_items_(0), after_key_(false) {}
+
+  // Deeper nesting throws std::runtime_error
+  static constexpr int kMaxDepth = 64;
+
+  JsonWriter &BeginObject();
+  JsonWriter &EndObject();
+  JsonWriter &BeginArray();
+  JsonWriter &EndArray();
+  // The name of the next member of an object
+  JsonWriter &Key(std::string_view name);
+
+  JsonWriter &String(std::string_view value);
+  JsonWriter &Int(std::int64_t value);
+  JsonWriter &Uint(std::uint64_t value);
+  // NaN and infinities have no JSON form and are written as null
+  JsonWriter &Double(double value);
+  JsonWriter &Bool(bool value);
+  JsonWriter &Null();
+
+private:
+  ResponseWriter *output_;
+  int depth_;
+  std::uint64_t has_items_;  // one bit per open container
+  bool after_key_;
+
+  bool NeedsComma();
+  void WriteToken(std::string_view text);
+  void Open(char bracket);
+  void Close(char bracket);
+  template <typename T> void WriteNumber(T value);
+  void WriteString(bool comma, std::string_view value, bool key);
+  void WriteEscaped(std::string_view value);
+};
+
+}  // namespace high_performance_server
+
+#endif  // JSON_WRITER_H_
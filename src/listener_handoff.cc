@@ -0,0 +1,233 @@
+#include "listener_handoff.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern char **environ;
+
+namespace {
+
+// File descriptors passed through the environment start after stdio
+constexpr int kListenFdsStart = 3;
+// More listening sockets than any server needs, well below SCM_MAX_FD
+constexpr size_t kMaxHandoffFds = 64;
+constexpr int kPollIntervalMs = 100;
+constexpr int kAckTimeoutMs = 5000;
+
+bool MakeUnixAddress(const std::string &path, sockaddr_un *address) {
+  if (path.empty() || path.length() >= sizeof(address->sun_path)) {
+    return false;
+  }
+  std::memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  std::memcpy(address->sun_path, path.c_str(), path.length());
+  return true;
+}
+
+bool WaitFor(int fd, short events, int timeout_ms) {
+  pollfd entry{fd, events, 0};
+  int ready;
+  do {
+    ready = poll(&entry, 1, timeout_ms);
+  } while (ready < 0 && errno == EINTR);
+  return ready > 0;
+}
+
+bool SendFds(int unix_fd, const std::vector<int> &fds) {
+  std::uint32_t count = fds.size();
+  iovec payload{&count, sizeof(count)};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  msghdr message{};
+  message.msg_iov = &payload;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data();
+  message.msg_controllen = control.size();
+
+  cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  std::memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+
+  return sendmsg(unix_fd, &message, MSG_NOSIGNAL) ==
+         static_cast<ssize_t>(sizeof(count));
+}
+
+std::vector<int> ReceiveFds(int unix_fd) {
+  std::vector<int> fds;
+  std::uint32_t count = 0;
+  iovec payload{&count, sizeof(count)};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * kMaxHandoffFds));
+  msghdr message{};
+  message.msg_iov = &payload;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data();
+  message.msg_controllen = control.size();
+
+  if (recvmsg(unix_fd, &message, MSG_CMSG_CLOEXEC) !=
+      static_cast<ssize_t>(sizeof(count))) {
+    return fds;
+  }
+  for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    fds.resize(received);
+    std::memcpy(fds.data(), CMSG_DATA(header), sizeof(int) * received);
+  }
+  if (fds.size() != count || (message.msg_flags & MSG_CTRUNC)) {
+    for (int fd : fds) close(fd);
+    fds.clear();
+  }
+  return fds;
+}
+
+// Writes the decimal form of `value` after `prefix` without allocating, as
+// only async-signal-safe code may run between fork and exec
+void FormatVariable(char *buffer, const char *prefix, long value) {
+  size_t length = std::strlen(prefix);
+  std::memcpy(buffer, prefix, length);
+  char digits[24];
+  int count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (count > 0) buffer[length++] = digits[--count];
+  buffer[length] = '\0';
+}
+
+}  // namespace
+
+namespace high_performance_server {
+
+bool OfferListenerFds(const std::string &path, const std::vector<int> &fds,
+                      const std::atomic<bool> &cancel) {
+  sockaddr_un address;
+  if (fds.empty() || fds.size() > kMaxHandoffFds ||
+      !MakeUnixAddress(path, &address)) {
+    return false;
+  }
+  int server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server_fd < 0) return false;
+  unlink(path.c_str());
+  if (bind(server_fd, (sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(server_fd, 1) < 0) {
+    close(server_fd);
+    return false;
+  }
+
+  bool handed_off = false;
+  while (!handed_off && !cancel) {
+    if (!WaitFor(server_fd, POLLIN, kPollIntervalMs)) continue;
+    int peer_fd = accept4(server_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (peer_fd < 0) continue;
+    // The new process acknowledges once it holds the sockets; only then is
+    // it safe for this process to stop accepting
+    char ack = 0;
+    handed_off = SendFds(peer_fd, fds) &&
+                 WaitFor(peer_fd, POLLIN, kAckTimeoutMs) &&
+                 recv(peer_fd, &ack, 1, 0) == 1;
+    close(peer_fd);
+  }
+
+  close(server_fd);
+  unlink(path.c_str());
+  return handed_off;
+}
+
+std::vector<int> AcquireListenerFds(const std::string &path) {
+  std::vector<int> fds;
+  sockaddr_un address;
+  if (!MakeUnixAddress(path, &address)) return fds;
+  int unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (unix_fd < 0) return fds;
+
+  if (connect(unix_fd, (sockaddr *)&address, sizeof(address)) == 0) {
+    fds = ReceiveFds(unix_fd);
+    char ack = 1;
+    if (!fds.empty() && send(unix_fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+      for (int fd : fds) close(fd);
+      fds.clear();
+    }
+  }
+  close(unix_fd);
+  return fds;
+}
+
+pid_t SpawnWithListenerFds(const std::string &path,
+                           const std::vector<std::string> &argv,
+                           const std::vector<int> &fds) {
+  if (argv.empty() || fds.size() > kMaxHandoffFds) return -1;
+
+  // Everything the child needs is allocated before fork
+  std::vector<char *> child_argv;
+  for (const std::string &arg : argv) {
+    child_argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  child_argv.push_back(nullptr);
+  char fds_variable[32], pid_variable[32];
+  std::vector<char *> child_env;
+  for (char **variable = environ; *variable != nullptr; variable++) {
+    if (std::strncmp(*variable, "LISTEN_FDS=", 11) != 0 &&
+        std::strncmp(*variable, "LISTEN_PID=", 11) != 0) {
+      child_env.push_back(*variable);
+    }
+  }
+  child_env.push_back(fds_variable);
+  child_env.push_back(pid_variable);
+  child_env.push_back(nullptr);
+  FormatVariable(fds_variable, "LISTEN_FDS=", fds.size());
+
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  // Move the sockets out of the way first, so that placing them at 3, 4, ...
+  // cannot overwrite a socket that has not been moved yet
+  int base = kListenFdsStart + static_cast<int>(fds.size());
+  int moved[kMaxHandoffFds];
+  for (size_t i = 0; i < fds.size(); i++) {
+    if ((moved[i] = fcntl(fds[i], F_DUPFD, base)) < 0) _exit(127);
+  }
+  for (size_t i = 0; i < fds.size(); i++) {
+    if (dup2(moved[i], kListenFdsStart + i) < 0) _exit(127);
+    close(moved[i]);
+  }
+  FormatVariable(pid_variable, "LISTEN_PID=", getpid());
+  execve(path.c_str(), child_argv.data(), child_env.data());
+  _exit(127);
+}
+
+std::vector<int> InheritedListenerFds() {
+  std::vector<int> fds;
+  const char *pid_value = std::getenv("LISTEN_PID");
+  const char *fds_value = std::getenv("LISTEN_FDS");
+  if (pid_value != nullptr && fds_value != nullptr &&
+      std::strtol(pid_value, nullptr, 10) == getpid()) {
+    long count = std::strtol(fds_value, nullptr, 10);
+    for (long i = 0; i < count && i < static_cast<long>(kMaxHandoffFds); i++) {
+      int fd = kListenFdsStart + i;
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fds.push_back(fd);
+    }
+  }
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  return fds;
+}
+
+}  // namespace high_performance_server
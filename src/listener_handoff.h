@@ -0,0 +1,38 @@
+// Passes listening sockets from a running server to the process replacing
+// it, so that the new process accepts on the very same sockets and no
+// connection is refused while the old one drains.
+
+#ifndef LISTENER_HANDOFF_H_
+#define LISTENER_HANDOFF_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace high_performance_server {
+
+// Over a Unix domain socket, with SCM_RIGHTS:
+// the old process calls OfferListenerFds, which waits on `path` until a new
+// process connects with AcquireListenerFds, sends it the sockets and returns
+// true. It gives up and returns false once `cancel` is set.
+bool OfferListenerFds(const std::string &path, const std::vector<int> &fds,
+                      const std::atomic<bool> &cancel);
+// Returns the sockets offered on `path`, or nothing if no process offers any
+std::vector<int> AcquireListenerFds(const std::string &path);
+
+// Through the environment, following the systemd socket activation protocol
+// (LISTEN_FDS and LISTEN_PID, sockets starting at file descriptor 3):
+// SpawnWithListenerFds runs the program at `path` with `argv` in a child
+// process that inherits the sockets, and returns its pid, or -1 on failure.
+pid_t SpawnWithListenerFds(const std::string &path,
+                           const std::vector<std::string> &argv,
+                           const std::vector<int> &fds);
+// Returns the sockets passed to this process, if any. The variables are
+// removed so that they are not passed on to children.
+std::vector<int> InheritedListenerFds();
+
+}  // namespace high_performance_server
+
+#endif  // LISTENER_HANDOFF_H_
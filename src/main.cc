@@ -1,16 +1,26 @@
 #include <sys/resource.h>
 #include <sys/time.h>
 
+#include <atomic>
 #include <cerrno>
 #include <chrono>
+#include <csignal>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include "http_message.h"
 #include "http_server.h"
+#include "json_writer.h"
+#include "listener_handoff.h"
 #include "uri.h"
 
 using high_performance_server::HttpMethod;
@@ -18,6 +28,19 @@ using high_performance_server::HttpRequest;
 using high_performance_server::HttpResponse;
 using high_performance_server::HttpServer;
 using high_performance_server::HttpStatusCode;
+using high_performance_server::JsonWriter;
+using high_performance_server::RequestContext;
+using high_performance_server::RequestPriority;
+
+// A new server process started while this one runs takes over its listening
+// socket through this path, then this process drains and exits
+constexpr char kHandoffPath[] = "/tmp/high_performance_server.handoff";
+// Where the "trace" command writes recent request traces
+constexpr char kTracePath[] = "trace.json";
+
+std::atomic<bool> stop_requested(false);
+
+void request_stop(int) { stop_requested = true; }
 
 void ensure_enough_resource(int resource, std::uint32_t soft_limit,
                             std::uint32_t hard_limit) {
@@ -40,20 +63,76 @@ void ensure_enough_resource(int resource, std::uint32_t soft_limit,
   }
 }
 
-int main(void) {
-  std::string host = "0.0.0.0";
-  int port = 8080;
-  HttpServer server(host, port);
+int main(int argc, char* argv[]) {
+  // Comma-separated, e.g. "0.0.0.0:8080,[::1]:8080,unix:/tmp/server.sock"
+  std::string addresses = "0.0.0.0:8080";
+  if (const char* listen = std::getenv("LISTEN")) addresses = listen;
+  std::vector<high_performance_server::ListenEndpoint> endpoints;
+  try {
+    size_t start = 0;
+    while (start <= addresses.length()) {
+      size_t end = addresses.find(',', start);
+      if (end == std::string::npos) end = addresses.length();
+      endpoints.push_back(high_performance_server::ListenEndpoint::Parse(
+          addresses.substr(start, end - start)));
+      start = end + 1;
+    }
+  } catch (std::exception& exception) {
+    std::cerr << "Error: " << exception.what() << std::endl;
+    return -1;
+  }
+  std::unique_ptr<HttpServer> server;
+
+  // Take over the listening sockets of a running server, if there is one
+  std::vector<int> listener_fds =
+      high_performance_server::InheritedListenerFds();
+  if (listener_fds.empty()) {
+    listener_fds = high_performance_server::AcquireListenerFds(kHandoffPath);
+  }
+  if (listener_fds.empty()) {
+    server = std::make_unique<HttpServer>(endpoints);
+  } else {
+    server = std::make_unique<HttpServer>(listener_fds, endpoints);
+  }
+
+  high_performance_server::OverloadOptions overload;
+  overload.max_connections = 10000;
+  server->SetOverloadOptions(overload);
 
-  auto say_hello = [](const HttpRequest& request) -> HttpResponse {
-    HttpResponse response(HttpStatusCode::Ok);
+  if (const char* timeout = std::getenv("REQUEST_TIMEOUT_MS")) {
+    high_performance_server::DeadlineOptions deadlines;
+    deadlines.request_timeout = std::chrono::milliseconds(std::atoi(timeout));
+    server->SetDeadlineOptions(deadlines);
+  }
+
+  const char* sample_rate = std::getenv("TRACE_SAMPLE_RATE");
+  const char* latency = std::getenv("TRACE_LATENCY_US");
+  if (sample_rate != nullptr || latency != nullptr) {
+    high_performance_server::TraceOptions options;
+    options.sample_rate = sample_rate ? std::atoi(sample_rate) : 0;
+    options.latency_threshold =
+        std::chrono::microseconds(latency ? std::atoi(latency) : 0);
+    server->EnableTracing(options);
+  }
+
+  if (const char* access_log = std::getenv("ACCESS_LOG")) {
+    high_performance_server::AccessLogOptions options;
+    options.path = access_log;
+    server->EnableAccessLog(options);
+  }
+
+  auto say_hello = [](const HttpRequest& request,
+                      RequestContext& context) -> HttpResponse {
+    HttpResponse response(HttpStatusCode::Ok, context.resource());
     response.SetHeader("Content-Type", "text/plain");
     response.SetContent("Hello, world\n");
     return response;
   };
-  auto send_html = [](const HttpRequest& request) -> HttpResponse {
-    HttpResponse response(HttpStatusCode::Ok);
-    std::string content;
+  // Both the page and the response are built in the request's arena
+  auto send_html = [](const HttpRequest& request,
+                      RequestContext& context) -> HttpResponse {
+    HttpResponse response(HttpStatusCode::Ok, context.resource());
+    std::pmr::string content(context.resource());
     content += "<!doctype html>\n";
     content += "<html>\n<body>\n\n";
     content += "<h1>Hello, world in an Html page</h1>\n";
@@ -61,27 +140,116 @@ int main(void) {
     content += "</body>\n</html>\n";
 
     response.SetHeader("Content-Type", "text/html");
-    response.SetContent(content);
+    response.SetContent(std::move(content));
     return response;
   };
 
-  server.RegisterHttpRequestHandler("/", HttpMethod::HEAD, say_hello);
-  server.RegisterHttpRequestHandler("/", HttpMethod::GET, say_hello);
-  server.RegisterHttpRequestHandler("/welcome", HttpMethod::HEAD, send_html);
-  server.RegisterHttpRequestHandler("/welcome", HttpMethod::GET, send_html);
+  // Streamed as it is serialized, without building the document first
+  HttpServer* stats_server = server.get();
+  auto send_stats = [stats_server](const HttpRequest& request,
+                                   RequestContext& context) -> HttpResponse {
+    high_performance_server::ServerStats stats = stats_server->stats();
+    JsonWriter json(context.Stream(HttpStatusCode::Ok, "application/json"));
+    json.BeginObject()
+        .Key("connections").Int(stats.connections)
+        .Key("requests_in_flight").Int(stats.requests_in_flight)
+        .Key("requests_shed").Uint(stats.requests_shed)
+        .Key("requests_expired").Uint(stats.requests_expired)
+        .Key("requests_cancelled").Uint(stats.requests_cancelled)
+        .Key("priorities").BeginArray();
+    for (const auto& priority : stats.priorities) {
+      json.BeginObject()
+          .Key("requests").Uint(priority.requests)
+          .Key("deferred").Uint(priority.deferred)
+          .Key("queue_ns_max").Uint(priority.queue_ns_max)
+          .EndObject();
+    }
+    json.EndArray().Key("workers").BeginArray();
+    for (const auto& worker : stats.workers) {
+      json.BeginObject()
+          .Key("connections").Int(worker.connections)
+          .Key("busy").Double(worker.busy)
+          .Key("requests").Uint(worker.requests)
+          .EndObject();
+    }
+    json.EndArray().EndObject();
+    return HttpResponse();
+  };
+
+  server->RegisterHttpRequestHandler("/", HttpMethod::HEAD, say_hello);
+  server->RegisterHttpRequestHandler("/", HttpMethod::GET, say_hello);
+  server->RegisterHttpRequestHandler("/welcome", HttpMethod::HEAD, send_html);
+  server->RegisterHttpRequestHandler("/welcome", HttpMethod::GET, send_html);
+  // Monitoring keeps answering while the other routes are saturated
+  server->RegisterHttpRequestHandler("/stats", HttpMethod::GET, send_stats,
+                                     RequestPriority::High);
+  // Server-Sent Events carrying the connection count, once a second
+  server->RegisterEventStream("/events", "stats");
 
   try {
-    std::cout << "Starting server on " << host << ":" << port << "..." << std::endl;
-    server.Start();
+    const char* certificate = std::getenv("TLS_CERTIFICATE");
+    const char* private_key = std::getenv("TLS_PRIVATE_KEY");
+    if (certificate != nullptr && private_key != nullptr) {
+      high_performance_server::TlsOptions options;
+      options.certificate_file = certificate;
+      options.private_key_file = private_key;
+      server->EnableTls(options);
+    }
+    // Writes to a closed connection fail with EPIPE instead. TLS writes go
+    // through OpenSSL, which cannot pass MSG_NOSIGNAL.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Starting server on " << addresses << "..." << std::endl;
+    server->Start();
     std::cout << "Server running. Type 'quit' to stop." << std::endl;
 
-    std::string command;
-    while (std::cin >> command, command != "quit") {
+    std::signal(SIGTERM, request_stop);
+    std::signal(SIGINT, request_stop);
+    // The successor runs this very binary, whatever argv[0] says and
+    // whatever the working directory is, with the same arguments
+    std::vector<std::string> arguments(argv, argv + argc);
+    std::thread([&server, arguments] {
+      std::string command;
+      while (std::cin >> command) {
+        if (command == "quit") {
+          stop_requested = true;
+          break;
+        }
+        if (command == "trace") {
+          std::ofstream(kTracePath) << server->ExportTrace();
+          std::cout << "Trace written to " << kTracePath << std::endl;
+        }
+        // The new process inherits the listening sockets, and this one
+        // drains and exits
+        if (command == "restart" &&
+            high_performance_server::SpawnWithListenerFds(
+                "/proc/self/exe", arguments, server->listener_fds()) > 0) {
+          std::cout << "Successor started." << std::endl;
+          stop_requested = true;
+          break;
+        }
+      }
+    }).detach();
+    std::thread handoff([&server] {
+      if (high_performance_server::OfferListenerFds(
+              kHandoffPath, server->listener_fds(), stop_requested)) {
+        std::cout << "Listening socket handed over." << std::endl;
+        stop_requested = true;
+      }
+    });
+
+    for (int tick = 1; !stop_requested; tick++) {
       std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      if (tick % 10 == 0) {
+        server->Publish("stats", "{\"connections\":" +
+                                     std::to_string(server->stats().connections) +
+                                     "}");
+      }
     }
+    handoff.join();
 
     std::cout << "Stopping server..." << std::endl;
-    server.Stop();
+    server->Stop();
     std::cout << "Server stopped." << std::endl;
   } catch (std::exception& exception) {
     std::cerr << "Error: " << exception.what() << std::endl;
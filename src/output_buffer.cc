@@ -0,0 +1,120 @@
+#include "output_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace high_performance_server {
+
+BufferPool::~BufferPool() {
+  while (free_ != nullptr) {
+    OutputBlock *block = free_;
+    free_ = block->next;
+    delete block;
+  }
+}
+
+OutputBlock *BufferPool::Acquire() {
+  OutputBlock *block = free_;
+  if (block != nullptr) {
+    free_ = block->next;
+    cached_--;
+  } else {
+    block = new OutputBlock;
+    allocated_++;
+  }
+  block->next = nullptr;
+  block->begin = 0;
+  block->end = 0;
+  return block;
+}
+
+void BufferPool::Release(OutputBlock *block) {
+  if (cached_ >= max_cached_) {
+    delete block;
+    return;
+  }
+  block->next = free_;
+  free_ = block;
+  cached_++;
+}
+
+void OutputChain::AddBlock() {
+  OutputBlock *block = pool_->Acquire();
+  if (tail_ == nullptr) {
+    head_ = block;
+  } else {
+    tail_->next = block;
+  }
+  tail_ = block;
+}
+
+void OutputChain::Append(const char *data, size_t length) {
+  while (length > 0) {
+    if (tail_ == nullptr || tail_->end == OutputBlock::kSize) AddBlock();
+    size_t count = std::min(length, OutputBlock::kSize - tail_->end);
+    std::memcpy(tail_->data + tail_->end, data, count);
+    tail_->end += count;
+    size_ += count;
+    data += count;
+    length -= count;
+  }
+}
+
+char *OutputChain::Reserve(size_t length) {
+  if (tail_ == nullptr || OutputBlock::kSize - tail_->end < length) {
+    AddBlock();
+  }
+  return tail_->data + tail_->end;
+}
+
+int OutputChain::Fill(iovec *vectors, int max_count) const {
+  int count = 0;
+  for (OutputBlock *block = head_; block != nullptr && count < max_count;
+       block = block->next) {
+    if (block->end == block->begin) continue;
+    vectors[count].iov_base = block->data + block->begin;
+    vectors[count].iov_len = block->end - block->begin;
+    count++;
+  }
+  return count;
+}
+
+std::string_view OutputChain::Front() const {
+  for (OutputBlock *block = head_; block != nullptr; block = block->next) {
+    if (block->end > block->begin) {
+      return std::string_view(block->data + block->begin,
+                              block->end - block->begin);
+    }
+  }
+  return std::string_view();
+}
+
+void OutputChain::Consume(size_t length) {
+  size_ -= length;
+  while (head_ != nullptr) {
+    size_t available = head_->end - head_->begin;
+    if (length < available) {
+      head_->begin += length;
+      return;
+    }
+    // Sent blocks go back to the pool right away, so that idle connections
+    // hold none
+    length -= available;
+    OutputBlock *block = head_;
+    head_ = block->next;
+    if (head_ == nullptr) tail_ = nullptr;
+    pool_->Release(block);
+  }
+}
+
+void OutputChain::Clear() {
+  while (head_ != nullptr) {
+    OutputBlock *block = head_;
+    head_ = block->next;
+    pool_->Release(block);
+  }
+  tail_ = nullptr;
+  size_ = 0;
+}
+
+}  // namespace high_performance_server
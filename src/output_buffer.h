@@ -0,0 +1,105 @@
+// Response bytes waiting to be sent, in fixed-size blocks taken from a
+// per-worker pool. Responses are serialized straight into the blocks and
+// sent from them with one gathering sendmsg, whatever their size.
+
+#ifndef OUTPUT_BUFFER_H_
+#define OUTPUT_BUFFER_H_
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace high_performance_server {
+
+struct OutputBlock {
+  static constexpr size_t kSize = 16 * 1024 - 64;
+
+  OutputBlock *next;
+  size_t begin;  // first unsent byte
+  size_t end;    // first free byte
+  char data[kSize];
+};
+
+// Free blocks of one worker. Not thread-safe.
+class BufferPool {
+public:
+  // Keeps at most `max_cached` free blocks; more are returned to the heap
+  explicit BufferPool(size_t max_cached = 256)
+      : free_(nullptr), cached_(0), max_cached_(max_cached), allocated_(0) {}
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  OutputBlock *Acquire();
+  void Release(OutputBlock *block);
+
+  // Blocks ever taken from the heap
+  std::uint64_t allocated() const { return allocated_; }
+
+private:
+  OutputBlock *free_;
+  size_t cached_;
+  size_t max_cached_;
+  std::uint64_t allocated_;
+};
+
+// A queue of bytes in pooled blocks
+class OutputChain {
+public:
+  OutputChain() : pool_(nullptr), head_(nullptr), tail_(nullptr), size_(0) {}
+  ~OutputChain() { Clear(); }
+
+  OutputChain(const OutputChain &) = delete;
+  OutputChain &operator=(const OutputChain &) = delete;
+
+  // Where blocks come from and go back to. Only changed while empty, e.g.
+  // when a connection moves to another worker.
+  void set_pool(BufferPool *pool) { pool_ = pool; }
+
+  void Append(const char *data, size_t length);
+  void Append(std::string_view data) { Append(data.data(), data.length()); }
+  // At least `length` contiguous bytes to write into, `length` being at
+  // most OutputBlock::kSize, followed by Commit() of what was written
+  char *Reserve(size_t length);
+  void Commit(size_t length) {
+    tail_->end += length;
+    size_ += length;
+  }
+  // Drops the last `length` bytes, which must all be in the last block
+  void Truncate(size_t length) {
+    tail_->end -= length;
+    size_ -= length;
+  }
+
+  // The unsent bytes, at most `max_count` blocks of them. Returns the
+  // number of entries filled.
+  int Fill(iovec *vectors, int max_count) const;
+  // The first unsent bytes, in one piece
+  std::string_view Front() const;
+  // Marks `length` bytes as sent, returning sent blocks to the pool
+  void Consume(size_t length);
+  void Clear();
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // Room left in the last block, which Commit() can fill without Reserve()
+  size_t tail_room() const {
+    return tail_ == nullptr ? 0 : OutputBlock::kSize - tail_->end;
+  }
+  char *tail_end() const { return tail_->data + tail_->end; }
+
+private:
+  BufferPool *pool_;
+  OutputBlock *head_;
+  OutputBlock *tail_;
+  size_t size_;
+
+  void AddBlock();
+};
+
+}  // namespace high_performance_server
+
+#endif  // OUTPUT_BUFFER_H_
@@ -0,0 +1,70 @@
+// Overload protection: connection and in-flight request limits, and adaptive
+// load shedding driven by how long requests wait before being handled
+
+#ifndef OVERLOAD_H_
+#define OVERLOAD_H_
+
+#include <chrono>
+#include <cstdint>
+
+namespace high_performance_server {
+
+// Limits are disabled when set to 0
+struct OverloadOptions {
+  // When either connection limit is reached the listener stops accepting and
+  // new connections wait in the kernel backlog
+  int max_connections = 0;
+  int max_connections_per_worker = 0;
+  // Requests beyond these limits get an immediate 503 Service Unavailable
+  int max_requests_in_flight = 0;
+  int max_requests_in_flight_per_worker = 0;
+  // Adaptive shedding: a worker is overloaded when no request waited less
+  // than `target_queue_delay` during a whole `interval`
+  bool adaptive_shedding = true;
+  std::chrono::microseconds target_queue_delay{5000};
+  std::chrono::milliseconds interval{100};
+  // Sent in the Retry-After header of 503 responses
+  std::chrono::seconds retry_after{1};
+};
+
+// CoDel-style detector for a standing request queue, owned by one worker.
+// Like CoDel it looks at the minimum queueing delay over an interval rather
+// than at the queue length: a short burst leaves the minimum low, a standing
+// queue does not. While overloaded, requests that waited longer than the
+// target are shed so that the ones still served meet it; once a request is
+// served within the target the worker leaves the overloaded state.
+class LoadShedder {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  LoadShedder() = default;
+  explicit LoadShedder(const OverloadOptions &options)
+      : target_(options.target_queue_delay), interval_(options.interval) {}
+
+  // Returns true if a request that waited `queue_delay` should be shed
+  bool ShouldShed(Clock::duration queue_delay, Clock::time_point now) {
+    if (queue_delay < target_) {
+      first_above_time_ = Clock::time_point();
+      overloaded_ = false;
+      return false;
+    }
+    if (first_above_time_ == Clock::time_point()) {
+      first_above_time_ = now + interval_;
+    } else if (now >= first_above_time_) {
+      overloaded_ = true;
+    }
+    return overloaded_;
+  }
+
+  bool overloaded() const { return overloaded_; }
+
+private:
+  Clock::duration target_ = std::chrono::milliseconds(5);
+  Clock::duration interval_ = std::chrono::milliseconds(100);
+  Clock::time_point first_above_time_;
+  bool overloaded_ = false;
+};
+
+}  // namespace high_performance_server
+
+#endif  // OVERLOAD_H_
@@ -0,0 +1,159 @@
+#include "pubsub.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+namespace high_performance_server {
+
+namespace {
+
+constexpr std::string_view kDataField = "data: ";
+
+// Calls `line` with each line of `text`, which SSE lets end with CRLF, LF or
+// CR. There is always at least one, maybe empty.
+template <typename Function>
+void ForEachLine(std::string_view text, Function line) {
+  while (true) {
+    size_t end = text.find_first_of("\r\n");
+    if (end == std::string_view::npos) {
+      line(text);
+      return;
+    }
+    line(text.substr(0, end));
+    size_t next = end + 1;
+    if (text[end] == '\r' && next < text.length() && text[next] == '\n') next++;
+    text.remove_prefix(next);
+  }
+}
+
+size_t HexDigits(size_t value) {
+  size_t digits = 1;
+  while (value >>= 4) digits++;
+  return digits;
+}
+
+char *Put(char *out, std::string_view text) {
+  std::memcpy(out, text.data(), text.length());
+  return out + text.length();
+}
+
+}  // namespace
+
+EventMessage *EventMessage::Create(std::string_view topic,
+                                   std::string_view data,
+                                   std::string_view event,
+                                   std::string_view id) {
+  if (event.find_first_of("\r\n") != std::string_view::npos ||
+      id.find_first_of("\r\n") != std::string_view::npos) {
+    throw std::invalid_argument("Event type and id must be single lines");
+  }
+  size_t body = 1;  // the blank line ending the event
+  if (!id.empty()) body += 4 + id.length() + 1;
+  if (!event.empty()) body += 7 + event.length() + 1;
+  ForEachLine(data, [&body](std::string_view line) {
+    body += kDataField.length() + line.length() + 1;
+  });
+  size_t size = HexDigits(body) + 2 + body + 2;
+
+  void *memory = ::operator new(sizeof(EventMessage) + topic.length() + size);
+  EventMessage *message = new (memory) EventMessage(topic.length(), size);
+  char *out = Put(message->data(), topic);
+  static const char kHexDigits[] = "0123456789abcdef";
+  for (size_t digit = HexDigits(body); digit > 0; digit--) {
+    *out++ = kHexDigits[(body >> (4 * (digit - 1))) & 0xF];
+  }
+  out = Put(out, "\r\n");
+  if (!id.empty()) {
+    out = Put(out, "id: ");
+    out = Put(out, id);
+    *out++ = '\n';
+  }
+  if (!event.empty()) {
+    out = Put(out, "event: ");
+    out = Put(out, event);
+    *out++ = '\n';
+  }
+  ForEachLine(data, [&out](std::string_view line) {
+    out = Put(out, kDataField);
+    out = Put(out, line);
+    *out++ = '\n';
+  });
+  out = Put(out, "\n\r\n");
+  return message;
+}
+
+void EventMessage::Unref() {
+  if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+  this->~EventMessage();
+  ::operator delete(this);
+}
+
+void EventBacklog::Push(EventMessage *message) {
+  if (count_ == ring_.size()) {
+    // Grow, unrolling the ring so that it starts at 0 again
+    std::vector<EventMessage *> ring(std::min(
+        std::max<size_t>(4, ring_.size() * 2), capacity_));
+    for (size_t i = 0; i < count_; i++) ring[i] = at(i);
+    ring_.swap(ring);
+    head_ = 0;
+  }
+  message->Ref();
+  at(count_) = message;
+  count_++;
+}
+
+bool EventBacklog::DropOldest() {
+  size_t index = offset_ > 0 || front_pinned_ ? 1 : 0;
+  if (index >= count_) return false;
+  at(index)->Unref();
+  // Close the gap, which is at most one message from the front
+  if (index == 1) at(1) = at(0);
+  head_ = (head_ + 1) % ring_.size();
+  count_--;
+  return true;
+}
+
+void EventBacklog::Clear() {
+  for (size_t i = 0; i < count_; i++) at(i)->Unref();
+  head_ = 0;
+  count_ = 0;
+  offset_ = 0;
+  front_pinned_ = false;
+}
+
+int EventBacklog::Fill(iovec *vectors, int max_count) const {
+  int count = 0;
+  for (size_t i = 0; i < count_ && count < max_count; i++) {
+    std::string_view bytes = at(i)->bytes();
+    if (i == 0) bytes.remove_prefix(offset_);
+    vectors[count].iov_base = const_cast<char *>(bytes.data());
+    vectors[count].iov_len = bytes.length();
+    count++;
+  }
+  return count;
+}
+
+std::string_view EventBacklog::Front() const {
+  if (count_ == 0) return std::string_view();
+  return at(0)->bytes().substr(offset_);
+}
+
+void EventBacklog::Consume(size_t length) {
+  while (length > 0) {
+    size_t available = at(0)->bytes().length() - offset_;
+    if (length < available) {
+      offset_ += length;
+      return;
+    }
+    length -= available;
+    at(0)->Unref();
+    head_ = (head_ + 1) % ring_.size();
+    count_--;
+    offset_ = 0;
+    front_pinned_ = false;
+  }
+}
+
+}  // namespace high_performance_server
@@ -0,0 +1,126 @@
+// Publish/subscribe for Server-Sent Events. A published event is encoded
+// once, as the chunk every subscriber is sent, into a reference-counted
+// message that all workers share. Each subscriber only queues pointers to
+// the messages it has yet to send, and sends them from the shared bytes.
+
+#ifndef PUBSUB_H_
+#define PUBSUB_H_
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace high_performance_server {
+
+// One event of a topic, immutable once created. Thread-safe to share.
+class EventMessage {
+public:
+  // Encodes an event in the text/event-stream format, framed as one chunk
+  // of a chunked response. The `data` is split into one "data:" field per
+  // line. The event type and id are left out when empty. The message holds
+  // one reference, for the caller.
+  static EventMessage *Create(std::string_view topic, std::string_view data,
+                              std::string_view event = std::string_view(),
+                              std::string_view id = std::string_view());
+
+  EventMessage(const EventMessage &) = delete;
+  EventMessage &operator=(const EventMessage &) = delete;
+
+  void Ref() { refs_.fetch_add(1, std::memory_order_relaxed); }
+  // Frees the message with the last reference
+  void Unref();
+
+  std::string_view topic() const {
+    return std::string_view(data(), topic_length_);
+  }
+  // The chunk as sent
+  std::string_view bytes() const {
+    return std::string_view(data() + topic_length_, size_);
+  }
+
+private:
+  std::atomic<std::uint32_t> refs_;
+  std::uint32_t topic_length_;
+  size_t size_;
+
+  EventMessage(size_t topic_length, size_t size)
+      : refs_(1), topic_length_(static_cast<std::uint32_t>(topic_length)),
+        size_(size) {}
+  // The topic and then the chunk follow the header in the same allocation
+  char *data() { return reinterpret_cast<char *>(this + 1); }
+  const char *data() const { return reinterpret_cast<const char *>(this + 1); }
+};
+
+// Messages a subscriber has yet to send, oldest first, holding a reference
+// to each. The ring grows as needed up to `capacity` messages. Not
+// thread-safe.
+class EventBacklog {
+public:
+  explicit EventBacklog(size_t capacity)
+      : capacity_(capacity), head_(0), count_(0), offset_(0),
+        front_pinned_(false) {}
+  ~EventBacklog() { Clear(); }
+
+  EventBacklog(const EventBacklog &) = delete;
+  EventBacklog &operator=(const EventBacklog &) = delete;
+
+  bool empty() const { return count_ == 0; }
+  bool full() const { return count_ == capacity_; }
+  size_t size() const { return count_; }
+
+  // Takes a reference. The backlog must not be full.
+  void Push(EventMessage *message);
+  // Drops the oldest message that has not started to be sent. Returns false
+  // if there is none.
+  bool DropOldest();
+  void Clear();
+
+  // The unsent bytes of at most `max_count` messages. Returns the number of
+  // entries filled.
+  int Fill(iovec *vectors, int max_count) const;
+  // The first unsent bytes, in one piece
+  std::string_view Front() const;
+  // Marks `length` bytes sent, releasing the messages sent in full
+  void Consume(size_t length);
+  // Keeps DropOldest() from dropping the oldest message before it is sent
+  // in full, although none of it is marked sent: a TLS write that has to be
+  // retried must be retried with the same bytes
+  void PinFront() { front_pinned_ = true; }
+
+private:
+  std::vector<EventMessage *> ring_;
+  size_t capacity_;
+  size_t head_;
+  size_t count_;
+  size_t offset_;  // bytes of the oldest message already sent
+  bool front_pinned_;
+
+  EventMessage *&at(size_t index) {
+    return ring_[(head_ + index) % ring_.size()];
+  }
+  EventMessage *at(size_t index) const {
+    return ring_[(head_ + index) % ring_.size()];
+  }
+};
+
+// A connection subscribed to a topic, owned by its worker
+struct EventSubscription {
+  EventSubscription(std::string topic, size_t max_backlog)
+      : topic(std::move(topic)), index(0), flush_pending(false),
+        overflowed(false), backlog(max_backlog) {}
+  std::string topic;
+  size_t index;        // in its worker's subscriber list of the topic
+  bool flush_pending;  // in its worker's list of subscribers to flush
+  bool overflowed;     // fell behind, and is to be disconnected
+  EventBacklog backlog;
+};
+
+}  // namespace high_performance_server
+
+#endif  // PUBSUB_H_
@@ -0,0 +1,102 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace {
+
+constexpr std::uint64_t kOne = 1 << 16;  // one token in 16.16 fixed point
+
+// Keys are spread over the table with the splitmix64 finalizer
+std::uint64_t Mix(std::uint64_t key) {
+  key ^= key >> 30;
+  key *= 0xBF58476D1CE4E5B9ULL;
+  key ^= key >> 27;
+  key *= 0x94D049BB133111EBULL;
+  key ^= key >> 31;
+  return key;
+}
+
+std::uint64_t Pack(std::uint32_t time_ms, std::uint64_t tokens) {
+  return static_cast<std::uint64_t>(time_ms) << 32 | tokens;
+}
+
+std::uint32_t TimeOf(std::uint64_t bucket) { return bucket >> 32; }
+std::uint64_t TokensOf(std::uint64_t bucket) { return bucket & 0xFFFFFFFF; }
+
+}  // namespace
+
+namespace high_performance_server {
+
+RateLimiter::RateLimiter(const RateLimitOptions &options) : options_(options) {
+  size_t size = 1;
+  while (size < std::max<size_t>(options.table_size, kProbeLength)) size <<= 1;
+  mask_ = size - 1;
+  double burst = std::min(std::max(options.burst, 1.0), 65535.0);
+  capacity_ = static_cast<std::uint64_t>(burst * kOne);
+  refill_per_second_ = std::max<std::uint64_t>(
+      static_cast<std::uint64_t>(options.requests_per_second * kOne), 1);
+  full_after_ms_ = capacity_ * 1000 / refill_per_second_ + 1;
+  slots_ = std::make_unique<Slot[]>(size);
+}
+
+bool RateLimiter::Allow(std::uint64_t key, std::uint64_t now_ms) {
+  // The home slot comes from the whole hash, before the low bit is set to
+  // tell the key from an empty slot, which is 0
+  const std::uint64_t hash = Mix(key);
+  const size_t start = hash & mask_;
+  key = hash | 1;
+  const std::uint32_t now = static_cast<std::uint32_t>(now_ms);
+  Slot *victim = nullptr;
+  std::uint32_t victim_age = 0;
+
+  for (size_t i = 0; i < kProbeLength; i++) {
+    Slot *slot = &slots_[(start + i) & mask_];
+    std::uint64_t slot_key = slot->key.load(std::memory_order_acquire);
+    if (slot_key == key) return Consume(slot, now);
+    if (slot_key == 0) {
+      if (slot->key.compare_exchange_strong(slot_key, key,
+                                            std::memory_order_acq_rel)) {
+        slot->bucket.store(Pack(now, capacity_), std::memory_order_release);
+        return Consume(slot, now);
+      }
+      if (slot_key == key) return Consume(slot, now);
+    }
+    std::uint32_t age =
+        now - TimeOf(slot->bucket.load(std::memory_order_relaxed));
+    if (victim == nullptr || age > victim_age) {
+      victim = slot;
+      victim_age = age;
+    }
+  }
+
+  // All nearby slots belong to other clients: take over the one refilled
+  // longest ago. Racing with its owner only makes the limit approximate.
+  victim->key.store(key, std::memory_order_release);
+  victim->bucket.store(Pack(now, capacity_), std::memory_order_release);
+  return Consume(victim, now);
+}
+
+bool RateLimiter::Consume(Slot *slot, std::uint32_t now_ms) {
+  std::uint64_t bucket = slot->bucket.load(std::memory_order_acquire);
+  while (true) {
+    std::uint32_t elapsed = now_ms - TimeOf(bucket);
+    // A time slightly ahead of ours, written by another worker, is not
+    // a wrap-around; treat it as no time having passed
+    if (elapsed > 0x80000000u) elapsed = 0;
+    std::uint64_t refill =
+        std::min<std::uint64_t>(elapsed, full_after_ms_) * refill_per_second_ /
+        1000;
+    std::uint64_t tokens = std::min(TokensOf(bucket) + refill, capacity_);
+    if (tokens < kOne) return false;
+    std::uint32_t time = elapsed > 0 ? now_ms : TimeOf(bucket);
+    if (slot->bucket.compare_exchange_weak(bucket, Pack(time, tokens - kOne),
+                                           std::memory_order_acq_rel)) {
+      return true;
+    }
+  }
+}
+
+}  // namespace high_performance_server
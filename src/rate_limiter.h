@@ -0,0 +1,68 @@
+// Token-bucket rate limiting keyed by client address, in a fixed-size table
+// shared by all workers and updated with atomic compare-and-swap
+
+#ifndef RATE_LIMITER_H_
+#define RATE_LIMITER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace high_performance_server {
+
+enum class RateLimitAction {
+  Reject,  // answer 429 Too Many Requests
+  Close    // close the connection without answering
+};
+
+struct RateLimitOptions {
+  double requests_per_second = 100;
+  double burst = 100;  // bucket capacity, at most 65535 requests
+  // One bucket per client address, or a single bucket for all clients
+  bool per_client = true;
+  RateLimitAction action = RateLimitAction::Reject;
+  // Number of buckets, rounded up to a power of two. When clients outnumber
+  // buckets, the least recently used nearby bucket is taken over.
+  size_t table_size = 1 << 16;
+};
+
+class RateLimiter {
+public:
+  explicit RateLimiter(const RateLimitOptions &options);
+  ~RateLimiter() = default;
+
+  RateLimiter(const RateLimiter &) = delete;
+  RateLimiter &operator=(const RateLimiter &) = delete;
+
+  // Takes one token from the bucket of `key` at time `now_ms` (any
+  // monotonic millisecond clock). Returns false if the bucket is empty.
+  bool Allow(std::uint64_t key, std::uint64_t now_ms);
+
+  const RateLimitOptions &options() const { return options_; }
+
+private:
+  // Number of consecutive slots searched for a key before evicting one
+  static constexpr size_t kProbeLength = 8;
+
+  // A bucket fits in one 64-bit word so that it is updated with a single
+  // CAS: the upper half holds the last refill time in milliseconds (modulo
+  // 2^32) and the lower half the tokens in 16.16 fixed point.
+  struct alignas(16) Slot {
+    std::atomic<std::uint64_t> key;
+    std::atomic<std::uint64_t> bucket;
+  };
+
+  RateLimitOptions options_;
+  size_t mask_;
+  std::uint64_t capacity_;           // in 16.16 fixed point
+  std::uint64_t refill_per_second_;  // in 16.16 fixed point
+  std::uint64_t full_after_ms_;      // time to refill an empty bucket
+  std::unique_ptr<Slot[]> slots_;
+
+  bool Consume(Slot *slot, std::uint32_t now_ms);
+};
+
+}  // namespace high_performance_server
+
+#endif  // RATE_LIMITER_H_
@@ -0,0 +1,144 @@
+#include "response_writer.h"
+
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+
+namespace high_performance_server {
+
+namespace {
+
+void WriteStatusLine(HttpVersion version, HttpStatusCode status,
+                     OutputChain *output) {
+  char code[8];
+  code[0] = ' ';
+  char *end = std::to_chars(code + 1, code + sizeof(code) - 1,
+                            static_cast<int>(status)).ptr;
+  *end++ = ' ';
+  output->Append(to_string(version));
+  output->Append(code, end - code);
+  output->Append(to_string(status));
+  output->Append("\r\n", 2);
+}
+
+void WriteHeader(std::string_view name, std::string_view value,
+                 OutputChain *output) {
+  output->Append(name);
+  output->Append(": ", 2);
+  output->Append(value);
+  output->Append("\r\n", 2);
+}
+
+}  // namespace
+
+// Same bytes as toString(), without building them in a string first
+void WriteResponse(const HttpResponse &response, bool send_content,
+                   OutputChain *output) {
+  WriteStatusLine(response.version(), response.status_code(), output);
+  for (const auto &header : response.headers()) {
+    WriteHeader(header.first, header.second, output);
+  }
+  output->Append("\r\n", 2);
+  if (send_content) output->Append(response.content());
+}
+
+ResponseWriter::ResponseWriter(OutputChain *output, bool send_content,
+                               bool close, FlushFunction flush,
+                               void *flush_context)
+    : output_(output), flush_(flush), flush_context_(flush_context),
+      send_content_(send_content), close_(close), failed_(false),
+      state_(State::Idle), status_(HttpStatusCode::Ok), chunk_header_(nullptr),
+      chunk_bytes_(0), body_bytes_(0) {}
+
+void ResponseWriter::Begin(HttpStatusCode status) {
+  if (state_ != State::Idle) {
+    throw std::logic_error("Response already started");
+  }
+  status_ = status;
+  state_ = State::Head;
+  WriteStatusLine(HttpVersion::HTTP_1_1, status, output_);
+  if (close_) WriteHeader("Connection", "close", output_);
+}
+
+void ResponseWriter::SetHeader(std::string_view name, std::string_view value) {
+  if (state_ != State::Head) {
+    throw std::logic_error("Headers must be set before the body");
+  }
+  WriteHeader(name, value, output_);
+}
+
+// Ends the head if needed and opens a chunk. Returns false if the content
+// is to be dropped.
+bool ResponseWriter::Writable() {
+  if (state_ == State::Head) {
+    WriteHeader("Transfer-Encoding", "chunked", output_);
+    output_->Append("\r\n", 2);
+    state_ = State::Body;
+  }
+  if (state_ != State::Body || !send_content_ || failed_) return false;
+  if (chunk_header_ == nullptr) {
+    chunk_header_ = output_->Reserve(kChunkHeaderSize);
+    output_->Commit(kChunkHeaderSize);
+  }
+  return true;
+}
+
+// Large writes are split so that every chunk is sent once it is full
+void ResponseWriter::WriteSlow(std::string_view data) {
+  while (!data.empty() && Writable()) {
+    size_t count = std::min(data.length(), kChunkSize - chunk_bytes_);
+    if (output_->tail_room() == 0) output_->Reserve(1);
+    count = std::min(count, output_->tail_room());
+    std::memcpy(output_->tail_end(), data.data(), count);
+    data.remove_prefix(count);
+    Advance(count);
+    if (chunk_bytes_ >= kChunkSize) EndChunk();
+  }
+}
+
+char *ResponseWriter::ReserveSlow(size_t length) {
+  if (length > kMaxReserve) throw std::length_error("Reserve too large");
+  if (!Writable()) return discard_;
+  return output_->Reserve(length);
+}
+
+void ResponseWriter::CommitSlow(size_t length) {
+  if (chunk_header_ == nullptr) return;  // dropped
+  Advance(length);
+  if (chunk_bytes_ >= kChunkSize) EndChunk();
+}
+
+// Closes a full chunk and hands it to the connection
+void ResponseWriter::EndChunk() {
+  CloseChunk();
+  if (!flush_(flush_context_)) failed_ = true;
+}
+
+// Patches the size into the chunk header and ends the chunk. An empty chunk
+// would end the body, so it is taken back instead.
+void ResponseWriter::CloseChunk() {
+  if (chunk_header_ == nullptr) return;
+  if (chunk_bytes_ == 0) {
+    output_->Truncate(kChunkHeaderSize);
+  } else {
+    static const char kHexDigits[] = "0123456789abcdef";
+    for (int i = 7; i >= 0; i--) {
+      chunk_header_[i] = kHexDigits[(chunk_bytes_ >> (4 * (7 - i))) & 0xF];
+    }
+    chunk_header_[8] = '\r';
+    chunk_header_[9] = '\n';
+    output_->Append("\r\n", 2);
+  }
+  chunk_header_ = nullptr;
+  chunk_bytes_ = 0;
+}
+
+void ResponseWriter::Finish() {
+  if (state_ == State::Idle || state_ == State::Finished) return;
+  bool writable = Writable();
+  CloseChunk();
+  if (writable) output_->Append("0\r\n\r\n", 5);
+  state_ = State::Finished;
+}
+
+}  // namespace high_performance_server
@@ -0,0 +1,116 @@
+// Writing responses into a connection's output chain. Whole responses are
+// serialized in place; streamed responses go out with chunked transfer
+// coding as the handler produces them, so the client gets the first bytes of
+// a large document before the last ones are written.
+
+#ifndef RESPONSE_WRITER_H_
+#define RESPONSE_WRITER_H_
+
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+
+#include "http_message.h"
+#include "output_buffer.h"
+
+namespace high_performance_server {
+
+// Appends `response` to `output` as it would be sent
+void WriteResponse(const HttpResponse &response, bool send_content,
+                   OutputChain *output);
+
+// The response of a streaming handler, see RequestContext::Stream()
+class ResponseWriter {
+public:
+  // Starts sending what has been written so far, without blocking. Returns
+  // false if the connection failed.
+  using FlushFunction = bool (*)(void *context);
+
+  // Chunks are sent once they reach this size
+  static constexpr size_t kChunkSize = 16 * 1024;
+  // Largest Reserve()
+  static constexpr size_t kMaxReserve = 64;
+
+  // Without `send_content` (HEAD requests) only the head is written.
+  // `close` adds "Connection: close".
+  ResponseWriter(OutputChain *output, bool send_content, bool close,
+                 FlushFunction flush, void *flush_context);
+
+  // Writes the status line. Called once, before anything else.
+  void Begin(HttpStatusCode status);
+  // Adds a header. Throws std::logic_error once the body has started.
+  void SetHeader(std::string_view name, std::string_view value);
+
+  // Small writes into the open chunk are inlined; JSON is written a few
+  // bytes at a time
+  void Write(std::string_view data) {
+    if (chunk_header_ != nullptr && data.length() <= output_->tail_room() &&
+        chunk_bytes_ + data.length() < kChunkSize) {
+      std::memcpy(output_->tail_end(), data.data(), data.length());
+      Advance(data.length());
+      return;
+    }
+    WriteSlow(data);
+  }
+  // Room for at most kMaxReserve bytes of body, followed by Commit() of what
+  // was written there
+  char *Reserve(size_t length) {
+    if (chunk_header_ != nullptr && length <= output_->tail_room()) {
+      return output_->tail_end();
+    }
+    return ReserveSlow(length);
+  }
+  void Commit(size_t length) {
+    if (chunk_header_ != nullptr && chunk_bytes_ + length < kChunkSize) {
+      Advance(length);
+      return;
+    }
+    CommitSlow(length);
+  }
+
+  // Ends the body. Called by the server after the handler returns.
+  void Finish();
+
+  bool started() const { return state_ != State::Idle; }
+  bool closes_connection() const { return close_; }
+  // The connection failed while streaming; what is written is dropped
+  bool failed() const { return failed_; }
+  HttpStatusCode status() const { return status_; }
+  // Content written so far, without the chunk framing
+  size_t body_bytes() const { return body_bytes_; }
+
+private:
+  enum class State { Idle, Head, Body, Finished };
+  // "XXXXXXXX\r\n", patched in once the chunk is complete
+  static constexpr size_t kChunkHeaderSize = 10;
+
+  OutputChain *output_;
+  FlushFunction flush_;
+  void *flush_context_;
+  bool send_content_;
+  bool close_;
+  bool failed_;
+  State state_;
+  HttpStatusCode status_;
+  // Null while no chunk is open. Content is only written while one is.
+  char *chunk_header_;
+  size_t chunk_bytes_;
+  size_t body_bytes_;
+  char discard_[kMaxReserve];  // Reserve() of dropped content
+
+  bool Writable();
+  void Advance(size_t length) {
+    output_->Commit(length);
+    chunk_bytes_ += length;
+    body_bytes_ += length;
+  }
+  void WriteSlow(std::string_view data);
+  char *ReserveSlow(size_t length);
+  void CommitSlow(size_t length);
+  void EndChunk();
+  void CloseChunk();
+};
+
+}  // namespace high_performance_server
+
+#endif  // RESPONSE_WRITER_H_
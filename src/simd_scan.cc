@@ -0,0 +1,484 @@
+#include "simd_scan.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HPS_SCAN_X86 1
+#endif
+
+namespace high_performance_server {
+namespace scan {
+
+namespace {
+
+// tchar = "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" / "-" / "." /
+//         "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA
+constexpr bool IsTokenChar(unsigned char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') || c == '!' || c == '#' || c == '$' ||
+         c == '%' || c == '&' || c == '\'' || c == '*' || c == '+' ||
+         c == '-' || c == '.' || c == '^' || c == '_' || c == '`' ||
+         c == '|' || c == '~';
+}
+
+constexpr std::array<bool, 256> MakeTokenTable() {
+  std::array<bool, 256> table{};
+  for (int c = 0; c < 256; c++) table[c] = IsTokenChar(c);
+  return table;
+}
+
+constexpr std::array<bool, 256> kTokenTable = MakeTokenTable();
+
+// Scalar kernels, also used for the tails of the vector kernels
+
+size_t FindCrlfScalar(const char *data, size_t length) {
+  for (size_t i = 0; i + 1 < length; i++) {
+    if (data[i] == '\r' && data[i + 1] == '\n') return i;
+  }
+  return kNotFound;
+}
+
+size_t FindHeaderEndScalar(const char *data, size_t length) {
+  for (size_t i = 0; i + 3 < length; i++) {
+    if (data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r' &&
+        data[i + 3] == '\n')
+      return i;
+  }
+  return kNotFound;
+}
+
+size_t FindByteScalar(const char *data, size_t length, char byte) {
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == byte) return i;
+  }
+  return kNotFound;
+}
+
+size_t FindInvalidTokenCharScalar(const char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (!kTokenTable[static_cast<unsigned char>(data[i])]) return i;
+  }
+  return length;
+}
+
+void ToLowerScalar(char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] >= 'A' && data[i] <= 'Z') data[i] += 'a' - 'A';
+  }
+}
+
+void ToUpperScalar(char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] >= 'a' && data[i] <= 'z') data[i] -= 'a' - 'A';
+  }
+}
+
+// Candidates are positions whose first and last bytes match the needle's;
+// only those are compared in full
+size_t FindSubstringScalar(const char *data, size_t length,
+                           const char *needle, size_t needle_length) {
+  if (needle_length > length) return kNotFound;
+  const char first = needle[0], last = needle[needle_length - 1];
+  for (size_t i = 0; i + needle_length <= length; i++) {
+    if (data[i] == first && data[i + needle_length - 1] == last &&
+        std::memcmp(data + i + 1, needle + 1, needle_length - 1) == 0) {
+      return i;
+    }
+  }
+  return kNotFound;
+}
+
+// Control characters, '"' and '\\' must be escaped in a JSON string
+inline bool NeedsJsonEscape(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+size_t FindJsonEscapeScalar(const char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (NeedsJsonEscape(static_cast<unsigned char>(data[i]))) return i;
+  }
+  return kNotFound;
+}
+
+// Adds `offset` to the result of a tail scan unless nothing was found
+inline size_t Offset(size_t position, size_t offset) {
+  return position == kNotFound ? kNotFound : position + offset;
+}
+
+#ifdef HPS_SCAN_X86
+
+// SSE2 kernels. Bytes >= 0x80 are negative under the signed comparisons
+// below, so they never fall inside any of the printable ASCII ranges.
+
+inline __m128i InRange128(__m128i v, char low, char high) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(low - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(high + 1)));
+}
+
+size_t FindCrlfSse2(const char *data, size_t length) {
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 17 <= length; i += 16) {
+    __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    __m128i v1 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1));
+    int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(v0, cr), _mm_cmpeq_epi8(v1, lf)));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return Offset(FindCrlfScalar(data + i, length - i), i);
+}
+
+size_t FindHeaderEndSse2(const char *data, size_t length) {
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 19 <= length; i += 16) {
+    const char *p = data + i;
+    __m128i m = _mm_and_si128(
+        _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)),
+                       cr),
+        _mm_cmpeq_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1)), lf));
+    if (_mm_movemask_epi8(m) == 0) continue;
+    m = _mm_and_si128(
+        m, _mm_cmpeq_epi8(
+               _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 2)), cr));
+    m = _mm_and_si128(
+        m, _mm_cmpeq_epi8(
+               _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 3)), lf));
+    int mask = _mm_movemask_epi8(m);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return Offset(FindHeaderEndScalar(data + i, length - i), i);
+}
+
+size_t FindByteSse2(const char *data, size_t length, char byte) {
+  const __m128i needle = _mm_set1_epi8(byte);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return Offset(FindByteScalar(data + i, length - i, byte), i);
+}
+
+size_t FindInvalidTokenCharSse2(const char *data, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    // Within '!'..'~' only these separators are not tchars
+    __m128i invalid = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8(','))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('{'))));
+    invalid = _mm_or_si128(invalid, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+    invalid = _mm_or_si128(invalid, InRange128(v, '(', ')'));
+    invalid = _mm_or_si128(invalid, InRange128(v, ':', '@'));
+    invalid = _mm_or_si128(invalid, InRange128(v, '[', ']'));
+    invalid = _mm_or_si128(invalid, _mm_andnot_si128(InRange128(v, '!', '~'),
+                                                     _mm_set1_epi8(-1)));
+    int mask = _mm_movemask_epi8(invalid);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return FindInvalidTokenCharScalar(data + i, length - i) + i;
+}
+
+// Compares the first and last needle bytes at 16 positions at once, then
+// checks the candidates in full
+size_t FindSubstringSse2(const char *data, size_t length, const char *needle,
+                         size_t needle_length) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+  size_t i = 0;
+  for (; i + needle_length + 15 <= length; i += 16) {
+    const char *p = data + i;
+    __m128i m = _mm_and_si128(
+        _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)),
+                       first),
+        _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                           p + needle_length - 1)),
+                       last));
+    for (unsigned mask = _mm_movemask_epi8(m); mask != 0; mask &= mask - 1) {
+      size_t candidate = __builtin_ctz(mask);
+      if (std::memcmp(p + candidate + 1, needle + 1, needle_length - 1) == 0) {
+        return i + candidate;
+      }
+    }
+  }
+  return Offset(
+      FindSubstringScalar(data + i, length - i, needle, needle_length), i);
+}
+
+// Control characters are found with an unsigned comparison:
+// min(v, 0x1F) == v exactly when v <= 0x1F
+size_t FindJsonEscapeSse2(const char *data, size_t length) {
+  const __m128i control = _mm_set1_epi8(0x1F);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    __m128i m = _mm_or_si128(
+        _mm_cmpeq_epi8(_mm_min_epu8(v, control), v),
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+    int mask = _mm_movemask_epi8(m);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return Offset(FindJsonEscapeScalar(data + i, length - i), i);
+}
+
+void ToLowerSse2(char *data, size_t length) {
+  const __m128i flip = _mm_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i *p = reinterpret_cast<__m128i *>(data + i);
+    __m128i v = _mm_loadu_si128(p);
+    __m128i upper = InRange128(v, 'A', 'Z');
+    _mm_storeu_si128(p, _mm_or_si128(v, _mm_and_si128(upper, flip)));
+  }
+  ToLowerScalar(data + i, length - i);
+}
+
+void ToUpperSse2(char *data, size_t length) {
+  const __m128i flip = _mm_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i *p = reinterpret_cast<__m128i *>(data + i);
+    __m128i v = _mm_loadu_si128(p);
+    __m128i lower = InRange128(v, 'a', 'z');
+    _mm_storeu_si128(p, _mm_andnot_si128(_mm_and_si128(lower, flip), v));
+  }
+  ToUpperScalar(data + i, length - i);
+}
+
+// AVX2 kernels, compiled for AVX2 through function attributes so the rest of
+// the binary keeps running on any x86-64 CPU. Tails are handed to the SSE2
+// kernels after a vzeroupper, which GCC does not emit across the target
+// boundary, to avoid the AVX-SSE transition penalty.
+
+#define HPS_AVX2 __attribute__((target("avx2")))
+
+HPS_AVX2 inline __m256i Load256(const char *p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+HPS_AVX2 inline __m256i InRange256(__m256i v, char low, char high) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(low - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), v));
+}
+
+HPS_AVX2 size_t FindCrlfAvx2(const char *data, size_t length) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 33 <= length; i += 32) {
+    __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(Load256(data + i), cr),
+                                 _mm256_cmpeq_epi8(Load256(data + i + 1), lf));
+    std::uint32_t mask = _mm256_movemask_epi8(m);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return Offset(FindCrlfSse2(data + i, length - i), i);
+}
+
+HPS_AVX2 size_t FindHeaderEndAvx2(const char *data, size_t length) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 35 <= length; i += 32) {
+    const char *p = data + i;
+    __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(Load256(p), cr),
+                                 _mm256_cmpeq_epi8(Load256(p + 1), lf));
+    if (_mm256_movemask_epi8(m) == 0) continue;
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi8(Load256(p + 2), cr));
+    m = _mm256_and_si256(m, _mm256_cmpeq_epi8(Load256(p + 3), lf));
+    std::uint32_t mask = _mm256_movemask_epi8(m);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return Offset(FindHeaderEndSse2(data + i, length - i), i);
+}
+
+HPS_AVX2 size_t FindByteAvx2(const char *data, size_t length, char byte) {
+  const __m256i needle = _mm256_set1_epi8(byte);
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    std::uint32_t mask =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(Load256(data + i), needle));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return Offset(FindByteSse2(data + i, length - i, byte), i);
+}
+
+// A byte is a tchar iff kLowNibbleClasses[low] has the bit for its high
+// nibble set. High nibbles 8..15 map to no bit, rejecting non-ASCII bytes.
+constexpr std::array<std::uint8_t, 16> MakeLowNibbleClasses() {
+  std::array<std::uint8_t, 16> classes{};
+  for (int c = 0; c < 128; c++) {
+    if (kTokenTable[c]) classes[c & 0x0F] |= 1 << (c >> 4);
+  }
+  return classes;
+}
+
+constexpr std::array<std::uint8_t, 16> kLowNibbleClasses =
+    MakeLowNibbleClasses();
+
+HPS_AVX2 size_t FindInvalidTokenCharAvx2(const char *data, size_t length) {
+  const __m128i low_lanes =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(kLowNibbleClasses.data()));
+  const __m256i low_table = _mm256_broadcastsi128_si256(low_lanes);
+  const __m256i high_table = _mm256_setr_epi8(
+      1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+      1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = Load256(data + i);
+    __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(v, nibble));
+    __m256i high = _mm256_shuffle_epi8(
+        high_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i invalid = _mm256_cmpeq_epi8(_mm256_and_si256(low, high),
+                                        _mm256_setzero_si256());
+    std::uint32_t mask = _mm256_movemask_epi8(invalid);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return FindInvalidTokenCharSse2(data + i, length - i) + i;
+}
+
+HPS_AVX2 size_t FindSubstringAvx2(const char *data, size_t length,
+                                  const char *needle, size_t needle_length) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+  size_t i = 0;
+  for (; i + needle_length + 31 <= length; i += 32) {
+    const char *p = data + i;
+    __m256i m = _mm256_and_si256(
+        _mm256_cmpeq_epi8(Load256(p), first),
+        _mm256_cmpeq_epi8(Load256(p + needle_length - 1), last));
+    for (std::uint32_t mask = _mm256_movemask_epi8(m); mask != 0;
+         mask &= mask - 1) {
+      size_t candidate = __builtin_ctz(mask);
+      if (std::memcmp(p + candidate + 1, needle + 1, needle_length - 1) == 0) {
+        _mm256_zeroupper();
+        return i + candidate;
+      }
+    }
+  }
+  _mm256_zeroupper();
+  return Offset(
+      FindSubstringSse2(data + i, length - i, needle, needle_length), i);
+}
+
+HPS_AVX2 size_t FindJsonEscapeAvx2(const char *data, size_t length) {
+  const __m256i control = _mm256_set1_epi8(0x1F);
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = Load256(data + i);
+    __m256i m = _mm256_or_si256(
+        _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                        _mm256_cmpeq_epi8(v, backslash)));
+    std::uint32_t mask = _mm256_movemask_epi8(m);
+    if (mask != 0) {
+      _mm256_zeroupper();
+      return i + __builtin_ctz(mask);
+    }
+  }
+  _mm256_zeroupper();
+  return Offset(FindJsonEscapeSse2(data + i, length - i), i);
+}
+
+HPS_AVX2 void ToLowerAvx2(char *data, size_t length) {
+  const __m256i flip = _mm256_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = Load256(data + i);
+    __m256i upper = InRange256(v, 'A', 'Z');
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i),
+                        _mm256_or_si256(v, _mm256_and_si256(upper, flip)));
+  }
+  _mm256_zeroupper();
+  ToLowerSse2(data + i, length - i);
+}
+
+HPS_AVX2 void ToUpperAvx2(char *data, size_t length) {
+  const __m256i flip = _mm256_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = Load256(data + i);
+    __m256i lower = InRange256(v, 'a', 'z');
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i),
+                        _mm256_andnot_si256(_mm256_and_si256(lower, flip), v));
+  }
+  _mm256_zeroupper();
+  ToUpperSse2(data + i, length - i);
+}
+
+#undef HPS_AVX2
+
+const ScanKernels kSse2Kernels = {
+    "sse2",           FindCrlfSse2,             FindHeaderEndSse2,
+    FindByteSse2,     FindInvalidTokenCharSse2, ToLowerSse2,
+    ToUpperSse2,      FindSubstringSse2,        FindJsonEscapeSse2,
+};
+
+const ScanKernels kAvx2Kernels = {
+    "avx2",           FindCrlfAvx2,             FindHeaderEndAvx2,
+    FindByteAvx2,     FindInvalidTokenCharAvx2, ToLowerAvx2,
+    ToUpperAvx2,      FindSubstringAvx2,        FindJsonEscapeAvx2,
+};
+
+#endif  // HPS_SCAN_X86
+
+const ScanKernels kScalarKernels = {
+    "scalar",         FindCrlfScalar,             FindHeaderEndScalar,
+    FindByteScalar,   FindInvalidTokenCharScalar, ToLowerScalar,
+    ToUpperScalar,    FindSubstringScalar,        FindJsonEscapeScalar,
+};
+
+const ScanKernels &SelectKernels() {
+#ifdef HPS_SCAN_X86
+  __builtin_cpu_init();
+#endif
+  if (const ScanKernels *kernels = Avx2Kernels()) return *kernels;
+  if (const ScanKernels *kernels = Sse2Kernels()) return *kernels;
+  return kScalarKernels;
+}
+
+}  // namespace
+
+const ScanKernels &ScalarKernels() { return kScalarKernels; }
+
+const ScanKernels *Sse2Kernels() {
+#ifdef HPS_SCAN_X86
+  if (__builtin_cpu_supports("sse2")) return &kSse2Kernels;
+#endif
+  return nullptr;
+}
+
+const ScanKernels *Avx2Kernels() {
+#ifdef HPS_SCAN_X86
+  if (__builtin_cpu_supports("avx2")) return &kAvx2Kernels;
+#endif
+  return nullptr;
+}
+
+const ScanKernels &ActiveKernels() {
+  static const ScanKernels &kernels = SelectKernels();
+  return kernels;
+}
+
+}  // namespace scan
+}  // namespace high_performance_server
@@ -0,0 +1,109 @@
+// Vectorized scanning kernels for the HTTP parser: delimiter search,
+// header-name token validation, bulk ASCII case conversion, substring
+// search (for multipart boundaries) and finding bytes that JSON strings must
+// escape.
+// SSE2 and AVX2 versions are selected at runtime, with a scalar fallback.
+
+#ifndef SIMD_SCAN_H_
+#define SIMD_SCAN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace high_performance_server {
+namespace scan {
+
+constexpr size_t kNotFound = static_cast<size_t>(-1);
+
+// A set of kernels built for one instruction set. Search kernels return the
+// offset of the first match, or kNotFound if there is none.
+struct ScanKernels {
+  const char *name;
+  // Offset of the first "\r\n"
+  size_t (*find_crlf)(const char *data, size_t length);
+  // Offset of the first "\r\n\r\n" (the end of a header block)
+  size_t (*find_header_end)(const char *data, size_t length);
+  // Offset of the first occurrence of the given byte
+  size_t (*find_byte)(const char *data, size_t length, char byte);
+  // Offset of the first byte that is not an RFC 9110 "tchar", or `length`
+  // if every byte is a valid header-name character
+  size_t (*find_invalid_token_char)(const char *data, size_t length);
+  // In-place ASCII case conversion; bytes outside A-Z / a-z are untouched
+  void (*to_lower)(char *data, size_t length);
+  void (*to_upper)(char *data, size_t length);
+  // Offset of the first occurrence of `needle`, which is not empty
+  size_t (*find_substring)(const char *data, size_t length,
+                           const char *needle, size_t needle_length);
+  // Offset of the first byte a JSON string must escape: a control
+  // character, '"' or '\\'
+  size_t (*find_json_escape)(const char *data, size_t length);
+};
+
+// Kernels for every instruction set. The vector versions return nullptr
+// when the CPU (or the target architecture) does not support them.
+const ScanKernels &ScalarKernels();
+const ScanKernels *Sse2Kernels();
+const ScanKernels *Avx2Kernels();
+
+// The best kernels for this CPU, detected once on first use
+const ScanKernels &ActiveKernels();
+
+inline size_t FindCrlf(const char *data, size_t length) {
+  return ActiveKernels().find_crlf(data, length);
+}
+inline size_t FindHeaderEnd(const char *data, size_t length) {
+  return ActiveKernels().find_header_end(data, length);
+}
+inline size_t FindByte(const char *data, size_t length, char byte) {
+  return ActiveKernels().find_byte(data, length, byte);
+}
+inline bool IsToken(const char *data, size_t length) {
+  return length > 0 &&
+         ActiveKernels().find_invalid_token_char(data, length) == length;
+}
+inline void ToLowerAscii(char *data, size_t length) {
+  ActiveKernels().to_lower(data, length);
+}
+inline void ToUpperAscii(char *data, size_t length) {
+  ActiveKernels().to_upper(data, length);
+}
+inline size_t FindSubstring(const char *data, size_t length,
+                            const char *needle, size_t needle_length) {
+  if (needle_length == 0) return 0;
+  return ActiveKernels().find_substring(data, length, needle, needle_length);
+}
+
+inline size_t FindJsonEscape(const char *data, size_t length) {
+  return ActiveKernels().find_json_escape(data, length);
+}
+
+// Packs up to 8 bytes into a little-endian word so that short tokens such as
+// HTTP methods can be matched with a single integer comparison
+constexpr std::uint64_t PackLiteral(const char *literal, size_t length) {
+  std::uint64_t word = 0;
+  for (size_t i = 0; i < length && i < 8; i++) {
+    word |= static_cast<std::uint64_t>(static_cast<unsigned char>(literal[i]))
+            << (8 * i);
+  }
+  return word;
+}
+
+// Same as PackLiteral, for a token that is at most 8 bytes long, with ASCII
+// letters folded to upper case
+inline std::uint64_t PackUpper(const char *data, size_t length) {
+  std::uint64_t word = 0;
+  std::memcpy(&word, data, length < 8 ? length : 8);
+  // Set 0x80 in every byte holding 'a'..'z', then clear its 0x20 bit
+  constexpr std::uint64_t kOnes = 0x0101010101010101ULL;
+  std::uint64_t heptets = word & (0x7F * kOnes);
+  std::uint64_t above_a = heptets + (0x80 - 'a') * kOnes;
+  std::uint64_t above_z = heptets + (0x7F - 'z') * kOnes;
+  std::uint64_t is_lower = above_a & ~above_z & ~word & (0x80 * kOnes);
+  return word ^ (is_lower >> 2);
+}
+
+}  // namespace scan
+}  // namespace high_performance_server
+
+#endif  // SIMD_SCAN_H_
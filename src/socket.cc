@@ -1,40 +1,283 @@
 #include "socket.h"
 
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
 namespace {
-constexpr int kBacklogSize = 1000;
+
+bool IsPort(const std::string &text) {
+  if (text.empty() || text.length() > 5) return false;
+  for (char c : text) {
+    if (c < '0' || c > '9') return false;
+  }
+  return std::stoul(text) <= 65535;
+}
+
+// A socket file whose server is gone refuses connections; anything else at
+// the path is left alone, so that bind reports it
+void RemoveStaleUnixSocket(const sockaddr_un &address, socklen_t length) {
+  struct stat status;
+  if (lstat(address.sun_path, &status) < 0 || !S_ISSOCK(status.st_mode)) {
+    return;
+  }
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe < 0) return;
+  if (connect(probe, reinterpret_cast<const sockaddr *>(&address), length) <
+          0 &&
+      errno == ECONNREFUSED) {
+    unlink(address.sun_path);
+  }
+  close(probe);
+}
+
+// Fills in the address of `endpoint`. Returns why it has none, or an empty
+// string.
+std::string EndpointAddress(
+    const high_performance_server::ListenEndpoint &endpoint,
+    sockaddr_storage *address, socklen_t *address_length) {
+  using high_performance_server::ListenEndpoint;
+  *address = {};
+  if (endpoint.kind == ListenEndpoint::Kind::Tcp) {
+    std::string host = endpoint.address.empty() ? "0.0.0.0" : endpoint.address;
+    auto *ipv4 = reinterpret_cast<sockaddr_in *>(address);
+    auto *ipv6 = reinterpret_cast<sockaddr_in6 *>(address);
+    if (inet_pton(AF_INET, host.c_str(), &ipv4->sin_addr) == 1) {
+      ipv4->sin_family = AF_INET;
+      ipv4->sin_port = htons(endpoint.port);
+      *address_length = sizeof(*ipv4);
+    } else if (inet_pton(AF_INET6, host.c_str(), &ipv6->sin6_addr) == 1) {
+      ipv6->sin6_family = AF_INET6;
+      ipv6->sin6_port = htons(endpoint.port);
+      *address_length = sizeof(*ipv6);
+    } else {
+      return "Invalid IP address: " + endpoint.address;
+    }
+    return std::string();
+  }
+  auto *unix_address = reinterpret_cast<sockaddr_un *>(address);
+  unix_address->sun_family = AF_UNIX;
+  // Abstract names start with a NUL byte and are not NUL-terminated
+  size_t offset = endpoint.kind == ListenEndpoint::Kind::AbstractUnix;
+  if (endpoint.address.empty() ||
+      offset + endpoint.address.length() >= sizeof(unix_address->sun_path)) {
+    return "Invalid Unix domain socket address: " + endpoint.ToString();
+  }
+  std::memcpy(unix_address->sun_path + offset, endpoint.address.data(),
+              endpoint.address.length());
+  *address_length = offsetof(sockaddr_un, sun_path) + offset +
+                    endpoint.address.length() + (offset == 0);
+  return std::string();
+}
+
 } // namespace
 
 namespace high_performance_server {
 
+ListenEndpoint ListenEndpoint::Tcp(const std::string &host,
+                                   std::uint16_t port) {
+  ListenEndpoint endpoint;
+  endpoint.kind = Kind::Tcp;
+  endpoint.address = host;
+  endpoint.port = port;
+  return endpoint;
+}
+
+ListenEndpoint ListenEndpoint::Unix(const std::string &path) {
+  ListenEndpoint endpoint;
+  endpoint.kind = Kind::Unix;
+  endpoint.address = path;
+  return endpoint;
+}
+
+ListenEndpoint ListenEndpoint::AbstractUnix(const std::string &name) {
+  ListenEndpoint endpoint;
+  endpoint.kind = Kind::AbstractUnix;
+  endpoint.address = name;
+  return endpoint;
+}
+
+ListenEndpoint ListenEndpoint::Parse(const std::string &text) {
+  std::string rest = text;
+  if (rest.compare(0, 5, "unix:") == 0) {
+    rest = rest.substr(5);
+    if (rest.length() > 1 && rest[0] == '@') return AbstractUnix(rest.substr(1));
+    if (!rest.empty() && rest[0] != '@') return Unix(rest);
+  } else if (rest.length() > 1 && rest[0] == '@') {
+    return AbstractUnix(rest.substr(1));
+  } else if (!rest.empty() && rest[0] == '[') {
+    size_t end = rest.find("]:");
+    if (end != std::string::npos && IsPort(rest.substr(end + 2))) {
+      return Tcp(rest.substr(1, end - 1), std::stoul(rest.substr(end + 2)));
+    }
+  } else {
+    size_t colon = rest.rfind(':');
+    if (colon != std::string::npos &&
+        rest.find(':') == colon &&  // IPv6 hosts need brackets
+        IsPort(rest.substr(colon + 1))) {
+      return Tcp(rest.substr(0, colon), std::stoul(rest.substr(colon + 1)));
+    }
+  }
+  throw std::invalid_argument("Invalid listen address: " + text);
+}
+
+bool ListenEndpoint::BoundTo(int sock_fd) const {
+  sockaddr_storage expected, bound = {};
+  socklen_t expected_length, bound_length = sizeof(bound);
+  if (!EndpointAddress(*this, &expected, &expected_length).empty() ||
+      getsockname(sock_fd, reinterpret_cast<sockaddr *>(&bound),
+                  &bound_length) < 0 ||
+      bound_length != expected_length) {
+    return false;
+  }
+  // The kernel picked the port of an endpoint that asked for port 0
+  if (kind == Kind::Tcp && port == 0) {
+    if (expected.ss_family == AF_INET && bound.ss_family == AF_INET) {
+      reinterpret_cast<sockaddr_in *>(&expected)->sin_port =
+          reinterpret_cast<sockaddr_in *>(&bound)->sin_port;
+    } else if (expected.ss_family == AF_INET6 && bound.ss_family == AF_INET6) {
+      reinterpret_cast<sockaddr_in6 *>(&expected)->sin6_port =
+          reinterpret_cast<sockaddr_in6 *>(&bound)->sin6_port;
+    }
+  }
+  return std::memcmp(&expected, &bound, expected_length) == 0;
+}
+
+std::string ListenEndpoint::ToString() const {
+  switch (kind) {
+    case Kind::Unix:
+      return "unix:" + address;
+    case Kind::AbstractUnix:
+      return '@' + address;
+    default:
+      if (address.find(':') != std::string::npos) {
+        return '[' + address + "]:" + std::to_string(port);
+      }
+      return (address.empty() ? "0.0.0.0" : address) + ':' +
+             std::to_string(port);
+  }
+}
+
 Socket::Socket(const std::string &host, std::uint16_t port)
-    : host_(host), port_(port) {}
+    : Socket(ListenEndpoint::Tcp(host, port)) {}
+
+Socket::Socket(const ListenEndpoint &endpoint)
+    : endpoint_(endpoint), sock_fd_(-1), adopted_(false) {}
+
+Socket::Socket(int sock_fd) : sock_fd_(sock_fd), adopted_(true) {}
+
+Socket::Socket(int sock_fd, const ListenEndpoint &endpoint)
+    : endpoint_(endpoint), sock_fd_(sock_fd), adopted_(true) {}
+
+std::string PeerAddress::ToString() const {
+  char host[INET6_ADDRSTRLEN] = "";
+  if (storage.ss_family == AF_INET) {
+    const auto *address = reinterpret_cast<const sockaddr_in *>(&storage);
+    inet_ntop(AF_INET, &address->sin_addr, host, sizeof(host));
+    return std::string(host) + ':' + std::to_string(ntohs(address->sin_port));
+  }
+  if (storage.ss_family == AF_INET6) {
+    const auto *address = reinterpret_cast<const sockaddr_in6 *>(&storage);
+    inet_ntop(AF_INET6, &address->sin6_addr, host, sizeof(host));
+    return '[' + std::string(host) + "]:" +
+           std::to_string(ntohs(address->sin6_port));
+  }
+  if (storage.ss_family == AF_UNIX) return "unix";
+  return std::string();
+}
+
+std::uint64_t PeerAddress::Key() const {
+  if (storage.ss_family == AF_INET) {
+    const auto *address = reinterpret_cast<const sockaddr_in *>(&storage);
+    return address->sin_addr.s_addr;
+  }
+  if (storage.ss_family == AF_INET6) {
+    // Fold the 128-bit address; the limiter mixes the key further
+    const auto *address = reinterpret_cast<const sockaddr_in6 *>(&storage);
+    if (IN6_IS_ADDR_V4MAPPED(&address->sin6_addr)) {
+      std::uint32_t ipv4;
+      std::memcpy(&ipv4, address->sin6_addr.s6_addr + 12, sizeof(ipv4));
+      return ipv4;
+    }
+    std::uint64_t halves[2];
+    std::memcpy(halves, &address->sin6_addr, sizeof(halves));
+    return halves[0] ^ (halves[1] * 0x9E3779B97F4A7C15ULL);
+  }
+  return 0;
+}
 
 int Socket::GetSocketFd() const { return sock_fd_; }
 
-bool Socket::Start() {
-  int socket_option = 1;
-  sockaddr_in server_address;
+bool Socket::Fail(const std::string &step) {
+  error_ = step + " " + endpoint_.ToString() + ": " + std::strerror(errno);
+  if (sock_fd_ >= 0 && !adopted_) {
+    close(sock_fd_);
+    sock_fd_ = -1;
+  }
+  return false;
+}
 
-  if ((sock_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
-    return false;
+bool Socket::SetOption(int level, int name, int value) {
+  return setsockopt(sock_fd_, level, name, &value, sizeof(value)) == 0;
+}
+
+bool Socket::Start() {
+  if (adopted_) {
+    int listening = 0;
+    socklen_t option_len = sizeof(listening);
+    if (getsockopt(sock_fd_, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+                   &option_len) < 0 ||
+        !listening) {
+      error_ = "Inherited socket " + std::to_string(sock_fd_) +
+               " is not listening";
+      return false;
+    }
+    int flags = fcntl(sock_fd_, F_GETFL);
+    return flags >= 0 && fcntl(sock_fd_, F_SETFL, flags | O_NONBLOCK) == 0;
   }
 
-  if (setsockopt(sock_fd_, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &socket_option,
-                 sizeof(socket_option)) < 0) {
-    return false;
+  const ListenOptions &options = endpoint_.options;
+  sockaddr_storage address;
+  socklen_t address_length;
+  error_ = EndpointAddress(endpoint_, &address, &address_length);
+  if (!error_.empty()) return false;
+  int family = address.ss_family;
+
+  if ((sock_fd_ = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0)) < 0) {
+    return Fail("Failed to create socket for");
   }
 
-  server_address.sin_family = AF_INET;
-  server_address.sin_addr.s_addr = INADDR_ANY;
-  inet_pton(AF_INET, host_.c_str(), &(server_address.sin_addr.s_addr));
-  server_address.sin_port = htons(port_);
+  if (family != AF_UNIX) {
+    if ((options.reuse_address && !SetOption(SOL_SOCKET, SO_REUSEADDR, 1)) ||
+        (options.reuse_port && !SetOption(SOL_SOCKET, SO_REUSEPORT, 1)) ||
+        (family == AF_INET6 &&
+         !SetOption(IPPROTO_IPV6, IPV6_V6ONLY, options.ipv6_only)) ||
+        (options.tcp_nodelay && !SetOption(IPPROTO_TCP, TCP_NODELAY, 1)) ||
+        (options.tcp_defer_accept > 0 &&
+         !SetOption(IPPROTO_TCP, TCP_DEFER_ACCEPT, options.tcp_defer_accept)) ||
+        (options.tcp_fastopen > 0 &&
+         !SetOption(IPPROTO_TCP, TCP_FASTOPEN, options.tcp_fastopen))) {
+      return Fail("Failed to set socket options on");
+    }
+  } else if (endpoint_.kind == ListenEndpoint::Kind::Unix) {
+    RemoveStaleUnixSocket(*reinterpret_cast<sockaddr_un *>(&address),
+                          address_length);
+  }
 
-  if (bind(sock_fd_, (sockaddr *)&server_address, sizeof(server_address)) < 0) {
-    return false;
+  if (bind(sock_fd_, (sockaddr *)&address, address_length) < 0) {
+    return Fail("Failed to bind");
   }
 
-  if (listen(sock_fd_, kBacklogSize) < 0) {
-    return false;
+  if (listen(sock_fd_, options.backlog) < 0) {
+    return Fail("Failed to listen on");
   }
 
   return true;
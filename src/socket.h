@@ -12,21 +12,97 @@
 
 namespace high_performance_server {
 
+// Address of the client at the other end of a connection
+struct PeerAddress {
+  PeerAddress() : storage(), length(0) {}
+  sockaddr_storage storage;
+  socklen_t length;
+
+  // e.g. "203.0.113.7:52144", "[2001:db8::1]:52144", or "unix"
+  std::string ToString() const;
+  // The IP address alone, without the port, as a 64-bit key. IPv4 clients
+  // of a dual-stack listener get the same key as over IPv4. All Unix domain
+  // socket clients share key 0.
+  std::uint64_t Key() const;
+};
+
+// Per-listener socket settings. The TCP options are ignored on Unix domain
+// sockets.
+struct ListenOptions {
+  int backlog = 1000;
+  bool reuse_address = true;
+  // Lets several sockets bind the same port, e.g. one per process
+  bool reuse_port = false;
+  // IPv6 only: refuse IPv4 clients instead of accepting them as
+  // IPv4-mapped addresses
+  bool ipv6_only = false;
+  // Inherited by accepted connections
+  bool tcp_nodelay = false;
+  // Only hand over a connection once its first data arrived, waiting at
+  // most this many seconds. 0 disables.
+  int tcp_defer_accept = 0;
+  // Queue length for TCP Fast Open requests. 0 disables.
+  int tcp_fastopen = 0;
+  // Serve TLS on this listener when the server has TLS enabled
+  bool tls = true;
+};
+
+// Where to listen
+struct ListenEndpoint {
+  enum class Kind { Tcp, Unix, AbstractUnix };
+
+  // An IPv4 or IPv6 address literal and a port; an empty host is 0.0.0.0
+  static ListenEndpoint Tcp(const std::string &host, std::uint16_t port);
+  // A Unix domain socket at `path` in the filesystem. A stale socket left
+  // at that path is replaced.
+  static ListenEndpoint Unix(const std::string &path);
+  // A Unix domain socket in the abstract namespace, which needs no file and
+  // disappears with its last descriptor
+  static ListenEndpoint AbstractUnix(const std::string &name);
+  // "203.0.113.7:8080", "[::]:8080", "unix:/run/server.sock" or "@server".
+  // Throws std::invalid_argument on anything else.
+  static ListenEndpoint Parse(const std::string &text);
+
+  std::string ToString() const;
+  // Whether the listening socket `sock_fd` is bound to this address. An
+  // endpoint with port 0 matches whatever port the kernel picked.
+  bool BoundTo(int sock_fd) const;
+
+  Kind kind = Kind::Tcp;
+  std::string address;  // host, path or abstract name
+  std::uint16_t port = 0;
+  ListenOptions options;
+};
+
 class Socket {
 public:
   Socket(const std::string &host, std::uint16_t port);
+  explicit Socket(const ListenEndpoint &endpoint);
+  // Adopts a socket that is already bound and listening, e.g. one inherited
+  // from the process this server replaces
+  explicit Socket(int sock_fd);
+  // Same, for the socket bound to `endpoint`, with its options
+  Socket(int sock_fd, const ListenEndpoint &endpoint);
   ~Socket() = default;
 
   bool Start();
 
   int GetSocketFd() const;
+  const ListenEndpoint &endpoint() const { return endpoint_; }
+  // Why Start() failed
+  const std::string &error() const { return error_; }
 
 private:
-  std::string host_;
-
-  std::uint16_t port_;
+  ListenEndpoint endpoint_;
 
   int sock_fd_;
+
+  bool adopted_;
+
+  std::string error_;
+
+  bool Fail(const std::string &step);
+  bool SetOption(int level, int name, int value);
 };
 
 } // namespace high_performance_server
@@ -0,0 +1,75 @@
+// Bounded single-producer single-consumer ring buffer. Pushing and popping
+// never allocate or block; a full ring simply rejects the element.
+
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace high_performance_server {
+
+template <typename T>
+class SpscRing {
+public:
+  // `capacity` is rounded up to a power of two
+  explicit SpscRing(size_t capacity)
+      : mask_(RoundUp(capacity) - 1),
+        slots_(std::make_unique<T[]>(mask_ + 1)), head_(0), tail_(0),
+        cached_head_(0), cached_tail_(0) {}
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  // Producer side. Returns false if the ring is full.
+  bool TryPush(const T &element) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) return false;
+    }
+    slots_[tail & mask_] = element;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Hands up to `max_count` elements to `consume`, oldest
+  // first, and returns how many there were.
+  template <typename Consumer>
+  size_t PopBatch(size_t max_count, Consumer &&consume) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (cached_tail_ - head < max_count) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    }
+    size_t count = cached_tail_ - head;
+    if (count > max_count) count = max_count;
+    for (size_t i = 0; i < count; i++) consume(slots_[(head + i) & mask_]);
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+private:
+  static constexpr size_t kCacheLineSize = 64;
+
+  static size_t RoundUp(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    return size;
+  }
+
+  const size_t mask_;
+  std::unique_ptr<T[]> slots_;
+  // The consumer owns head_, the producer owns tail_. Each side keeps a
+  // cached copy of the other's index so that it rarely touches its line.
+  alignas(kCacheLineSize) std::atomic<size_t> head_;
+  alignas(kCacheLineSize) std::atomic<size_t> tail_;
+  alignas(kCacheLineSize) size_t cached_head_;  // producer only
+  alignas(kCacheLineSize) size_t cached_tail_;  // consumer only
+};
+
+}  // namespace high_performance_server
+
+#endif  // SPSC_RING_H_
@@ -0,0 +1,220 @@
+#include "tls.h"
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+namespace high_performance_server {
+
+#ifdef HAVE_OPENSSL
+
+namespace {
+
+// The most recent OpenSSL error, for exception messages
+std::string LastError() {
+  char message[256];
+  ERR_error_string_n(ERR_get_error(), message, sizeof(message));
+  return message;
+}
+
+// Maps a failed SSL_read or SSL_write to the errno of a failed recv or send
+ssize_t FailedIo(SSL *ssl, int result) {
+  switch (SSL_get_error(ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;  // close_notify from the peer
+    case SSL_ERROR_SYSCALL:
+      if (errno == 0) errno = ECONNRESET;
+      return -1;
+    default:
+      errno = EPROTO;
+      return -1;
+  }
+}
+
+}  // namespace
+
+bool TlsAvailable() { return true; }
+
+TlsContext::TlsContext(const TlsOptions &options) : context_(nullptr) {
+  context_ = SSL_CTX_new(TLS_server_method());
+  if (context_ == nullptr) {
+    throw std::runtime_error("Failed to create TLS context: " + LastError());
+  }
+  SSL_CTX_set_min_proto_version(context_, TLS1_2_VERSION);
+
+  std::uint64_t ssl_options =
+      SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+  if (options.kernel_tls) ssl_options |= SSL_OP_ENABLE_KTLS;
+  if (!options.session_tickets) ssl_options |= SSL_OP_NO_TICKET;
+  SSL_CTX_set_options(context_, ssl_options);
+  // Idle keep-alive connections give their record buffers back, and a
+  // partially sent response may be resent from where the worker left off
+  SSL_CTX_set_mode(context_, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                 SSL_MODE_RELEASE_BUFFERS);
+  // Resumption relies on tickets alone, so workers never contend for a
+  // shared session cache
+  SSL_CTX_set_session_cache_mode(context_, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_num_tickets(context_, options.session_tickets ? 1 : 0);
+
+  if (SSL_CTX_use_certificate_chain_file(
+          context_, options.certificate_file.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(context_, options.private_key_file.c_str(),
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(context_) != 1) {
+    std::string error = LastError();
+    SSL_CTX_free(context_);
+    throw std::runtime_error("Failed to load TLS certificate: " + error);
+  }
+
+  for (const std::string &protocol : options.alpn_protocols) {
+    if (protocol.empty() || protocol.length() > 255) continue;
+    alpn_wire_.push_back(static_cast<char>(protocol.length()));
+    alpn_wire_.append(protocol);
+  }
+  if (!alpn_wire_.empty()) {
+    SSL_CTX_set_alpn_select_cb(context_, &TlsContext::SelectAlpn, this);
+  }
+}
+
+TlsContext::~TlsContext() { SSL_CTX_free(context_); }
+
+int TlsContext::SelectAlpn(SSL *, const unsigned char **out,
+                           unsigned char *out_length, const unsigned char *in,
+                           unsigned int in_length, void *context) {
+  const std::string &wire = static_cast<TlsContext *>(context)->alpn_wire_;
+  unsigned char *selected;
+  if (SSL_select_next_proto(
+          &selected, out_length,
+          reinterpret_cast<const unsigned char *>(wire.data()), wire.length(),
+          in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+TlsConnection::TlsConnection(const TlsContext &context, int fd)
+    : ssl_(SSL_new(context.native_handle())), handshake_done_(false),
+      failed_(false) {
+  if (ssl_ == nullptr || SSL_set_fd(ssl_, fd) != 1) {
+    std::string error = LastError();
+    SSL_free(ssl_);  // the destructor does not run
+    throw std::runtime_error("Failed to create TLS connection: " + error);
+  }
+  SSL_set_accept_state(ssl_);
+}
+
+TlsConnection::~TlsConnection() { SSL_free(ssl_); }
+
+TlsConnection::HandshakeStatus TlsConnection::Handshake() {
+  ERR_clear_error();
+  int result = SSL_do_handshake(ssl_);
+  if (result == 1) {
+    handshake_done_ = true;
+    return HandshakeStatus::Done;
+  }
+  switch (SSL_get_error(ssl_, result)) {
+    case SSL_ERROR_WANT_READ:
+      return HandshakeStatus::WantRead;
+    case SSL_ERROR_WANT_WRITE:
+      return HandshakeStatus::WantWrite;
+    default:
+      failed_ = true;
+      return HandshakeStatus::Failed;
+  }
+}
+
+ssize_t TlsConnection::Read(char *buffer, size_t length) {
+  ERR_clear_error();
+  errno = 0;
+  int result = SSL_read(ssl_, buffer, static_cast<int>(length));
+  if (result > 0) return result;
+  ssize_t status = FailedIo(ssl_, result);
+  if (status < 0 && errno != EAGAIN) failed_ = true;
+  return status;
+}
+
+ssize_t TlsConnection::Write(const char *buffer, size_t length) {
+  ERR_clear_error();
+  errno = 0;
+  int result = SSL_write(ssl_, buffer, static_cast<int>(length));
+  if (result > 0) return result;
+  ssize_t status = FailedIo(ssl_, result);
+  if (status < 0 && errno != EAGAIN) failed_ = true;
+  return status;
+}
+
+void TlsConnection::Shutdown() {
+  // After a fatal error OpenSSL must not send anything more
+  if (!handshake_done_ || failed_) return;
+  ERR_clear_error();
+  SSL_shutdown(ssl_);
+}
+
+bool TlsConnection::kernel_tls_send() const {
+  return BIO_get_ktls_send(SSL_get_wbio(ssl_)) != 0;
+}
+
+bool TlsConnection::kernel_tls_receive() const {
+  return BIO_get_ktls_recv(SSL_get_rbio(ssl_)) != 0;
+}
+
+bool TlsConnection::session_reused() const { return SSL_session_reused(ssl_); }
+
+std::string TlsConnection::alpn_protocol() const {
+  const unsigned char *protocol;
+  unsigned int length;
+  SSL_get0_alpn_selected(ssl_, &protocol, &length);
+  return std::string(reinterpret_cast<const char *>(protocol), length);
+}
+
+#else  // !HAVE_OPENSSL
+
+bool TlsAvailable() { return false; }
+
+TlsContext::TlsContext(const TlsOptions &) : context_(nullptr) {
+  throw std::runtime_error("TLS support was not built (OpenSSL not found)");
+}
+
+TlsContext::~TlsContext() = default;
+
+int TlsContext::SelectAlpn(ssl_st *, const unsigned char **, unsigned char *,
+                           const unsigned char *, unsigned int, void *) {
+  return 0;
+}
+
+// Unreachable: no TlsContext can be created to make a connection from
+TlsConnection::TlsConnection(const TlsContext &, int)
+    : ssl_(nullptr), handshake_done_(false), failed_(true) {}
+TlsConnection::~TlsConnection() = default;
+TlsConnection::HandshakeStatus TlsConnection::Handshake() {
+  return HandshakeStatus::Failed;
+}
+ssize_t TlsConnection::Read(char *, size_t) {
+  errno = EPROTO;
+  return -1;
+}
+ssize_t TlsConnection::Write(const char *, size_t) {
+  errno = EPROTO;
+  return -1;
+}
+void TlsConnection::Shutdown() {}
+bool TlsConnection::kernel_tls_send() const { return false; }
+bool TlsConnection::kernel_tls_receive() const { return false; }
+bool TlsConnection::session_reused() const { return false; }
+std::string TlsConnection::alpn_protocol() const { return std::string(); }
+
+#endif  // HAVE_OPENSSL
+
+}  // namespace high_performance_server
@@ -0,0 +1,93 @@
+// TLS termination with OpenSSL. Handshakes are non-blocking and driven by
+// the worker that owns the connection. Once a handshake completes, record
+// encryption is handed to the kernel (kTLS) when the kernel and cipher allow
+// it, so that sending a response is a plain write of the plaintext.
+
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// OpenSSL types, so that only tls.cc includes OpenSSL headers
+struct ssl_st;
+struct ssl_ctx_st;
+
+namespace high_performance_server {
+
+struct TlsOptions {
+  // PEM files. The certificate file may hold the whole chain.
+  std::string certificate_file;
+  std::string private_key_file;
+  // Protocols offered in ALPN, most preferred first. A client that offers
+  // none of them is refused.
+  std::vector<std::string> alpn_protocols = {"http/1.1"};
+  // Stateless session resumption. Ticket keys belong to the server and are
+  // lost when it restarts, after which clients do a full handshake again.
+  bool session_tickets = true;
+  // Move record encryption into the kernel after the handshake
+  bool kernel_tls = true;
+};
+
+// Whether this build has TLS support
+bool TlsAvailable();
+
+// Certificates and settings shared by all connections of a listener
+class TlsContext {
+public:
+  // Throws std::runtime_error if the certificate or key cannot be loaded
+  explicit TlsContext(const TlsOptions &options);
+  ~TlsContext();
+
+  TlsContext(const TlsContext &) = delete;
+  TlsContext &operator=(const TlsContext &) = delete;
+
+  ssl_ctx_st *native_handle() const { return context_; }
+
+private:
+  ssl_ctx_st *context_;
+  std::string alpn_wire_;  // ALPN protocols, length-prefixed
+
+  static int SelectAlpn(ssl_st *ssl, const unsigned char **out,
+                        unsigned char *out_length, const unsigned char *in,
+                        unsigned int in_length, void *context);
+};
+
+// Server side of one TLS connection over a non-blocking socket. Read and
+// Write behave like recv and send: they return -1 with errno set to EAGAIN
+// when the socket is not ready.
+class TlsConnection {
+public:
+  enum class HandshakeStatus { Done, WantRead, WantWrite, Failed };
+
+  TlsConnection(const TlsContext &context, int fd);
+  ~TlsConnection();
+
+  TlsConnection(const TlsConnection &) = delete;
+  TlsConnection &operator=(const TlsConnection &) = delete;
+
+  HandshakeStatus Handshake();
+  ssize_t Read(char *buffer, size_t length);
+  ssize_t Write(const char *buffer, size_t length);
+  // Sends close_notify, without waiting for the peer's
+  void Shutdown();
+
+  bool handshake_done() const { return handshake_done_; }
+  bool kernel_tls_send() const;
+  bool kernel_tls_receive() const;
+  bool session_reused() const;
+  // The protocol selected with ALPN, empty if the client offered none
+  std::string alpn_protocol() const;
+
+private:
+  ssl_st *ssl_;
+  bool handshake_done_;
+  bool failed_;  // after a fatal error nothing more may be sent
+};
+
+}  // namespace high_performance_server
+
+#endif  // TLS_H_
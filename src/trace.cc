@@ -0,0 +1,174 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Ticks per nanosecond between two pairs of clock readings
+double TicksPerNanosecond(std::uint64_t start_ticks,
+                          std::chrono::steady_clock::time_point start_time,
+                          std::uint64_t end_ticks,
+                          std::chrono::steady_clock::time_point end_time) {
+  double ns = std::chrono::duration<double, std::nano>(end_time - start_time)
+                  .count();
+  if (ns <= 0 || end_ticks <= start_ticks) return 1.0;
+  return (end_ticks - start_ticks) / ns;
+}
+
+const char *PhaseName(int phase) {
+  static const char *const kNames[] = {
+      "queue",   "recv",          "priority queue", "parse",
+      "handler", "serialize",     "wait writable",  "send",
+      "request", "iteration"};
+  return kNames[phase];
+}
+
+}  // namespace
+
+namespace high_performance_server {
+
+Tracer::Tracer(const TraceOptions &options, int num_workers)
+    : capacity_(std::max<size_t>(options.events_per_worker, 1)),
+      sample_rate_(options.sample_rate), threshold_ticks_(0),
+      num_workers_(num_workers),
+      rings_(std::make_unique<Ring[]>(num_workers)), start_ticks_(Now()),
+      start_time_(std::chrono::steady_clock::now()) {
+  for (int i = 0; i < num_workers; i++) {
+    rings_[i].events = std::make_unique<Event[]>(capacity_);
+  }
+  if (options.latency_threshold.count() > 0) {
+    // The threshold only needs to be roughly right; a millisecond of
+    // calibration is plenty
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    double rate = TicksPerNanosecond(start_ticks_, start_time_, Now(),
+                                     std::chrono::steady_clock::now());
+    threshold_ticks_ = std::max<std::uint64_t>(
+        options.latency_threshold.count() * 1000 * rate, 1);
+  }
+}
+
+bool Tracer::CommitRequest(int worker_id, const RequestTrace &trace) {
+  Ring &ring = rings_[worker_id];
+  const std::uint64_t *marks = trace.marks;
+  bool keep = false;
+  if (sample_rate_ > 0 && ++ring.sample_counter >= sample_rate_) {
+    ring.sample_counter = 0;
+    keep = true;
+  }
+  std::uint64_t start = marks[kTraceReceiveStart];
+  std::uint64_t end = marks[kTraceSendEnd];
+  if (threshold_ticks_ > 0 && end > start && end - start >= threshold_ticks_) {
+    keep = true;
+  }
+  if (!keep) return false;
+
+  std::uint64_t request_id = ++ring.request_count;
+  Record(ring, Phase::Request, start, end, request_id);
+  // Phases run from each mark to the next one that was taken
+  int from = kTraceQueued;
+  for (int mark = kTraceQueued + 1; mark < kTraceMarkCount; mark++) {
+    if (marks[mark] == 0) continue;
+    if (marks[from] != 0 && marks[mark] >= marks[from]) {
+      Record(ring, static_cast<Phase>(mark - 1), marks[from], marks[mark],
+             request_id);
+    }
+    from = mark;
+  }
+  return true;
+}
+
+void Tracer::CommitIteration(int worker_id, std::uint64_t start,
+                             std::uint64_t end, bool keep) {
+  if (!keep && (threshold_ticks_ == 0 || end - start < threshold_ticks_)) {
+    return;
+  }
+  Record(rings_[worker_id], Phase::Iteration, start, end, 0);
+}
+
+void Tracer::Record(Ring &ring, Phase phase, std::uint64_t start,
+                    std::uint64_t end, std::uint64_t request_id) {
+  std::uint64_t next = ring.next.load(std::memory_order_relaxed);
+  Event &event = ring.events[next % capacity_];
+  event.start.store(start, std::memory_order_relaxed);
+  event.end.store(end, std::memory_order_relaxed);
+  event.info.store(request_id << 8 | static_cast<std::uint8_t>(phase),
+                   std::memory_order_relaxed);
+  ring.next.store(next + 1, std::memory_order_release);
+}
+
+// Each worker shows up as two rows: its event-loop iterations, and the
+// requests it served with their phases nested inside
+std::string Tracer::ExportChromeTrace() const {
+  double rate =
+      TicksPerNanosecond(start_ticks_, start_time_, Now(),
+                         std::chrono::steady_clock::now());
+  std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  char line[256];
+  bool first = true;
+  auto append = [&](int length) {
+    if (!first) json += ",\n";
+    json.append(line, length);
+    first = false;
+  };
+
+  for (int worker = 0; worker < num_workers_; worker++) {
+    append(std::snprintf(line, sizeof(line),
+                         "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                         "\"tid\":%d,\"args\":{\"name\":\"worker %d loop\"}}",
+                         2 * worker, worker));
+    append(std::snprintf(line, sizeof(line),
+                         "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                         "\"tid\":%d,\"args\":{\"name\":\"worker %d "
+                         "requests\"}}",
+                         2 * worker + 1, worker));
+
+    const Ring &ring = rings_[worker];
+    std::uint64_t end = ring.next.load(std::memory_order_acquire);
+    std::uint64_t begin = end > capacity_ ? end - capacity_ : 0;
+    std::vector<std::uint64_t> copy;
+    copy.reserve(3 * (end - begin));
+    for (std::uint64_t i = begin; i < end; i++) {
+      const Event &event = ring.events[i % capacity_];
+      copy.push_back(event.start.load(std::memory_order_relaxed));
+      copy.push_back(event.end.load(std::memory_order_relaxed));
+      copy.push_back(event.info.load(std::memory_order_relaxed));
+    }
+    // Slots the worker wrapped around to while they were copied are torn;
+    // so is the one it may be writing now
+    std::uint64_t now_next = ring.next.load(std::memory_order_acquire);
+    std::uint64_t valid = now_next + 1 > capacity_ ? now_next + 1 - capacity_ : 0;
+
+    for (std::uint64_t i = std::max(begin, valid); i < end; i++) {
+      const std::uint64_t *event = &copy[3 * (i - begin)];
+      int phase = event[2] & 0xFF;
+      if (event[1] < event[0] || event[0] < start_ticks_) continue;
+      double ts = (event[0] - start_ticks_) / rate / 1000.0;
+      double duration = (event[1] - event[0]) / rate / 1000.0;
+      bool loop = phase == static_cast<int>(Phase::Iteration);
+      int length;
+      if (loop) {
+        length = std::snprintf(
+            line, sizeof(line),
+            "{\"name\":\"%s\",\"cat\":\"loop\",\"ph\":\"X\",\"pid\":1,"
+            "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            PhaseName(phase), 2 * worker, ts, duration);
+      } else {
+        length = std::snprintf(
+            line, sizeof(line),
+            "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":1,"
+            "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%llu}}",
+            PhaseName(phase), 2 * worker + 1, ts, duration,
+            static_cast<unsigned long long>(event[2] >> 8));
+      }
+      append(length);
+    }
+  }
+  json += "]}\n";
+  return json;
+}
+
+}  // namespace high_performance_server
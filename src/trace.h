@@ -0,0 +1,136 @@
+// Per-request phase tracing. Workers timestamp each phase of a request with
+// the CPU timestamp counter; requests that are sampled, or slower than a
+// threshold, are copied into a per-worker ring buffer that always holds the
+// most recent events. The rings can be exported at any time as Chrome trace
+// event JSON, for chrome://tracing or Perfetto.
+//
+// The server only calls into this file when built with
+// HIGH_PERFORMANCE_SERVER_TRACING; otherwise its hooks compile to nothing.
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace high_performance_server {
+
+struct TraceOptions {
+  // Events kept per worker; older ones are overwritten
+  size_t events_per_worker = 1 << 16;
+  // Keep one request in `sample_rate`. 0 keeps none, except slow ones.
+  std::uint32_t sample_rate = 100;
+  // Also keep every request slower than this. 0 disables.
+  std::chrono::microseconds latency_threshold{0};
+};
+
+// Points in the life of a request, in order. Each phase of the trace runs
+// from one mark to the next.
+enum TraceMark {
+  kTraceQueued,  // the worker's previous poll, when the data arrived at latest
+  kTraceReceiveStart,
+  kTraceReceiveEnd,
+  kTraceDequeued,  // taken from its priority queue to be served
+  kTraceParseEnd,
+  kTraceHandleEnd,
+  kTraceSerializeEnd,
+  kTraceSendStart,
+  kTraceSendEnd,
+  kTraceMarkCount
+};
+
+// Timestamps of the request a connection is working on. Marks left at 0
+// (e.g. parsing, for a request shed before it) are left out of the trace.
+struct RequestTrace {
+  std::uint64_t marks[kTraceMarkCount];
+
+  void Reset() {
+    for (std::uint64_t &mark : marks) mark = 0;
+  }
+  void Mark(TraceMark mark);
+};
+
+class Tracer {
+public:
+  Tracer(const TraceOptions &options, int num_workers);
+  ~Tracer() = default;
+
+  Tracer(const Tracer &) = delete;
+  Tracer &operator=(const Tracer &) = delete;
+
+  // A cheap timestamp, in ticks
+  static std::uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+
+  // Called by worker `worker_id` only. Keeps the request if it is sampled
+  // or slow, and returns whether it did.
+  bool CommitRequest(int worker_id, const RequestTrace &trace);
+  // Called by worker `worker_id` only, for one event-loop iteration. Kept
+  // if a request was kept during it, or if it was slow.
+  void CommitIteration(int worker_id, std::uint64_t start, std::uint64_t end,
+                       bool keep);
+
+  // All events still held, as Chrome trace event JSON. Safe to call while
+  // workers are recording.
+  std::string ExportChromeTrace() const;
+
+private:
+  enum class Phase : std::uint8_t {
+    Queue,
+    Receive,
+    PriorityQueue,
+    Parse,
+    Handle,
+    Serialize,
+    WaitWritable,
+    Send,
+    Request,
+    Iteration
+  };
+
+  // Written by the worker with relaxed stores, so that an exporter reading
+  // a slot being overwritten sees stale or new values, never a data race
+  struct Event {
+    std::atomic<std::uint64_t> start;
+    std::atomic<std::uint64_t> end;
+    std::atomic<std::uint64_t> info;  // request id << 8 | phase
+  };
+
+  struct alignas(64) Ring {
+    std::unique_ptr<Event[]> events;
+    std::atomic<std::uint64_t> next{0};  // events ever recorded
+    std::uint32_t sample_counter = 0;
+    std::uint64_t request_count = 0;
+  };
+
+  size_t capacity_;
+  std::uint32_t sample_rate_;
+  std::uint64_t threshold_ticks_;  // 0 when disabled
+  int num_workers_;
+  std::unique_ptr<Ring[]> rings_;
+  // Matching clock readings, to convert ticks to time when exporting
+  std::uint64_t start_ticks_;
+  std::chrono::steady_clock::time_point start_time_;
+
+  void Record(Ring &ring, Phase phase, std::uint64_t start, std::uint64_t end,
+              std::uint64_t request_id);
+};
+
+inline void RequestTrace::Mark(TraceMark mark) { marks[mark] = Tracer::Now(); }
+
+}  // namespace high_performance_server
+
+#endif  // TRACE_H_
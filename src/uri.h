@@ -9,6 +9,8 @@
 #include <string>
 #include <utility>
 
+#include "simd_scan.h"
+
 namespace high_performance_server {
 
 class Uri {
@@ -39,8 +41,7 @@ private:
   std::uint16_t port_;
 
   void SetPathToLowercase() {
-    std::transform(path_.begin(), path_.end(), path_.begin(),
-                   [](char c) { return tolower(c); });
+    scan::ToLowerAscii(&path_[0], path_.length());
   }
 };
 
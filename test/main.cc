@@ -1,13 +1,61 @@
 // Simple unit tests without using any framework
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
 
+#include "access_log.h"
+#include "arena.h"
+#include "cancellation.h"
+#include "form.h"
 #include "http_message.h"
+#include "http_server.h"
+#include "json_writer.h"
+#include "listener_handoff.h"
+#include "output_buffer.h"
+#include "overload.h"
+#include "pubsub.h"
+#include "rate_limiter.h"
+#include "response_writer.h"
+#include "simd_scan.h"
+#include "socket.h"
+#include "spsc_ring.h"
+#include "tls.h"
+#include "trace.h"
 #include "uri.h"
 
 using namespace high_performance_server;
@@ -47,6 +95,14 @@ void test_status_code_to_string() {
 void test_string_to_method() {
   EXPECT_TRUE(string_to_method("GET") == HttpMethod::GET);
   EXPECT_TRUE(string_to_method("post") == HttpMethod::POST);
+  // Methods are matched as packed words, which must not make padding match
+  bool thrown = false;
+  try {
+    string_to_method(std::string_view("GET\0", 4));
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  EXPECT_TRUE(thrown);
 }
 
 void test_string_to_version() {
@@ -79,7 +135,2180 @@ void test_response_to_string() {
   EXPECT_TRUE(toString(response) == expected_str);
 }
 
-int main(void) {
+void test_string_to_request() {
+  std::string request_str;
+  request_str += "post /Submit HTTP/1.1\r\n";
+  request_str += "Host: example.com\r\n";
+  request_str += "User-Agent:  curl/8.5.0 (x86_64)\t\r\n";
+  request_str += "Content-Length: 5\r\n\r\n";
+  request_str += "hello";
+
+  HttpRequest request = stringToRequest(request_str);
+  EXPECT_TRUE(request.method() == HttpMethod::POST);
+  EXPECT_TRUE(request.uri().path() == "/submit");
+  EXPECT_TRUE(request.header("Host") == "example.com");
+  EXPECT_TRUE(request.header("User-Agent") == "curl/8.5.0 (x86_64)");
+  EXPECT_TRUE(request.content() == "hello");
+
+  request = stringToRequest("GET / HTTP/1.1\r\n\r\n");
+  EXPECT_TRUE(request.headers().size() == 1);  // only Content-Length
+
+  bool rejected = false;
+  try {
+    stringToRequest("GET / HTTP/1.1\r\nBad Name: x\r\n\r\n");
+  } catch (const std::invalid_argument &) {
+    rejected = true;
+  }
+  EXPECT_TRUE(rejected);
+}
+
+// Compares every vector kernel available on this CPU against the scalar
+// kernels on random buffers biased towards the bytes the kernels look for
+void test_scan_kernels_match_scalar() {
+  const scan::ScanKernels &scalar = scan::ScalarKernels();
+  std::vector<const scan::ScanKernels *> kernels = {scan::Sse2Kernels(),
+                                                    scan::Avx2Kernels()};
+  const std::string alphabet = "\r\n:aZ-_ \t09!~\x7f\x80\xff@[`{";
+  std::mt19937 generator(42);
+
+  for (const scan::ScanKernels *vector : kernels) {
+    if (vector == nullptr) continue;
+    for (size_t length = 0; length < 200; length++) {
+      for (int round = 0; round < 20; round++) {
+        std::string input(length, 'a');
+        for (char &c : input) {
+          c = generator() % 4 == 0 ? alphabet[generator() % alphabet.size()]
+                                   : static_cast<char>(generator() % 256);
+        }
+        const char *data = input.data();
+        EXPECT_TRUE(vector->find_crlf(data, length) ==
+                    scalar.find_crlf(data, length));
+        EXPECT_TRUE(vector->find_header_end(data, length) ==
+                    scalar.find_header_end(data, length));
+        EXPECT_TRUE(vector->find_byte(data, length, ':') ==
+                    scalar.find_byte(data, length, ':'));
+        EXPECT_TRUE(vector->find_invalid_token_char(data, length) ==
+                    scalar.find_invalid_token_char(data, length));
+        EXPECT_TRUE(vector->find_json_escape(data, length) ==
+                    scalar.find_json_escape(data, length));
+
+        std::string expected = input, actual = input;
+        scalar.to_lower(&expected[0], length);
+        vector->to_lower(&actual[0], length);
+        EXPECT_TRUE(expected == actual);
+        scalar.to_upper(&expected[0], length);
+        vector->to_upper(&actual[0], length);
+        EXPECT_TRUE(expected == actual);
+      }
+    }
+
+    // Substring search, over an alphabet where partial matches are common
+    const std::string needles[] = {"-", "\r\n", "\r\n--ab", "\r\n--abab-"};
+    for (size_t length = 0; length < 200; length++) {
+      std::string input(length, 'a');
+      for (char &c : input) c = "\r\n-ab"[generator() % 5];
+      for (const std::string &needle : needles) {
+        size_t expected = input.find(needle);
+        if (expected == std::string::npos) expected = scan::kNotFound;
+        EXPECT_TRUE(scalar.find_substring(input.data(), length, needle.data(),
+                                          needle.length()) == expected);
+        EXPECT_TRUE(vector->find_substring(input.data(), length,
+                                           needle.data(),
+                                           needle.length()) == expected);
+      }
+    }
+
+    // Every byte value must be classified like the scalar token table
+    std::string all_bytes(256, '\0');
+    for (int c = 0; c < 256; c++) all_bytes[c] = static_cast<char>(c);
+    for (int c = 0; c < 256; c++) {
+      std::string block(64, 'a');
+      block[c % 64] = all_bytes[c];
+      EXPECT_TRUE(vector->find_invalid_token_char(block.data(), 64) ==
+                  scalar.find_invalid_token_char(block.data(), 64));
+      EXPECT_TRUE(vector->find_json_escape(block.data(), 64) ==
+                  scalar.find_json_escape(block.data(), 64));
+    }
+  }
+}
+
+void test_pack_upper() {
+  EXPECT_TRUE(scan::PackUpper("options", 7) ==
+              scan::PackLiteral("OPTIONS", 7));
+  EXPECT_TRUE(scan::PackUpper("Get", 3) == scan::PackLiteral("GET", 3));
+  EXPECT_TRUE(scan::PackUpper("GE{", 3) != scan::PackLiteral("GE[", 3));
+  EXPECT_TRUE(scan::PackUpper("g\xe5t", 3) != scan::PackLiteral("G\xc5T", 3));
+}
+
+void test_listener_handoff() {
+  const std::string path = "/tmp/test_high_performance_server.handoff";
+  Socket socket("127.0.0.1", 0);
+  EXPECT_TRUE(socket.Start());
+
+  std::atomic<bool> cancel(false);
+  bool offered = false;
+  std::thread old_process([&] {
+    offered = OfferListenerFds(path, {socket.GetSocketFd()}, cancel);
+  });
+  std::vector<int> fds;
+  for (int attempt = 0; attempt < 50 && fds.empty(); attempt++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    fds = AcquireListenerFds(path);
+  }
+  cancel = true;
+  old_process.join();
+
+  EXPECT_TRUE(offered);
+  EXPECT_TRUE(fds.size() == 1);
+  if (fds.size() == 1) {
+    sockaddr_in original, received;
+    socklen_t length = sizeof(original);
+    getsockname(socket.GetSocketFd(), (sockaddr *)&original, &length);
+    length = sizeof(received);
+    getsockname(fds[0], (sockaddr *)&received, &length);
+    EXPECT_TRUE(original.sin_port == received.sin_port);
+    EXPECT_TRUE(Socket(fds[0]).Start());  // still listening
+    close(fds[0]);
+  }
+  close(socket.GetSocketFd());
+}
+
+void test_request_arena() {
+  RequestArena arena(4096);
+  RequestContext context(arena.resource(), 0);
+  {
+    std::pmr::vector<int> numbers(context.allocator<int>());
+    for (int i = 0; i < 100; i++) numbers.push_back(i);
+    std::uint64_t *counter = context.Make<std::uint64_t>(7u);
+    EXPECT_TRUE(*counter == 7);
+  }
+  arena.Reset();
+  EXPECT_TRUE(arena.overflows() == 0);
+
+  // A request bigger than the arena spills to the heap, and the next one
+  // starts from the arena's buffer again
+  {
+    std::pmr::string big(8192, 'x', context.allocator<char>());
+    EXPECT_TRUE(big.length() == 8192);
+  }
+  arena.Reset();
+  EXPECT_TRUE(arena.overflows() == 1);
+  {
+    std::pmr::string small(1000, 'y', context.allocator<char>());
+  }
+  arena.Reset();
+  EXPECT_TRUE(arena.overflows() == 1);
+
+  // Messages allocate from the arena they are parsed into; copies do not
+  HttpRequest copy;
+  {
+    HttpRequest request = stringToRequest(
+        "GET /path HTTP/1.1\r\nHost: example.com\r\n\r\n", arena.resource());
+    EXPECT_TRUE(request.resource() == arena.resource());
+    EXPECT_TRUE(request.header("Host") == "example.com");
+    copy = request;
+  }
+  arena.Reset();
+  EXPECT_TRUE(copy.resource() == std::pmr::get_default_resource());
+  EXPECT_TRUE(copy.header("Host") == "example.com");
+  EXPECT_TRUE(copy.header("Missing").empty());
+}
+
+void test_form_urlencoded() {
+  const std::string body = "name=J%C3%BCrgen+M&&empty=&flag&bad=%zz%4";
+  UrlEncodedParser parser(body);
+  FormField field;
+  std::vector<std::string> names, values;
+  while (parser.Next(&field)) {
+    names.emplace_back(field.name);
+    values.emplace_back(field.value);
+  }
+  EXPECT_TRUE((names == std::vector<std::string>{"name", "empty", "flag",
+                                                 "bad"}));
+  EXPECT_TRUE(values[0] == "J%C3%BCrgen+M");
+  EXPECT_TRUE(values[1].empty() && values[2].empty());
+
+  // Values are views into the body, decoded only on request
+  std::optional<std::string_view> name = FindFormField(body, "name");
+  EXPECT_TRUE(name && name->data() == body.data() + 5);
+  EXPECT_TRUE(!FindFormField(body, "missing"));
+  RequestArena arena(1024);
+  EXPECT_TRUE(PercentDecode(*name, arena.resource()) == "J\xC3\xBCrgen M");
+  std::string_view plain = PercentDecode("plain", arena.resource());
+  EXPECT_TRUE(plain == "plain");
+  EXPECT_TRUE(PercentDecode(*FindFormField(body, "bad"), arena.resource()) ==
+              "%zz%4");
+}
+
+// Records what a multipart parser reports. Consecutive data pieces are
+// merged, since their split depends on how the body was fed.
+class RecordingSink : public MultipartSink {
+public:
+  void OnPartBegin(const MultipartPart &part) override {
+    events += "begin " + std::string(part.name) + " " +
+              std::string(part.filename) + " " +
+              std::string(part.content_type) + "\n";
+    in_data_ = false;
+  }
+  void OnPartData(std::string_view data) override {
+    if (!in_data_) events += "data ";
+    events.append(data.data(), data.length());
+    in_data_ = true;
+  }
+  void OnPartEnd() override {
+    events += "\nend\n";
+    in_data_ = false;
+  }
+
+  std::string events;
+
+private:
+  bool in_data_ = false;
+};
+
+void test_multipart_form() {
+  const std::string content_type =
+      "multipart/form-data; charset=utf-8; boundary=\"----Boundary7MA4\"";
+  std::string_view boundary = MultipartBoundary(content_type);
+  EXPECT_TRUE(boundary == "----Boundary7MA4");
+  EXPECT_TRUE(MultipartBoundary("text/plain").empty());
+
+  const std::string body =
+      "preamble\r\n"
+      "------Boundary7MA4\r\n"
+      "Content-Disposition: form-data; name=\"title\"\r\n"
+      "\r\n"
+      "Hello -- world\r\n"
+      "------Boundary7MA4\r\n"
+      "Content-Disposition: form-data; name=\"file\"; filename=\"a;b.txt\"\r\n"
+      "Content-Type: text/plain\r\n"
+      "\r\n"
+      "line 1\r\n------Boundary7MA\r\nline 2\r\n"
+      "------Boundary7MA4--\r\n"
+      "epilogue";
+
+  std::vector<MultipartField> fields = ParseMultipartForm(body, boundary);
+  EXPECT_TRUE(fields.size() == 2);
+  EXPECT_TRUE(fields[0].part.name == "title");
+  EXPECT_TRUE(fields[0].part.filename.empty());
+  EXPECT_TRUE(fields[0].content == "Hello -- world");
+  EXPECT_TRUE(fields[1].part.filename == "a;b.txt");
+  EXPECT_TRUE(fields[1].part.content_type == "text/plain");
+  EXPECT_TRUE(fields[1].content == "line 1\r\n------Boundary7MA\r\nline 2");
+  EXPECT_TRUE(fields[1].content.data() > body.data() &&
+              fields[1].content.data() < body.data() + body.length());
+
+  // Fed in pieces of every size, the parser reports the same parts
+  RecordingSink whole;
+  MultipartParser whole_parser(boundary, &whole);
+  whole_parser.Feed(body);
+  EXPECT_TRUE(whole_parser.done());
+  for (size_t piece = 1; piece < body.length(); piece++) {
+    RecordingSink sink;
+    MultipartParser parser(boundary, &sink);
+    for (size_t pos = 0; pos < body.length(); pos += piece) {
+      parser.Feed(std::string_view(body).substr(pos, piece));
+    }
+    EXPECT_TRUE(parser.done());
+    EXPECT_TRUE(sink.events == whole.events);
+  }
+
+  bool threw = false;
+  try {
+    ParseMultipartForm(body.substr(0, body.length() / 2), boundary);
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  EXPECT_TRUE(threw);
+}
+
+std::string ChainContents(const OutputChain &chain) {
+  iovec vectors[64];
+  int count = chain.Fill(vectors, 64);
+  std::string contents;
+  for (int i = 0; i < count; i++) {
+    contents.append(static_cast<const char *>(vectors[i].iov_base),
+                    vectors[i].iov_len);
+  }
+  return contents;
+}
+
+void test_output_chain() {
+  BufferPool pool;
+  OutputChain chain;
+  chain.set_pool(&pool);
+  std::string data(3 * OutputBlock::kSize + 100, 'a');
+  for (size_t i = 0; i < data.length(); i++) data[i] = 'a' + i % 26;
+  chain.Append(data);
+  EXPECT_TRUE(chain.size() == data.length());
+  EXPECT_TRUE(ChainContents(chain) == data);
+  chain.Consume(OutputBlock::kSize + 10);
+  EXPECT_TRUE(chain.Front() ==
+              std::string_view(data).substr(OutputBlock::kSize + 10,
+                                            OutputBlock::kSize - 10));
+  EXPECT_TRUE(ChainContents(chain) == data.substr(OutputBlock::kSize + 10));
+  chain.Consume(chain.size());
+  EXPECT_TRUE(chain.empty() && chain.Front().empty());
+
+  // Sent blocks are reused
+  chain.Append(data);
+  chain.Clear();
+  EXPECT_TRUE(pool.allocated() == 4);
+}
+
+void test_json_writer() {
+  BufferPool pool;
+  OutputChain chain;
+  chain.set_pool(&pool);
+  int flushes = 0;
+  auto count_flush = [](void *flushes) {
+    ++*static_cast<int *>(flushes);
+    return true;
+  };
+  ResponseWriter writer(&chain, true, false, count_flush, &flushes);
+  writer.Begin(HttpStatusCode::Ok);
+  writer.SetHeader("Content-Type", "application/json");
+  JsonWriter json(writer);
+  json.BeginObject()
+      .Key("text").String("a\"b\\c\n\x01\x1f\xc3\xa9 and a long tail")
+      .Key("numbers").BeginArray()
+          .Int(-42).Uint(18446744073709551615ULL).Double(0.1).Double(1e300)
+          .Double(0.0 / 0.0)
+      .EndArray()
+      .Key("empty").BeginObject().EndObject()
+      .Key("flags").BeginArray().Bool(true).Bool(false).Null().EndArray()
+      .EndObject();
+  bool rejected = false;
+  try {
+    writer.SetHeader("X-Late", "1");
+  } catch (const std::logic_error &) {
+    rejected = true;
+  }
+  EXPECT_TRUE(rejected);
+  writer.Finish();
+
+  const std::string body =
+      "{\"text\":\"a\\\"b\\\\c\\n\\u0001\\u001f\xc3\xa9 and a long tail\","
+      "\"numbers\":[-42,18446744073709551615,0.1,1e+300,null],"
+      "\"empty\":{},\"flags\":[true,false,null]}";
+  char size[16];
+  std::snprintf(size, sizeof(size), "%08zx\r\n", body.length());
+  EXPECT_TRUE(ChainContents(chain) ==
+              "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+              "Transfer-Encoding: chunked\r\n\r\n" +
+                  std::string(size) + body + "\r\n0\r\n\r\n");
+  EXPECT_TRUE(writer.body_bytes() == body.length());
+  EXPECT_TRUE(flushes == 0);
+
+  // Full chunks are flushed as they are written
+  chain.Clear();
+  ResponseWriter streamed(&chain, true, true, count_flush, &flushes);
+  streamed.Begin(HttpStatusCode::Ok);
+  JsonWriter array(streamed);
+  array.BeginArray();
+  for (int i = 0; i < 10000; i++) array.String("0123456789");
+  array.EndArray();
+  streamed.Finish();
+  EXPECT_TRUE(flushes == 7);
+  std::string contents = ChainContents(chain);
+  EXPECT_TRUE(contents.find("Connection: close\r\n") != std::string::npos);
+  // A chunk is closed by the write that fills it, which may go past it by
+  // less than one reserved piece
+  size_t first_chunk = contents.find("\r\n\r\n") + 4;
+  size_t chunk_size =
+      std::stoul(contents.substr(first_chunk, 8), nullptr, 16);
+  EXPECT_TRUE(chunk_size >= ResponseWriter::kChunkSize &&
+              chunk_size < ResponseWriter::kChunkSize +
+                                ResponseWriter::kMaxReserve);
+
+  // The vector scan must not skip bytes to escape anywhere in a long string
+  for (size_t at = 0; at < 100; at++) {
+    std::string text(100, 'x');
+    text[at] = '\t';
+    chain.Clear();
+    ResponseWriter one(&chain, true, false, count_flush, &flushes);
+    one.Begin(HttpStatusCode::Ok);
+    JsonWriter(one).String(text);
+    std::string escaped = ChainContents(chain);
+    std::string expected = "\"" + std::string(at, 'x') + "\\t" +
+                           std::string(99 - at, 'x') + "\"";
+    EXPECT_TRUE(escaped.compare(escaped.length() - expected.length(),
+                                expected.length(), expected) == 0);
+  }
+}
+
+void test_load_shedder() {
+  using std::chrono::milliseconds;
+  OverloadOptions options;
+  options.target_queue_delay = milliseconds(5);
+  options.interval = milliseconds(100);
+  LoadShedder shedder(options);
+  LoadShedder::Clock::time_point now;
+
+  // A burst of slow requests shorter than the interval is tolerated
+  EXPECT_TRUE(!shedder.ShouldShed(milliseconds(20), now));
+  EXPECT_TRUE(!shedder.ShouldShed(milliseconds(20), now + milliseconds(50)));
+  // A queue that stands for a whole interval triggers shedding
+  EXPECT_TRUE(shedder.ShouldShed(milliseconds(20), now + milliseconds(100)));
+  EXPECT_TRUE(shedder.overloaded());
+  // A single request served within the target ends it
+  EXPECT_TRUE(!shedder.ShouldShed(milliseconds(1), now + milliseconds(110)));
+  EXPECT_TRUE(!shedder.ShouldShed(milliseconds(20), now + milliseconds(120)));
+  EXPECT_TRUE(!shedder.overloaded());
+}
+
+void test_rate_limiter() {
+  RateLimitOptions options;
+  options.requests_per_second = 10;
+  options.burst = 3;
+  options.table_size = 8;
+  RateLimiter limiter(options);
+
+  std::uint64_t now = 1000;
+  EXPECT_TRUE(limiter.Allow(1, now));
+  EXPECT_TRUE(limiter.Allow(1, now));
+  EXPECT_TRUE(limiter.Allow(1, now));
+  EXPECT_TRUE(!limiter.Allow(1, now));
+  EXPECT_TRUE(limiter.Allow(2, now));  // other clients have their own bucket
+  EXPECT_TRUE(!limiter.Allow(1, now + 50));
+  EXPECT_TRUE(limiter.Allow(1, now + 100));  // one token per 100ms
+  EXPECT_TRUE(!limiter.Allow(1, now + 100));
+  EXPECT_TRUE(limiter.Allow(1, now + 10000));
+
+  // Many more clients than buckets: new clients still get served, by
+  // evicting the buckets that were refilled longest ago
+  for (std::uint64_t client = 100; client < 200; client++) {
+    EXPECT_TRUE(limiter.Allow(client, now + 20000 + client));
+  }
+}
+
+void test_peer_address_to_string() {
+  PeerAddress peer;
+  auto *address = reinterpret_cast<sockaddr_in *>(&peer.storage);
+  address->sin_family = AF_INET;
+  address->sin_port = htons(52144);
+  inet_pton(AF_INET, "203.0.113.7", &address->sin_addr);
+  peer.length = sizeof(*address);
+  EXPECT_TRUE(peer.ToString() == "203.0.113.7:52144");
+}
+
+void test_spsc_ring() {
+  SpscRing<int> ring(3);
+  EXPECT_TRUE(ring.capacity() == 4);
+  for (int i = 0; i < 4; i++) EXPECT_TRUE(ring.TryPush(i));
+  EXPECT_TRUE(!ring.TryPush(4));
+
+  std::vector<int> popped;
+  auto consume = [&popped](int value) { popped.push_back(value); };
+  EXPECT_TRUE(ring.PopBatch(3, consume) == 3);
+  EXPECT_TRUE(ring.TryPush(4));
+  EXPECT_TRUE(ring.PopBatch(10, consume) == 2);
+  EXPECT_TRUE(ring.PopBatch(10, consume) == 0);
+  EXPECT_TRUE((popped == std::vector<int>{0, 1, 2, 3, 4}));
+
+  // Everything pushed by one thread comes out once and in order on another
+  SpscRing<int> shared(64);
+  const int count = 100000;
+  std::thread producer([&shared]() {
+    for (int i = 0; i < count; i++) {
+      while (!shared.TryPush(i)) std::this_thread::yield();
+    }
+  });
+  int expected = 0;
+  bool in_order = true;
+  while (expected < count) {
+    shared.PopBatch(16, [&](int value) { in_order &= value == expected++; });
+  }
+  producer.join();
+  EXPECT_TRUE(in_order);
+}
+
+void test_access_log() {
+  const std::string path = "/tmp/high_performance_server_test.log";
+  std::remove(path.c_str());
+  std::remove((path + ".1").c_str());
+  std::remove((path + ".2").c_str());
+
+  AccessLogOptions options;
+  options.path = path;
+  options.max_file_size = 200;
+  options.max_files = 1;
+  options.flush_interval = std::chrono::milliseconds(1);
+  AccessLogger logger(options, 1);
+  EXPECT_TRUE(logger.Start());
+
+  AccessLogRecord record = {};
+  PeerAddress peer;
+  auto *address = reinterpret_cast<sockaddr_in *>(&peer.storage);
+  address->sin_family = AF_INET;
+  address->sin_port = htons(52144);
+  inet_pton(AF_INET, "203.0.113.7", &address->sin_addr);
+  record.SetPeer(peer);
+  record.SetPath("/say \"hi\"\n");
+  record.method = HttpMethod::GET;
+  record.status = 200;
+  record.bytes = 135;
+  record.time_us = 1700000000123456;
+  record.total_ns = 15345;
+  EXPECT_TRUE(logger.Sample(0));
+  logger.Append(0, record);
+  logger.Stop();
+  EXPECT_TRUE(logger.written() == 1);
+
+  std::ifstream log(path);
+  std::string line;
+  std::getline(log, line);
+  EXPECT_TRUE(line ==
+              "time=2023-11-14T22:13:20.123456Z peer=203.0.113.7:52144 "
+              "method=GET path=\"/say \\\"hi\\\"\\x0a\" status=200 "
+              "bytes=135 parse_us=0.0 handler_us=0.0 total_us=15.3");
+
+  // A full log is moved to path.1 and the oldest file beyond max_files goes
+  AccessLogger rotating(options, 1);
+  EXPECT_TRUE(rotating.Start());
+  for (int i = 0; i < 10; i++) rotating.Append(0, record);
+  rotating.Stop();
+  EXPECT_TRUE(std::ifstream(path + ".1").good());
+  EXPECT_TRUE(!std::ifstream(path + ".2").good());
+
+  options.sample_rate = 3;
+  AccessLogger sampled(options, 2);
+  int sampled_count = 0;
+  for (int i = 0; i < 9; i++) sampled_count += sampled.Sample(1);
+  EXPECT_TRUE(sampled_count == 3);
+
+  std::remove(path.c_str());
+  std::remove((path + ".1").c_str());
+}
+
+#ifdef HAVE_OPENSSL
+// A P-256 key and a certificate for "localhost" signed with it
+bool WriteSelfSignedCertificate(const std::string &certificate_path,
+                                const std::string &key_path) {
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *certificate = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+  X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+  X509_NAME *name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+  X509_set_pubkey(certificate, key);
+  X509_sign(certificate, key, EVP_sha256());
+
+  FILE *file = fopen(certificate_path.c_str(), "w");
+  bool written = file != nullptr && PEM_write_X509(file, certificate);
+  if (file != nullptr) fclose(file);
+  file = fopen(key_path.c_str(), "w");
+  written = written && file != nullptr &&
+            PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr,
+                                 nullptr);
+  if (file != nullptr) fclose(file);
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+  return written;
+}
+
+struct TlsExchange {
+  bool handshake_done = false;
+  bool session_reused = false;
+  std::string alpn_protocol;
+  std::string request;
+  std::string response;
+};
+
+// A blocking OpenSSL client sends "ping" over loopback TCP and the server
+// side answers "pong" from a non-blocking TlsConnection, as a worker would
+TlsExchange ExchangeOverTls(const TlsContext &context, SSL_CTX *client_context,
+                            const std::string &client_alpn,
+                            SSL_SESSION **session) {
+  TlsExchange exchange;
+  Socket listener("127.0.0.1", 0);
+  if (!listener.Start()) return exchange;
+  sockaddr_in address;
+  socklen_t length = sizeof(address);
+  getsockname(listener.GetSocketFd(), (sockaddr *)&address, &length);
+
+  std::thread client([&] {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    connect(fd, (sockaddr *)&address, sizeof(address));
+    SSL *ssl = SSL_new(client_context);
+    SSL_set_fd(ssl, fd);
+    SSL_set_alpn_protos(ssl, (const unsigned char *)client_alpn.data(),
+                        client_alpn.length());
+    if (*session != nullptr) SSL_set_session(ssl, *session);
+    char buffer[16];
+    int count;
+    if (SSL_connect(ssl) == 1 && SSL_write(ssl, "ping", 4) == 4 &&
+        (count = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+      exchange.response.assign(buffer, count);
+      if (*session != nullptr) SSL_SESSION_free(*session);
+      *session = SSL_get1_session(ssl);
+      SSL_shutdown(ssl);  // a session cut short is not resumed
+    }
+    SSL_free(ssl);
+    close(fd);
+  });
+
+  int fd = -1;
+  for (int attempt = 0; attempt < 1000 && fd < 0; attempt++) {
+    fd = accept4(listener.GetSocketFd(), nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  TlsConnection connection(context, fd);
+  for (int attempt = 0; attempt < 1000; attempt++) {
+    auto status = connection.Handshake();
+    if (status == TlsConnection::HandshakeStatus::Done ||
+        status == TlsConnection::HandshakeStatus::Failed) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  exchange.handshake_done = connection.handshake_done();
+  if (exchange.handshake_done) {
+    exchange.session_reused = connection.session_reused();
+    exchange.alpn_protocol = connection.alpn_protocol();
+    char buffer[16];
+    ssize_t count = -1;
+    for (int attempt = 0; attempt < 1000 && count < 0; attempt++) {
+      count = connection.Read(buffer, sizeof(buffer));
+      if (count < 0 && errno != EAGAIN) break;
+      if (count < 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (count > 0) exchange.request.assign(buffer, count);
+    connection.Write("pong", 4);
+    connection.Shutdown();
+  }
+  client.join();
+  close(fd);
+  close(listener.GetSocketFd());
+  return exchange;
+}
+#endif
+
+void test_tls() {
+#ifdef HAVE_OPENSSL
+  const std::string certificate = "/tmp/high_performance_server_test.crt";
+  const std::string key = "/tmp/high_performance_server_test.key";
+  EXPECT_TRUE(TlsAvailable());
+  EXPECT_TRUE(WriteSelfSignedCertificate(certificate, key));
+
+  TlsOptions options;
+  options.certificate_file = certificate;
+  options.private_key_file = key;
+  TlsContext context(options);
+  SSL_CTX *client_context = SSL_CTX_new(TLS_client_method());
+  SSL_SESSION *session = nullptr;
+  const std::string h2_and_http11("\x02h2\x08http/1.1", 12);
+
+  TlsExchange first =
+      ExchangeOverTls(context, client_context, h2_and_http11, &session);
+  EXPECT_TRUE(first.handshake_done);
+  EXPECT_TRUE(!first.session_reused);
+  EXPECT_TRUE(first.alpn_protocol == "http/1.1");
+  EXPECT_TRUE(first.request == "ping");
+  EXPECT_TRUE(first.response == "pong");
+
+  // The ticket from the first connection resumes the session
+  TlsExchange resumed =
+      ExchangeOverTls(context, client_context, h2_and_http11, &session);
+  EXPECT_TRUE(resumed.handshake_done);
+  EXPECT_TRUE(resumed.session_reused);
+  EXPECT_TRUE(resumed.response == "pong");
+
+  // A client that cannot speak HTTP/1.1 is refused
+  SSL_SESSION *no_session = nullptr;
+  TlsExchange refused = ExchangeOverTls(
+      context, client_context, std::string("\x02h2", 3), &no_session);
+  EXPECT_TRUE(!refused.handshake_done);
+
+  SSL_SESSION_free(session);
+  SSL_CTX_free(client_context);
+  options.certificate_file = "/nonexistent.crt";
+  bool thrown = false;
+  try {
+    TlsContext missing(options);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  EXPECT_TRUE(thrown);
+  std::remove(certificate.c_str());
+  std::remove(key.c_str());
+#else
+  EXPECT_TRUE(!TlsAvailable());
+#endif
+}
+
+// A keep-alive client of an HttpServer with TLS: a body spanning several
+// output blocks, then a short answer before the server closes
+void test_tls_server() {
+#ifdef HAVE_OPENSSL
+  const std::string certificate = "/tmp/high_performance_server_test.crt";
+  const std::string key = "/tmp/high_performance_server_test.key";
+  EXPECT_TRUE(WriteSelfSignedCertificate(certificate, key));
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::Tcp("127.0.0.1", 0)});
+  const std::string large(100000, 'x');
+  server.RegisterHttpRequestHandler("/large", HttpMethod::GET,
+                                    [&](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent(large);
+                                      return response;
+                                    });
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET,
+                                    [](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent("hello");
+                                      return response;
+                                    });
+  TlsOptions options;
+  options.certificate_file = certificate;
+  options.private_key_file = key;
+  server.EnableTls(options);
+  server.Start();
+
+  sockaddr_in address;
+  socklen_t address_length = sizeof(address);
+  getsockname(server.listener_fds()[0], (sockaddr *)&address, &address_length);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  connect(fd, (sockaddr *)&address, sizeof(address));
+  SSL_CTX *client_context = SSL_CTX_new(TLS_client_method());
+  SSL *ssl = SSL_new(client_context);
+  SSL_set_fd(ssl, fd);
+  // Reads until the response holds at least length bytes, or to the end
+  auto read_response = [ssl](size_t length) {
+    std::string response;
+    char buffer[4096];
+    int count;
+    while (response.length() < length &&
+           (count = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+      response.append(buffer, count);
+    }
+    return response;
+  };
+  std::string first, second;
+  const std::string request = "GET /large HTTP/1.1\r\nHost: test\r\n\r\n";
+  const std::string last =
+      "GET / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+  if (SSL_connect(ssl) == 1 &&
+      SSL_write(ssl, request.data(), request.length()) > 0) {
+    first = read_response(large.length());
+    size_t end = first.find("\r\n\r\n");
+    if (end != std::string::npos && first.length() < end + 4 + large.length()) {
+      first += read_response(end + 4 + large.length() - first.length());
+    }
+    if (SSL_write(ssl, last.data(), last.length()) > 0) {
+      second = read_response(std::string::npos);
+    }
+  }
+  SSL_free(ssl);
+  SSL_CTX_free(client_context);
+  close(fd);
+
+  size_t first_end = first.find("\r\n\r\n");
+  EXPECT_TRUE(first.find("HTTP/1.1 200 OK\r\n") == 0);
+  EXPECT_TRUE(first_end != std::string::npos &&
+              first.length() == first_end + 4 + large.length() &&
+              first.compare(first_end + 4, large.length(), large) == 0);
+  EXPECT_TRUE(second.find("HTTP/1.1 200 OK\r\n") == 0);
+  EXPECT_TRUE(second.length() > 5 &&
+              second.compare(second.length() - 5, 5, "hello") == 0);
+
+  server.Stop(std::chrono::milliseconds(100));
+  ServerStats stats = server.stats();
+  EXPECT_TRUE(stats.tls_handshakes == 1);
+  EXPECT_TRUE(stats.tls_connections_failed == 0);
+  std::remove(certificate.c_str());
+  std::remove(key.c_str());
+#endif
+}
+
+void test_listen_endpoint_parse() {
+  ListenEndpoint ipv4 = ListenEndpoint::Parse("127.0.0.1:8080");
+  EXPECT_TRUE(ipv4.kind == ListenEndpoint::Kind::Tcp);
+  EXPECT_TRUE(ipv4.address == "127.0.0.1" && ipv4.port == 8080);
+  ListenEndpoint ipv6 = ListenEndpoint::Parse("[::1]:443");
+  EXPECT_TRUE(ipv6.address == "::1" && ipv6.port == 443);
+  EXPECT_TRUE(ipv6.ToString() == "[::1]:443");
+  ListenEndpoint path = ListenEndpoint::Parse("unix:/run/server.sock");
+  EXPECT_TRUE(path.kind == ListenEndpoint::Kind::Unix);
+  EXPECT_TRUE(path.address == "/run/server.sock");
+  ListenEndpoint abstract = ListenEndpoint::Parse("@server");
+  EXPECT_TRUE(abstract.kind == ListenEndpoint::Kind::AbstractUnix);
+  EXPECT_TRUE(abstract.address == "server");
+  EXPECT_TRUE(ListenEndpoint::Parse("unix:@server").ToString() == "@server");
+
+  for (const char *invalid : {"8080", "::1:8080", "host:", "host:65536",
+                              "unix:", "@", "[::1]8080"}) {
+    bool thrown = false;
+    try {
+      ListenEndpoint::Parse(invalid);
+    } catch (const std::invalid_argument &) {
+      thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+  }
+}
+
+void test_socket_endpoints() {
+  Socket invalid("256.0.0.1", 0);
+  EXPECT_TRUE(!invalid.Start());
+  EXPECT_TRUE(invalid.error().find("256.0.0.1") != std::string::npos);
+
+  ListenEndpoint ipv6 = ListenEndpoint::Tcp("::1", 0);
+  ipv6.options.ipv6_only = true;
+  ipv6.options.tcp_nodelay = true;
+  ipv6.options.tcp_defer_accept = 1;
+  ipv6.options.tcp_fastopen = 16;
+  Socket ipv6_socket(ipv6);
+  // Hosts without IPv6 cannot bind ::1
+  if (ipv6_socket.Start()) {
+    sockaddr_in6 bound;
+    socklen_t length = sizeof(bound);
+    getsockname(ipv6_socket.GetSocketFd(), (sockaddr *)&bound, &length);
+    EXPECT_TRUE(bound.sin6_family == AF_INET6);
+    close(ipv6_socket.GetSocketFd());
+  }
+
+  // A stale socket file is replaced, a live one is not
+  const std::string path = "/tmp/high_performance_server_test.sock";
+  Socket first(ListenEndpoint::Unix(path));
+  EXPECT_TRUE(first.Start());
+  Socket second(ListenEndpoint::Unix(path));
+  EXPECT_TRUE(!second.Start());
+  close(first.GetSocketFd());
+  Socket third(ListenEndpoint::Unix(path));
+  EXPECT_TRUE(third.Start());
+  close(third.GetSocketFd());
+  unlink(path.c_str());
+
+  Socket abstract(ListenEndpoint::AbstractUnix("high_performance_server_test"));
+  EXPECT_TRUE(abstract.Start());
+  int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::string name("\0high_performance_server_test", 29);
+  std::memcpy(address.sun_path, name.data(), name.length());
+  EXPECT_TRUE(connect(client, (sockaddr *)&address,
+                      offsetof(sockaddr_un, sun_path) + name.length()) == 0);
+  close(client);
+  close(abstract.GetSocketFd());
+
+  // IPv4 clients of a dual-stack listener count as the same client
+  PeerAddress ipv4_peer, mapped_peer;
+  auto *ipv4_address = reinterpret_cast<sockaddr_in *>(&ipv4_peer.storage);
+  ipv4_address->sin_family = AF_INET;
+  inet_pton(AF_INET, "203.0.113.7", &ipv4_address->sin_addr);
+  auto *mapped_address = reinterpret_cast<sockaddr_in6 *>(&mapped_peer.storage);
+  mapped_address->sin6_family = AF_INET6;
+  inet_pton(AF_INET6, "::ffff:203.0.113.7", &mapped_address->sin6_addr);
+  EXPECT_TRUE(ipv4_peer.Key() == mapped_peer.Key());
+}
+
+size_t CountOccurrences(const std::string &text, const std::string &pattern) {
+  size_t count = 0;
+  for (size_t at = text.find(pattern); at != std::string::npos;
+       at = text.find(pattern, at + 1)) {
+    count++;
+  }
+  return count;
+}
+
+// Reads from a blocking socket until `length` bytes or the end of the stream
+std::string ReadResponse(int fd, size_t length) {
+  std::string response;
+  char buffer[4096];
+  while (response.length() < length) {
+    ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+    if (count <= 0) break;
+    response.append(buffer, count);
+  }
+  return response;
+}
+
+// A client of the abstract Unix domain socket `name`
+int ConnectAbstract(const std::string &name) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path + 1, name.data(), name.length());
+  socklen_t address_length =
+      offsetof(sockaddr_un, sun_path) + 1 + name.length();
+  int client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+  return client;
+}
+
+// Sends a request for `target` on a kept-alive connection, and returns the
+// body of a response small enough to arrive in one piece
+std::string GetBody(int fd, const std::string &target) {
+  std::string request = "GET " + target + " HTTP/1.1\r\nHost: test\r\n\r\n";
+  send(fd, request.data(), request.length(), MSG_NOSIGNAL);
+  char buffer[4096];
+  ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+  std::string response(buffer, count > 0 ? count : 0);
+  size_t at = response.find("\r\n\r\n");
+  return at == std::string::npos ? std::string() : response.substr(at + 4);
+}
+
+// Sends one request for `target` on a new connection, then shuts down the
+// client's side, and returns the whole response. Refused requests are not
+// parsed, so the server would not see a "Connection: close".
+std::string Fetch(const std::string &name, const std::string &target) {
+  int client = ConnectAbstract(name);
+  std::string request = "GET " + target + " HTTP/1.1\r\nHost: test\r\n\r\n";
+  send(client, request.data(), request.length(), MSG_NOSIGNAL);
+  shutdown(client, SHUT_WR);
+  std::string response = ReadResponse(client, SIZE_MAX);
+  close(client);
+  return response;
+}
+
+void test_edge_triggered_connections() {
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::AbstractUnix("high_performance_server_test_et")});
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET,
+                                    [](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent("hello");
+                                      return response;
+                                    });
+  server.Start();
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::string name("\0high_performance_server_test_et", 32);
+  std::memcpy(address.sun_path, name.data(), name.length());
+  socklen_t address_length = offsetof(sockaddr_un, sun_path) + name.length();
+  const std::string request = "GET / HTTP/1.1\r\nHost: test\r\n\r\n";
+
+  // Keep-alive requests cost no epoll_ctl beyond registering the connection
+  int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+  std::string expected;
+  for (int i = 0; i < 3; i++) {
+    send(client, request.data(), request.length(), 0);
+    if (i == 0) expected = ReadResponse(client, 1);
+    else EXPECT_TRUE(ReadResponse(client, expected.length()) == expected);
+  }
+  EXPECT_TRUE(expected.find("hello") != std::string::npos);
+  std::uint64_t requests = 0, epoll_ctls = 0;
+  for (const WorkerStats &worker : server.stats().workers) {
+    requests += worker.requests;
+    epoll_ctls += worker.epoll_ctls;
+  }
+  EXPECT_TRUE(requests == 3);
+  EXPECT_TRUE(epoll_ctls == 1);
+  close(client);
+
+  // A client that shuts down its side right after the request still gets
+  // the response, then the end of the stream
+  client = socket(AF_UNIX, SOCK_STREAM, 0);
+  EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+  send(client, request.data(), request.length(), 0);
+  shutdown(client, SHUT_WR);
+  EXPECT_TRUE(ReadResponse(client, SIZE_MAX) == expected);
+  close(client);
+
+  server.Stop(std::chrono::milliseconds(100));
+}
+
+// What the test binary runs as the successor in test_spawned_successor:
+// serves on the sockets it inherited until it is killed
+int ServeInheritedListeners() {
+  std::vector<int> fds = InheritedListenerFds();
+  if (fds.empty()) return 1;
+  HttpServer server(fds);
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET,
+                                    [](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent("new");
+                                      return response;
+                                    });
+  server.Start();
+  while (true) pause();
+}
+
+void test_spawned_successor() {
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::AbstractUnix("high_performance_server_test_successor")});
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET,
+                                    [](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent("old");
+                                      return response;
+                                    });
+  server.Start();
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::string name("\0high_performance_server_test_successor", 39);
+  std::memcpy(address.sun_path, name.data(), name.length());
+  socklen_t address_length = offsetof(sockaddr_un, sun_path) + name.length();
+  auto connect_client = [&] {
+    int client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    timeval timeout = {2, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+    return client;
+  };
+  // The body of a response that arrives in one piece
+  auto get = [](int client) {
+    const std::string request = "GET / HTTP/1.1\r\nHost: test\r\n\r\n";
+    send(client, request.data(), request.length(), 0);
+    char buffer[4096];
+    ssize_t count = recv(client, buffer, sizeof(buffer), 0);
+    std::string response(buffer, count > 0 ? count : 0);
+    size_t at = response.find("\r\n\r\n");
+    return at == std::string::npos ? std::string() : response.substr(at + 4);
+  };
+
+  int idle = connect_client();
+  EXPECT_TRUE(get(idle) == "old");
+  pid_t successor = SpawnWithListenerFds(
+      "/proc/self/exe",
+      {"test_high_performance_server", "--serve-inherited-listeners"},
+      server.listener_fds());
+  EXPECT_TRUE(successor > 0);
+  server.Stop(std::chrono::milliseconds(200));
+
+  // The successor got the listening sockets and nothing else: closing the
+  // drained connection reached the client
+  char byte;
+  EXPECT_TRUE(recv(idle, &byte, 1, 0) == 0);
+  close(idle);
+  int client = connect_client();
+  EXPECT_TRUE(get(client) == "new");
+  close(client);
+
+  kill(successor, SIGKILL);
+  waitpid(successor, nullptr, 0);
+}
+
+// A keep-alive request still in its handler when Stop() is called is
+// answered, with "Connection: close", and the connection closed without
+// waiting for the drain timeout
+void test_graceful_stop() {
+  const std::string name = "high_performance_server_test_stop";
+  HttpServer server(
+      std::vector<ListenEndpoint>{ListenEndpoint::AbstractUnix(name)});
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET,
+                                    [](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent("fast");
+                                      return response;
+                                    });
+  server.RegisterHttpRequestHandler(
+      "/slow", HttpMethod::GET, [](const HttpRequest &) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        HttpResponse response(HttpStatusCode::Ok);
+        response.SetContent("slow");
+        return response;
+      });
+  OverloadOptions overload;
+  overload.adaptive_shedding = false;
+  server.SetOverloadOptions(overload);
+  server.Start();
+
+  int client = ConnectAbstract(name);
+  timeval timeout = {2, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  auto send_request = [client](const std::string &target) {
+    std::string request = "GET " + target + " HTTP/1.1\r\nHost: test\r\n\r\n";
+    send(client, request.data(), request.length(), 0);
+  };
+  send_request("/");
+  char buffer[4096];
+  ssize_t count = recv(client, buffer, sizeof(buffer), 0);
+  std::string first(buffer, count > 0 ? count : 0);
+  EXPECT_TRUE(first.find("HTTP/1.1 200 OK\r\n") == 0);
+  EXPECT_TRUE(first.find("Connection: close") == std::string::npos);
+
+  send_request("/slow");
+  std::string last;
+  std::thread reader([&] { last = ReadResponse(client, SIZE_MAX); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  auto stop_start = std::chrono::steady_clock::now();
+  server.Stop(std::chrono::milliseconds(5000));
+  auto stop_time = std::chrono::steady_clock::now() - stop_start;
+  reader.join();
+  close(client);
+
+  EXPECT_TRUE(last.find("HTTP/1.1 200 OK\r\n") == 0);
+  EXPECT_TRUE(last.find("\r\nConnection: close\r\n") != std::string::npos);
+  EXPECT_TRUE(last.length() > 4 &&
+              last.compare(last.length() - 4, 4, "slow") == 0);
+  EXPECT_TRUE(stop_time < std::chrono::milliseconds(2000));
+}
+
+// Listeners handed over to a new server keep the options of the endpoints
+// they were created for: here, a plaintext listener of a TLS server
+void test_adopted_listener_options() {
+  ListenEndpoint plain = ListenEndpoint::AbstractUnix(
+      "high_performance_server_test_adopted");
+  plain.options.tls = false;
+  ListenEndpoint tcp = ListenEndpoint::Tcp("127.0.0.1", 0);
+  ListenEndpoint other = ListenEndpoint::AbstractUnix(
+      "high_performance_server_test_other");
+  Socket plain_socket(plain), tcp_socket(tcp);
+  EXPECT_TRUE(plain_socket.Start() && tcp_socket.Start());
+  int plain_fd = plain_socket.GetSocketFd();
+  int tcp_fd = tcp_socket.GetSocketFd();
+  EXPECT_TRUE(plain.BoundTo(plain_fd) && !plain.BoundTo(tcp_fd));
+  EXPECT_TRUE(tcp.BoundTo(tcp_fd) && !tcp.BoundTo(plain_fd));
+  EXPECT_TRUE(!other.BoundTo(plain_fd));
+  EXPECT_TRUE(!ListenEndpoint::Tcp("127.0.0.1", 1).BoundTo(tcp_fd));
+
+#ifdef HAVE_OPENSSL
+  const std::string certificate = "/tmp/high_performance_server_test.crt";
+  const std::string key = "/tmp/high_performance_server_test.key";
+  EXPECT_TRUE(WriteSelfSignedCertificate(certificate, key));
+  HttpServer server(std::vector<int>{tcp_fd, plain_fd},
+                    std::vector<ListenEndpoint>{tcp, other, plain});
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET,
+                                    [](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent("plain");
+                                      return response;
+                                    });
+  TlsOptions options;
+  options.certificate_file = certificate;
+  options.private_key_file = key;
+  server.EnableTls(options);
+  server.Start();
+  EXPECT_TRUE(Fetch(plain.address, "/").find("HTTP/1.1 200 OK\r\n") == 0);
+  server.Stop(std::chrono::milliseconds(100));
+  EXPECT_TRUE(server.stats().tls_handshakes == 0);
+  std::remove(certificate.c_str());
+  std::remove(key.c_str());
+#else
+  close(plain_fd);
+  close(tcp_fd);
+#endif
+}
+
+// Reads one "Connection: close" response to the end and decodes its
+// chunked body into `body`. Returns the head.
+std::string ReadChunkedResponse(int fd, std::string *body) {
+  std::string response = ReadResponse(fd, SIZE_MAX);
+  size_t at = response.find("\r\n\r\n");
+  if (at == std::string::npos) return std::string();
+  std::string head = response.substr(0, at + 2);
+  at += 4;
+  body->clear();
+  while (at < response.length()) {
+    size_t line_end = response.find("\r\n", at);
+    size_t size = std::stoul(response.substr(at, line_end - at), nullptr, 16);
+    if (size == 0) break;
+    body->append(response, line_end + 2, size);
+    at = line_end + 2 + size + 2;
+  }
+  return head;
+}
+
+void test_rate_limited_requests() {
+  const std::string name = "high_performance_server_test_rate";
+  HttpServer server(
+      std::vector<ListenEndpoint>{ListenEndpoint::AbstractUnix(name)});
+  std::atomic<int> handled(0);
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET,
+                                    [&](const HttpRequest &) {
+                                      handled++;
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent("hello");
+                                      return response;
+                                    });
+  RateLimitOptions options;
+  options.requests_per_second = 0.5;
+  options.burst = 2;
+  server.SetRateLimit(options);
+  const std::string log_path = "/tmp/high_performance_server_test_rate.log";
+  std::remove(log_path.c_str());
+  AccessLogOptions log_options;
+  log_options.path = log_path;
+  server.EnableAccessLog(log_options);
+  server.Start();
+
+  EXPECT_TRUE(Fetch(name, "/").find("HTTP/1.1 200 OK\r\n") == 0);
+  EXPECT_TRUE(Fetch(name, "/").find("HTTP/1.1 200 OK\r\n") == 0);
+  // Over the limit: refused without running the handler, and told when
+  // to come back
+  std::string response = Fetch(name, "/");
+  EXPECT_TRUE(response.find("HTTP/1.1 429 Too Many Requests\r\n") == 0);
+  EXPECT_TRUE(response.find("\r\nRetry-After: 2\r\n") != std::string::npos);
+  EXPECT_TRUE(handled == 2);
+
+  server.Stop(std::chrono::milliseconds(100));
+  EXPECT_TRUE(server.stats().requests_rate_limited == 1);
+  // Refused requests are logged too, with their status
+  std::ifstream log(log_path);
+  std::string contents((std::istreambuf_iterator<char>(log)),
+                       std::istreambuf_iterator<char>());
+  EXPECT_TRUE(CountOccurrences(contents, " status=200 ") == 2);
+  EXPECT_TRUE(CountOccurrences(contents, "method=GET path=\"/\" status=429 ") ==
+              1);
+  std::remove(log_path.c_str());
+}
+
+void test_overload_protection() {
+  const std::string name = "high_performance_server_test_overload";
+  HttpServer server(
+      std::vector<ListenEndpoint>{ListenEndpoint::AbstractUnix(name)});
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET,
+                                    [](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent("hello");
+                                      return response;
+                                    });
+  server.RegisterHttpRequestHandler(
+      "/slow", HttpMethod::GET, [](const HttpRequest &) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        HttpResponse response(HttpStatusCode::Ok);
+        response.SetContent("slow");
+        return response;
+      });
+  OverloadOptions options;
+  options.max_connections = 2;
+  options.max_requests_in_flight = 1;
+  options.adaptive_shedding = false;
+  options.retry_after = std::chrono::seconds(3);
+  server.SetOverloadOptions(options);
+  const std::string log_path = "/tmp/high_performance_server_test_overload.log";
+  std::remove(log_path.c_str());
+  AccessLogOptions log_options;
+  log_options.path = log_path;
+  server.EnableAccessLog(log_options);
+  server.Start();
+
+  // A handler still running counts against the limit on the other workers
+  std::string slow;
+  std::thread slow_client([&] { slow = Fetch(name, "/slow"); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  std::string refused = Fetch(name, "/");
+  slow_client.join();
+  EXPECT_TRUE(slow.find("HTTP/1.1 200 OK\r\n") == 0);
+  EXPECT_TRUE(refused.find("HTTP/1.1 503 Service Unavailable\r\n") == 0);
+  EXPECT_TRUE(refused.find("\r\nRetry-After: 3\r\n") != std::string::npos);
+  EXPECT_TRUE(Fetch(name, "/").find("HTTP/1.1 200 OK\r\n") == 0);
+
+  // At the connection cap the third client waits in the backlog until one
+  // of the first two leaves
+  int first = ConnectAbstract(name);
+  int second = ConnectAbstract(name);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  int third = ConnectAbstract(name);
+  timeval timeout = {0, 200000};
+  setsockopt(third, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  const std::string request =
+      "GET / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+  send(third, request.data(), request.length(), 0);
+  char buffer[64];
+  EXPECT_TRUE(recv(third, buffer, sizeof(buffer), 0) < 0);
+  EXPECT_TRUE(server.stats().connections == 2);
+  EXPECT_TRUE(server.stats().accept_pauses >= 1);
+  close(first);
+  timeout.tv_sec = 2;
+  setsockopt(third, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  EXPECT_TRUE(ReadResponse(third, SIZE_MAX).find("HTTP/1.1 200 OK\r\n") == 0);
+  close(second);
+  close(third);
+
+  server.Stop(std::chrono::milliseconds(100));
+  EXPECT_TRUE(server.stats().requests_shed == 1);
+  std::ifstream log(log_path);
+  std::string contents((std::istreambuf_iterator<char>(log)),
+                       std::istreambuf_iterator<char>());
+  EXPECT_TRUE(CountOccurrences(contents, "method=GET path=\"/\" status=503 ") ==
+              1);
+  std::remove(log_path.c_str());
+}
+
+// Handlers answering with the id of the worker that ran them, "/slow" after
+// keeping it busy for `slow` first
+void RegisterWorkerIdHandlers(HttpServer &server,
+                              std::chrono::milliseconds slow) {
+  auto handler = [slow](const HttpRequest &request, RequestContext &context) {
+    if (request.uri().path() == "/slow") std::this_thread::sleep_for(slow);
+    HttpResponse response(HttpStatusCode::Ok);
+    response.SetContent(std::to_string(context.worker_id()));
+    return response;
+  };
+  server.RegisterHttpRequestHandler("/id", HttpMethod::GET, handler);
+  server.RegisterHttpRequestHandler("/slow", HttpMethod::GET, handler);
+}
+
+void test_connection_balancing() {
+  OverloadOptions overload;
+  overload.adaptive_shedding = false;
+
+  // A new connection goes to the worker that lost one, not to the next in
+  // turn
+  const std::string name = "high_performance_server_test_least_connections";
+  HttpServer server(
+      std::vector<ListenEndpoint>{ListenEndpoint::AbstractUnix(name)});
+  RegisterWorkerIdHandlers(server, std::chrono::milliseconds(0));
+  BalancingOptions balancing;
+  balancing.mode = BalancingMode::LeastConnections;
+  server.SetBalancingOptions(balancing);
+  server.SetOverloadOptions(overload);
+  server.Start();
+  const int workers = static_cast<int>(server.stats().workers.size());
+  std::vector<int> clients;
+  std::vector<std::string> ids;
+  for (int i = 0; i < workers; i++) {
+    clients.push_back(ConnectAbstract(name));
+    ids.push_back(GetBody(clients.back(), "/id"));
+  }
+  std::vector<std::string> distinct(ids);
+  std::sort(distinct.begin(), distinct.end());
+  EXPECT_TRUE(std::unique(distinct.begin(), distinct.end()) == distinct.end());
+  int left = std::atoi(ids[2].c_str());
+  close(clients[2]);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    if (server.stats().workers[left].connections == 0) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  clients[2] = ConnectAbstract(name);
+  EXPECT_TRUE(GetBody(clients[2], "/id") == ids[2]);
+  for (int client : clients) close(client);
+  server.Stop(std::chrono::milliseconds(100));
+
+  // New connections avoid a busy worker even once it has the fewest
+  const std::string busy_name = "high_performance_server_test_least_busy";
+  HttpServer busy_server(
+      std::vector<ListenEndpoint>{ListenEndpoint::AbstractUnix(busy_name)});
+  RegisterWorkerIdHandlers(busy_server, std::chrono::milliseconds(20));
+  balancing.mode = BalancingMode::LeastBusy;
+  busy_server.SetBalancingOptions(balancing);
+  busy_server.SetOverloadOptions(overload);
+  busy_server.Start();
+  int busy_client = ConnectAbstract(busy_name);
+  std::string busy_id = GetBody(busy_client, "/id");
+  std::atomic<bool> done(false);
+  std::thread load([&] {
+    while (!done) GetBody(busy_client, "/slow");
+  });
+  int busy_worker = std::atoi(busy_id.c_str());
+  for (int attempt = 0; attempt < 100; attempt++) {
+    if (busy_server.stats().workers[busy_worker].busy > 0.5) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_TRUE(busy_server.stats().workers[busy_worker].busy > 0.5);
+  clients.clear();
+  bool avoided = true;
+  for (int i = 0; i < 2 * workers - 1; i++) {
+    clients.push_back(ConnectAbstract(busy_name));
+    avoided = avoided && GetBody(clients.back(), "/id") != busy_id;
+  }
+  EXPECT_TRUE(avoided);
+  done = true;
+  load.join();
+  close(busy_client);
+  for (int client : clients) close(client);
+  busy_server.Stop(std::chrono::milliseconds(100));
+}
+
+// A worker kept busy gives its idle keep-alive connections away. They keep
+// working on the new worker, while a connection in the middle of a response
+// stays where it is.
+void test_connection_migration() {
+  const std::string name = "high_performance_server_test_migration";
+  HttpServer server(
+      std::vector<ListenEndpoint>{ListenEndpoint::AbstractUnix(name)});
+  RegisterWorkerIdHandlers(server, std::chrono::milliseconds(30));
+  const std::string large(8 << 20, 'x');
+  server.RegisterHttpRequestHandler("/large", HttpMethod::GET,
+                                    [&](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent(large);
+                                      return response;
+                                    });
+  BalancingOptions balancing;
+  balancing.migrate_connections = true;
+  server.SetBalancingOptions(balancing);
+  OverloadOptions overload;
+  overload.adaptive_shedding = false;
+  server.SetOverloadOptions(overload);
+  server.Start();
+
+  // Three connections on one worker: one to keep it busy, one left with a
+  // response it does not read, and an idle one
+  std::vector<int> clients;
+  std::map<std::string, std::vector<int>> by_worker;
+  std::vector<int> same_worker;
+  const int workers = static_cast<int>(server.stats().workers.size());
+  for (int i = 0; i < 3 * workers && same_worker.empty(); i++) {
+    int client = ConnectAbstract(name);
+    timeval timeout = {2, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    clients.push_back(client);
+    std::vector<int> &group = by_worker[GetBody(client, "/id")];
+    group.push_back(client);
+    if (group.size() == 3) same_worker = group;
+  }
+  EXPECT_TRUE(same_worker.size() == 3);
+  if (same_worker.size() != 3) {
+    for (int client : clients) close(client);
+    server.Stop(std::chrono::milliseconds(100));
+    return;
+  }
+  int busy_client = same_worker[0], writing = same_worker[1],
+      idle = same_worker[2];
+  std::string worker_id = GetBody(idle, "/id");
+  const std::string request = "GET /large HTTP/1.1\r\nHost: test\r\n\r\n";
+  send(writing, request.data(), request.length(), 0);
+
+  std::atomic<bool> done(false);
+  std::thread load([&] {
+    while (!done) GetBody(busy_client, "/slow");
+  });
+  std::string moved_to = worker_id;
+  for (int attempt = 0; attempt < 150 && moved_to == worker_id; attempt++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    moved_to = GetBody(idle, "/id");
+  }
+  done = true;
+  load.join();
+  EXPECT_TRUE(!moved_to.empty() && moved_to != worker_id);
+  EXPECT_TRUE(GetBody(idle, "/id") == moved_to);
+
+  // The response being written is whole, and its connection never moved
+  std::string response = ReadResponse(writing, large.length());
+  size_t head_end = response.find("\r\n\r\n");
+  if (head_end != std::string::npos) {
+    response += ReadResponse(writing, head_end + 4 + large.length() -
+                                          response.length());
+  }
+  EXPECT_TRUE(head_end != std::string::npos &&
+              response.length() == head_end + 4 + large.length());
+  EXPECT_TRUE(GetBody(writing, "/id") == worker_id);
+
+  ServerStats stats = server.stats();
+  std::uint64_t migrated_in = 0, migrated_out = 0;
+  for (const WorkerStats &worker : stats.workers) {
+    migrated_in += worker.connections_migrated_in;
+    migrated_out += worker.connections_migrated_out;
+  }
+  int worker = std::atoi(worker_id.c_str());
+  EXPECT_TRUE(stats.workers[worker].connections_migrated_out >= 1);
+  EXPECT_TRUE(stats.workers[std::atoi(moved_to.c_str())]
+                  .connections_migrated_in >= 1);
+  EXPECT_TRUE(migrated_in == migrated_out);
+  for (int client : clients) close(client);
+  server.Stop(std::chrono::milliseconds(100));
+}
+
+void test_streamed_responses() {
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::AbstractUnix("high_performance_server_test_stream")});
+  server.RegisterHttpRequestHandler(
+      "/items", HttpMethod::GET,
+      [](const HttpRequest &, RequestContext &context) {
+        JsonWriter json(context.Stream(HttpStatusCode::Ok, "application/json"));
+        json.BeginArray();
+        for (int i = 0; i < 10000; i++) {
+          json.BeginObject().Key("id").Int(i).Key("name").String("item");
+          json.EndObject();
+        }
+        json.EndArray();
+        return HttpResponse();
+      });
+  server.RegisterHttpRequestHandler(
+      "/items", HttpMethod::HEAD,
+      [](const HttpRequest &, RequestContext &context) {
+        context.Stream(HttpStatusCode::Ok).Write("not sent");
+        return HttpResponse();
+      });
+  // Whole responses are no longer cut at the size of the request buffer
+  server.RegisterHttpRequestHandler("/large", HttpMethod::GET,
+                                    [](const HttpRequest &) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent(
+                                          std::string(100000, 'x'));
+                                      return response;
+                                    });
+  server.Start();
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::string name("\0high_performance_server_test_stream", 36);
+  std::memcpy(address.sun_path, name.data(), name.length());
+  socklen_t address_length = offsetof(sockaddr_un, sun_path) + name.length();
+  auto request = [&](const std::string &request_line) {
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+    std::string request =
+        request_line + " HTTP/1.1\r\nConnection: close\r\n\r\n";
+    send(client, request.data(), request.length(), 0);
+    return client;
+  };
+
+  int client = request("GET /items");
+  std::string body;
+  std::string head = ReadChunkedResponse(client, &body);
+  close(client);
+  EXPECT_TRUE(head.find("HTTP/1.1 200 OK\r\n") == 0);
+  EXPECT_TRUE(head.find("Transfer-Encoding: chunked\r\n") !=
+              std::string::npos);
+  EXPECT_TRUE(head.find("Content-Type: application/json\r\n") !=
+              std::string::npos);
+  EXPECT_TRUE(head.find("Connection: close\r\n") != std::string::npos);
+  EXPECT_TRUE(body.length() > 2 * ResponseWriter::kChunkSize);
+  const std::string first = "[{\"id\":0,\"name\":\"item\"},";
+  const std::string last = ",{\"id\":9999,\"name\":\"item\"}]";
+  EXPECT_TRUE(body.compare(0, first.length(), first) == 0);
+  EXPECT_TRUE(body.compare(body.length() - last.length(), last.length(),
+                           last) == 0);
+
+  client = request("HEAD /items");
+  std::string response = ReadResponse(client, SIZE_MAX);
+  close(client);
+  EXPECT_TRUE(response.find("Transfer-Encoding: chunked\r\n") !=
+              std::string::npos);
+  EXPECT_TRUE(response.length() ==
+              response.find("\r\n\r\n") + 4);  // nothing after the head
+
+  client = request("GET /large");
+  response = ReadResponse(client, SIZE_MAX);
+  close(client);
+  EXPECT_TRUE(response.find("Content-Length: 100000\r\n") !=
+              std::string::npos);
+  EXPECT_TRUE(response.length() ==
+              response.find("\r\n\r\n") + 4 + 100000);
+
+  server.Stop(std::chrono::milliseconds(100));
+}
+
+void test_request_priorities() {
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::AbstractUnix("high_performance_server_test_priority")});
+  auto handler = [](const HttpRequest &request) {
+    HttpResponse response(HttpStatusCode::Ok);
+    response.SetContent(request.uri().path());
+    return response;
+  };
+  server.RegisterHttpRequestHandler("/health", HttpMethod::GET, handler,
+                                    RequestPriority::High);
+  server.RegisterHttpRequestHandler("/bulk", HttpMethod::GET, handler,
+                                    RequestPriority::Low);
+  server.RegisterHttpRequestHandler("/", HttpMethod::GET, handler);
+  PriorityOptions options;
+  options.low_budget = 1;
+  server.SetPriorityOptions(options);
+  server.Start();
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::string name("\0high_performance_server_test_priority", 38);
+  std::memcpy(address.sun_path, name.data(), name.length());
+  socklen_t address_length = offsetof(sockaddr_un, sun_path) + name.length();
+  int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+  // Requests are classified before parsing, with the same case-insensitive
+  // match as routing
+  const char *targets[] = {"/HEALTH", "/bulk", "/", "/bulk", "/missing"};
+  for (const char *target : targets) {
+    std::string request =
+        std::string("GET ") + target + " HTTP/1.1\r\nHost: test\r\n\r\n";
+    send(client, request.data(), request.length(), 0);
+    std::string response = ReadResponse(client, 1);
+    while (response.find("\r\n\r\n") == std::string::npos) {
+      response += ReadResponse(client, 1);
+    }
+    EXPECT_TRUE(response.find("HTTP/1.1 ") == 0);
+  }
+  close(client);
+
+  ServerStats stats = server.stats();
+  const PriorityStats &high =
+      stats.priorities[static_cast<int>(RequestPriority::High)];
+  const PriorityStats &normal =
+      stats.priorities[static_cast<int>(RequestPriority::Normal)];
+  const PriorityStats &low =
+      stats.priorities[static_cast<int>(RequestPriority::Low)];
+  EXPECT_TRUE(high.requests == 1);
+  EXPECT_TRUE(normal.requests == 2);
+  EXPECT_TRUE(low.requests == 2);
+  EXPECT_TRUE(low.queue_ns_max <= low.queue_ns_total);
+  server.Stop(std::chrono::milliseconds(100));
+}
+
+// Reads `count` responses of a keep-alive connection, or as many as come
+// before nothing has for a while, and returns their bodies
+std::vector<std::string> ReadBodies(int fd, size_t count) {
+  timeval timeout = {2, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  std::vector<std::string> bodies;
+  std::string received;
+  char buffer[4096];
+  while (bodies.size() < count) {
+    size_t head_end = received.find("\r\n\r\n");
+    size_t length_at = received.find("Content-Length: ");
+    if (head_end != std::string::npos && length_at < head_end) {
+      size_t length = std::stoul(received.substr(length_at + 16));
+      if (received.length() >= head_end + 4 + length) {
+        bodies.push_back(received.substr(head_end + 4, length));
+        received.erase(0, head_end + 4 + length);
+        continue;
+      }
+    }
+    ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+    if (got <= 0) break;
+    received.append(buffer, got);
+  }
+  return bodies;
+}
+
+// Over TCP, where reading a response does not wake the server up: on a
+// Unix domain socket it raises an EPOLLOUT edge that would hide a lost read
+void test_priority_scheduling() {
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::Tcp("127.0.0.1", 0)});
+  std::mutex served_mutex;
+  std::vector<std::string> served;
+  std::atomic<int> slow_started(0);
+  // Answers with the worker's id, for the test to find connections that
+  // share a worker
+  auto handler = [&](const HttpRequest &request, RequestContext &context) {
+    std::string path(request.uri().path());
+    if (path == "/block") {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    } else if (path == "/slow") {
+      slow_started++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    {
+      std::lock_guard<std::mutex> lock(served_mutex);
+      served.push_back(path);
+    }
+    HttpResponse response(HttpStatusCode::Ok);
+    response.SetContent(std::to_string(context.worker_id()));
+    return response;
+  };
+  server.RegisterHttpRequestHandler("/high", HttpMethod::GET, handler,
+                                    RequestPriority::High);
+  server.RegisterHttpRequestHandler("/slow", HttpMethod::GET, handler,
+                                    RequestPriority::Low);
+  server.RegisterHttpRequestHandler("/low", HttpMethod::GET, handler,
+                                    RequestPriority::Low);
+  server.RegisterHttpRequestHandler("/normal", HttpMethod::GET, handler);
+  server.RegisterHttpRequestHandler("/block", HttpMethod::GET, handler);
+  PriorityOptions options;
+  options.low_budget = 1;
+  server.SetPriorityOptions(options);
+  // The held-up requests would be shed otherwise
+  OverloadOptions overload;
+  overload.adaptive_shedding = false;
+  server.SetOverloadOptions(overload);
+  server.Start();
+
+  sockaddr_in address;
+  socklen_t address_length = sizeof(address);
+  getsockname(server.listener_fds()[0], (sockaddr *)&address, &address_length);
+  auto send_request = [](int client, const std::string &target) {
+    std::string request = "GET " + target + " HTTP/1.1\r\nHost: test\r\n\r\n";
+    send(client, request.data(), request.length(), 0);
+  };
+
+  // Five connections on one worker
+  std::vector<int> clients, same_worker;
+  std::vector<std::vector<int>> by_worker(16);
+  for (int i = 0; i < 30 && same_worker.empty(); i++) {
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+    clients.push_back(client);
+    send_request(client, "/normal");
+    std::vector<std::string> bodies = ReadBodies(client, 1);
+    EXPECT_TRUE(bodies.size() == 1);
+    if (bodies.size() != 1) break;
+    std::vector<int> &group = by_worker[std::stoul(bodies[0]) % 16];
+    group.push_back(client);
+    if (group.size() == 5) same_worker = group;
+  }
+  EXPECT_TRUE(same_worker.size() == 5);
+  if (same_worker.size() == 5) {
+    {
+      std::lock_guard<std::mutex> lock(served_mutex);
+      served.clear();
+    }
+    // While the worker is held up, requests of every class arrive, the
+    // lowest first. They are all received in the next iteration.
+    send_request(same_worker[0], "/block");
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    send_request(same_worker[1], "/slow");
+    send_request(same_worker[2], "/slow");
+    send_request(same_worker[3], "/normal");
+    send_request(same_worker[4], "/high");
+    // One of the low-priority requests is deferred by the budget. The
+    // next request on each of the two connections arrives while the other
+    // is served.
+    for (int i = 0; i < 200 && slow_started == 0; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    send_request(same_worker[1], "/low");
+    send_request(same_worker[2], "/low");
+
+    EXPECT_TRUE(ReadBodies(same_worker[0], 1).size() == 1);
+    EXPECT_TRUE(ReadBodies(same_worker[1], 2).size() == 2);
+    EXPECT_TRUE(ReadBodies(same_worker[2], 2).size() == 2);
+    EXPECT_TRUE(ReadBodies(same_worker[3], 1).size() == 1);
+    EXPECT_TRUE(ReadBodies(same_worker[4], 1).size() == 1);
+    std::lock_guard<std::mutex> lock(served_mutex);
+    const std::vector<std::string> expected = {
+        "/block", "/high", "/normal", "/slow", "/slow", "/low", "/low"};
+    EXPECT_TRUE(served == expected);
+  }
+  for (int client : clients) close(client);
+
+  ServerStats stats = server.stats();
+  EXPECT_TRUE(stats.priorities[static_cast<int>(RequestPriority::High)]
+                  .deferred == 0);
+  EXPECT_TRUE(stats.priorities[static_cast<int>(RequestPriority::Low)]
+                  .deferred >= 2);
+  server.Stop(std::chrono::milliseconds(100));
+}
+
+void test_cancellation_token() {
+  using Clock = CancellationToken::Clock;
+  CancellationToken never;
+  EXPECT_TRUE(!never.cancelled());
+  EXPECT_TRUE(never.remaining() == Clock::duration::max());
+
+  // Callbacks run once, when the token is found cancelled
+  CancellationToken token(Clock::now() + std::chrono::hours(1), nullptr,
+                          nullptr);
+  int calls = 0;
+  token.OnCancel([&calls] { calls++; });
+  EXPECT_TRUE(!token.cancelled());
+  EXPECT_TRUE(token.remaining() > std::chrono::minutes(59));
+  token.ShortenDeadline(Clock::now() + std::chrono::hours(2));  // no effect
+  EXPECT_TRUE(!token.cancelled());
+  token.ShortenDeadline(Clock::now() - std::chrono::milliseconds(1));
+  EXPECT_TRUE(calls == 0);
+  EXPECT_TRUE(token.cancelled());
+  EXPECT_TRUE(token.reason() == CancelReason::Deadline);
+  EXPECT_TRUE(token.remaining() == Clock::duration::zero());
+  EXPECT_TRUE(token.cancelled());
+  EXPECT_TRUE(calls == 1);
+  token.OnCancel([&calls] { calls++; });  // already cancelled
+  EXPECT_TRUE(calls == 2);
+  token.Cancel(CancelReason::PeerClosed);  // the first reason stays
+  EXPECT_TRUE(token.reason() == CancelReason::Deadline);
+  EXPECT_TRUE(calls == 2);
+
+  // The probe is asked at most once per interval
+  int probes = 0;
+  bool gone = false;
+  struct Probe {
+    int *probes;
+    bool *gone;
+    static bool Ask(void *context) {
+      Probe *probe = static_cast<Probe *>(context);
+      (*probe->probes)++;
+      return *probe->gone;
+    }
+  } probe{&probes, &gone};
+  CancellationToken probed(Clock::time_point::max(), &Probe::Ask, &probe);
+  for (int i = 0; i < 1000; i++) EXPECT_TRUE(!probed.cancelled());
+  EXPECT_TRUE(probes >= 1 && probes < 1000);
+  gone = true;
+  std::this_thread::sleep_for(CancellationToken::kProbeInterval);
+  EXPECT_TRUE(probed.cancelled());
+  EXPECT_TRUE(probed.reason() == CancelReason::PeerClosed);
+}
+
+void test_request_deadlines() {
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::AbstractUnix("high_performance_server_test_deadline")});
+  std::atomic<int> handled(0);
+  std::atomic<int> reason(-1);
+  // Works until its request is cancelled, for at most three seconds
+  server.RegisterHttpRequestHandler(
+      "/wait", HttpMethod::GET,
+      [&](const HttpRequest &, RequestContext &context) {
+        handled++;
+        auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(3);
+        CancellationToken &cancellation = context.cancellation();
+        bool notified = false;
+        cancellation.OnCancel([&notified] { notified = true; });
+        while (!cancellation.cancelled() &&
+               std::chrono::steady_clock::now() < give_up) {
+        }
+        EXPECT_TRUE(notified == cancellation.cancelled());
+        reason = static_cast<int>(cancellation.reason());
+        HttpResponse response(HttpStatusCode::Ok);
+        response.SetContent("done");
+        return response;
+      });
+  DeadlineOptions options;
+  options.request_timeout = std::chrono::milliseconds(300);
+  server.SetDeadlineOptions(options);
+  server.Start();
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::string name("\0high_performance_server_test_deadline", 38);
+  std::memcpy(address.sun_path, name.data(), name.length());
+  socklen_t address_length = offsetof(sockaddr_un, sun_path) + name.length();
+  auto request = [&](const std::string &headers) {
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+    std::string request = "GET /wait HTTP/1.1\r\nConnection: close\r\n" +
+                          headers + "\r\n";
+    send(client, request.data(), request.length(), 0);
+    return client;
+  };
+  auto exchange = [&](const std::string &headers) {
+    int client = request(headers);
+    std::string response = ReadResponse(client, SIZE_MAX);
+    close(client);
+    return response;
+  };
+
+  // The server's deadline: the handler notices, and what it returns is
+  // replaced
+  auto start = std::chrono::steady_clock::now();
+  std::string response = exchange("");
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start <
+              std::chrono::seconds(2));
+  EXPECT_TRUE(response.find("HTTP/1.1 408 Request Timeout\r\n") == 0);
+  EXPECT_TRUE(reason == static_cast<int>(CancelReason::Deadline));
+  EXPECT_TRUE(handled == 1);
+
+  // A client's deadline already past when the request is served never
+  // reaches the handler
+  response = exchange("X-Request-Timeout: 0\r\n");
+  EXPECT_TRUE(response.find("HTTP/1.1 504 Gateway Timeout\r\n") == 0);
+  EXPECT_TRUE(handled == 1);
+  response = exchange("X-Request-Timeout: 10\r\n");
+  EXPECT_TRUE(response.find("HTTP/1.1 504 Gateway Timeout\r\n") == 0);
+  EXPECT_TRUE(handled == 2);
+  response = exchange("X-Request-Timeout: soon\r\n");
+  EXPECT_TRUE(response.find("HTTP/1.1 400 Bad Request\r\n") == 0);
+  EXPECT_TRUE(handled == 2);
+
+  // A client that goes away while the handler runs cancels its request
+  // before the deadline
+  reason = -1;
+  int client = request("");
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  close(client);
+  for (int i = 0; i < 200 && reason == -1; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_TRUE(reason == static_cast<int>(CancelReason::PeerClosed));
+  EXPECT_TRUE(handled == 3);
+
+  server.Stop(std::chrono::milliseconds(100));
+  ServerStats stats = server.stats();
+  EXPECT_TRUE(stats.requests_expired == 1);
+  EXPECT_TRUE(stats.requests_cancelled == 3);
+
+  // Without a server deadline, a client's deadline of any length holds
+  HttpServer unbounded(std::vector<ListenEndpoint>{
+      ListenEndpoint::AbstractUnix("high_performance_server_test_deadline")});
+  unbounded.RegisterHttpRequestHandler(
+      "/wait", HttpMethod::GET, [](const HttpRequest &, RequestContext &) {
+        HttpResponse response(HttpStatusCode::Ok);
+        response.SetContent("done");
+        return response;
+      });
+  unbounded.Start();
+  response = exchange("X-Request-Timeout: 9000000000000000000\r\n");
+  EXPECT_TRUE(response.find("HTTP/1.1 200 OK\r\n") == 0);
+  unbounded.Stop(std::chrono::milliseconds(100));
+  EXPECT_TRUE(unbounded.stats().requests_expired == 0);
+}
+
+void test_event_messages() {
+  EventMessage *message = EventMessage::Create("news", "a\nb", "update", "7");
+  const std::string body = "id: 7\nevent: update\ndata: a\ndata: b\n\n";
+  EXPECT_TRUE(message->topic() == "news");
+  EXPECT_TRUE(message->bytes() == "25\r\n" + body + "\r\n");
+  message->Unref();
+  // Every line break SSE knows starts a new data field
+  message = EventMessage::Create("news", "x\r\ny\rz\n");
+  EXPECT_TRUE(message->bytes() ==
+              "20\r\ndata: x\ndata: y\ndata: z\ndata: \n\n\r\n");
+  message->Unref();
+  message = EventMessage::Create("", "");
+  EXPECT_TRUE(message->bytes() == "8\r\ndata: \n\n\r\n");
+  message->Unref();
+  bool thrown = false;
+  try {
+    EventMessage::Create("news", "", "two\nlines");
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  EXPECT_TRUE(thrown);
+
+  EventMessage *messages[4];
+  for (int i = 0; i < 4; i++) {
+    messages[i] = EventMessage::Create("news", std::string(1, 'a' + i));
+  }
+  EventBacklog backlog(3);
+  for (int i = 0; i < 3; i++) backlog.Push(messages[i]);
+  EXPECT_TRUE(backlog.full());
+  // The partly sent event is kept and the next one dropped
+  size_t size = messages[0]->bytes().length();
+  backlog.Consume(2);
+  EXPECT_TRUE(backlog.DropOldest());
+  backlog.Push(messages[3]);
+  iovec vectors[4];
+  EXPECT_TRUE(backlog.Fill(vectors, 4) == 3);
+  EXPECT_TRUE(vectors[0].iov_len == size - 2);
+  EXPECT_TRUE(backlog.Front() == messages[0]->bytes().substr(2));
+  EXPECT_TRUE(std::string_view(static_cast<char *>(vectors[1].iov_base),
+                               vectors[1].iov_len) == messages[2]->bytes());
+  EXPECT_TRUE(std::string_view(static_cast<char *>(vectors[2].iov_base),
+                               vectors[2].iov_len) == messages[3]->bytes());
+  backlog.Consume(size - 2 + 1);
+  EXPECT_TRUE(backlog.size() == 2);
+  EXPECT_TRUE(backlog.DropOldest());
+  EXPECT_TRUE(backlog.size() == 1 && !backlog.DropOldest());
+  backlog.Consume(size - 1);
+  EXPECT_TRUE(backlog.empty());
+  // Nor is an event dropped that a TLS write is to be retried with
+  backlog.Push(messages[1]);
+  backlog.Push(messages[3]);
+  backlog.PinFront();
+  EXPECT_TRUE(backlog.DropOldest());
+  EXPECT_TRUE(backlog.size() == 1 && !backlog.DropOldest());
+  EXPECT_TRUE(backlog.Front() == messages[1]->bytes());
+  backlog.Consume(size);
+  backlog.Push(messages[3]);
+  EXPECT_TRUE(backlog.DropOldest() && backlog.empty());
+  // The backlog held its own references
+  for (EventMessage *held : messages) held->Unref();
+}
+
+// Reads an event stream until `count` events have arrived or nothing came
+// for a while. The events go to `events`, one chunk each; returns the head.
+std::string ReadEvents(int fd, size_t count, std::vector<std::string> *events) {
+  timeval timeout = {0, 500 * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  std::string received, head;
+  size_t at = 0;
+  char buffer[65536];
+  while (events->size() < count) {
+    ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+    if (length <= 0) break;
+    received.append(buffer, length);
+    if (head.empty()) {
+      size_t end = received.find("\r\n\r\n");
+      if (end == std::string::npos) continue;
+      head = received.substr(0, end + 2);
+      at = end + 4;
+    }
+    while (true) {
+      size_t line_end = received.find("\r\n", at);
+      if (line_end == std::string::npos) break;
+      size_t size =
+          std::stoul(received.substr(at, line_end - at), nullptr, 16);
+      if (received.length() < line_end + 2 + size + 2) break;
+      events->push_back(received.substr(line_end + 2, size));
+      at = line_end + 2 + size + 2;
+    }
+  }
+  return head;
+}
+
+void test_event_streams() {
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::AbstractUnix("high_performance_server_test_events")});
+  server.RegisterEventStream("/events", "news");
+  server.RegisterEventStream("/private",
+                             [](const HttpRequest &) { return std::string(); });
+  EventStreamOptions options;
+  options.max_backlog = 4;
+  server.SetEventStreamOptions(options);
+  server.Start();
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::string name("\0high_performance_server_test_events", 36);
+  std::memcpy(address.sun_path, name.data(), name.length());
+  socklen_t address_length = offsetof(sockaddr_un, sun_path) + name.length();
+  auto request = [&](const std::string &target) {
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+    std::string request = "GET " + target + " HTTP/1.1\r\nHost: test\r\n\r\n";
+    send(client, request.data(), request.length(), 0);
+    return client;
+  };
+  auto wait_for_subscribers = [&server](int count) {
+    for (int i = 0; i < 200 && server.stats().subscribers != count; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    EXPECT_TRUE(server.stats().subscribers == count);
+  };
+
+  // Every subscriber of the topic gets every event, and only those
+  std::vector<int> clients;
+  for (int i = 0; i < 3; i++) clients.push_back(request("/events"));
+  wait_for_subscribers(3);
+  server.Publish("news", "hello", "greeting", "1");
+  server.Publish("sports", "not subscribed");
+  server.Publish("news", "line 1\nline 2");
+  for (int client : clients) {
+    std::vector<std::string> events;
+    std::string head = ReadEvents(client, 2, &events);
+    EXPECT_TRUE(head.find("HTTP/1.1 200 OK\r\n") == 0);
+    EXPECT_TRUE(head.find("Content-Type: text/event-stream\r\n") !=
+                std::string::npos);
+    EXPECT_TRUE(head.find("Transfer-Encoding: chunked\r\n") !=
+                std::string::npos);
+    EXPECT_TRUE(events.size() == 2);
+    if (events.size() != 2) continue;
+    EXPECT_TRUE(events[0] == "id: 1\nevent: greeting\ndata: hello\n\n");
+    EXPECT_TRUE(events[1] == "data: line 1\ndata: line 2\n\n");
+  }
+  for (int client : clients) close(client);
+  wait_for_subscribers(0);
+
+  int client = request("/private");
+  std::string response = ReadResponse(client, 1);
+  EXPECT_TRUE(response.find("HTTP/1.1 404 Not Found\r\n") == 0);
+  close(client);
+
+  // A subscriber that does not read loses the oldest events, never part of
+  // one, and still gets the latest
+  client = request("/events");
+  wait_for_subscribers(1);
+  const std::string payload(32 * 1024, 'x');
+  for (int i = 0; i < 200; i++) {
+    server.Publish("news", payload, std::string_view(), std::to_string(i));
+  }
+  for (int i = 0; i < 200 && server.stats().events_dropped == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  EXPECT_TRUE(server.stats().events_dropped > 0);
+  std::vector<std::string> events;
+  ReadEvents(client, 200, &events);
+  EXPECT_TRUE(events.size() < 200);
+  int last = -1;
+  bool whole = true;
+  for (const std::string &event : events) {
+    int id = std::stoi(event.substr(4));
+    whole = whole && id > last &&
+            event == "id: " + std::to_string(id) + "\ndata: " + payload + "\n\n";
+    last = id;
+  }
+  EXPECT_TRUE(whole);
+  EXPECT_TRUE(last == 199);
+  close(client);
+
+  server.Stop(std::chrono::milliseconds(100));
+  ServerStats stats = server.stats();
+  EXPECT_TRUE(stats.subscribers == 0);
+  EXPECT_TRUE(stats.events_published == 203);
+  EXPECT_TRUE(stats.subscribers_disconnected == 0);
+}
+
+void test_slow_subscribers_disconnected() {
+  HttpServer server(std::vector<ListenEndpoint>{
+      ListenEndpoint::AbstractUnix("high_performance_server_test_slow")});
+  server.RegisterEventStream("/events", "news");
+  EventStreamOptions options;
+  options.max_backlog = 2;
+  options.slow_subscriber_action = SlowSubscriberAction::Disconnect;
+  server.SetEventStreamOptions(options);
+  server.Start();
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::string name("\0high_performance_server_test_slow", 34);
+  std::memcpy(address.sun_path, name.data(), name.length());
+  socklen_t address_length = offsetof(sockaddr_un, sun_path) + name.length();
+  int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  EXPECT_TRUE(connect(client, (sockaddr *)&address, address_length) == 0);
+  const std::string request = "GET /events HTTP/1.1\r\nHost: test\r\n\r\n";
+  send(client, request.data(), request.length(), 0);
+  for (int i = 0; i < 200 && server.stats().subscribers == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+
+  const std::string payload(64 * 1024, 'x');
+  for (int i = 0; i < 100 && server.stats().subscribers_disconnected == 0;
+       i++) {
+    server.Publish("news", payload);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_TRUE(server.stats().subscribers_disconnected == 1);
+  EXPECT_TRUE(server.stats().subscribers == 0);
+  // What was sent still arrives, then the end of the stream
+  ReadResponse(client, SIZE_MAX);
+  close(client);
+  server.Stop(std::chrono::milliseconds(100));
+}
+
+void test_tracer() {
+  // A request whose phases each took about a millisecond
+  auto slow_request = [] {
+    RequestTrace trace;
+    trace.Reset();
+    std::uint64_t now = Tracer::Now();
+    std::uint64_t step = Tracer::Now() - now + 1000000;
+    for (int mark = kTraceQueued; mark < kTraceMarkCount; mark++) {
+      trace.marks[mark] = now + mark * step;
+    }
+    return trace;
+  };
+
+  TraceOptions options;
+  options.sample_rate = 2;
+  options.events_per_worker = 64;
+  Tracer sampled(options, 2);
+  RequestTrace trace = slow_request();
+  int kept = 0;
+  for (int i = 0; i < 4; i++) kept += sampled.CommitRequest(1, trace);
+  EXPECT_TRUE(kept == 2);
+  sampled.CommitIteration(1, trace.marks[0], trace.marks[kTraceSendEnd], true);
+  sampled.CommitIteration(1, trace.marks[0], trace.marks[kTraceSendEnd], false);
+  std::string json = sampled.ExportChromeTrace();
+  // A request and its 8 phases each time, plus one iteration
+  EXPECT_TRUE(CountOccurrences(json, "\"ph\":\"X\"") == 2 * 9 + 1);
+  EXPECT_TRUE(CountOccurrences(json, "\"name\":\"priority queue\"") == 2);
+  EXPECT_TRUE(CountOccurrences(json, "\"name\":\"parse\"") == 2);
+  EXPECT_TRUE(CountOccurrences(json, "\"name\":\"iteration\"") == 1);
+  EXPECT_TRUE(CountOccurrences(json, "\"thread_name\"") == 4);
+  EXPECT_TRUE(json.find("\"tid\":3") != std::string::npos);
+
+  // Phases that were not reached are left out: here, a shed request
+  options.sample_rate = 1;
+  Tracer shed(options, 1);
+  trace = slow_request();
+  trace.marks[kTraceParseEnd] = 0;
+  trace.marks[kTraceHandleEnd] = 0;
+  trace.marks[kTraceSerializeEnd] = 0;
+  shed.CommitRequest(0, trace);
+  EXPECT_TRUE(CountOccurrences(shed.ExportChromeTrace(), "\"ph\":\"X\"") ==
+              6);
+
+  // Without sampling only slow requests are kept
+  options.sample_rate = 0;
+  options.latency_threshold = std::chrono::microseconds(1000);
+  Tracer slow(options, 1);
+  RequestTrace fast;
+  fast.Reset();
+  fast.Mark(kTraceReceiveStart);
+  fast.Mark(kTraceSendEnd);
+  EXPECT_TRUE(!slow.CommitRequest(0, fast));
+  EXPECT_TRUE(slow.CommitRequest(0, slow_request()));
+
+  // The ring keeps only the most recent events
+  options.sample_rate = 1;
+  options.latency_threshold = std::chrono::microseconds(0);
+  Tracer full(options, 1);
+  for (int i = 0; i < 100; i++) full.CommitRequest(0, slow_request());
+  EXPECT_TRUE(CountOccurrences(full.ExportChromeTrace(), "\"ph\":\"X\"") <
+              64);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && std::strcmp(argv[1], "--serve-inherited-listeners") == 0) {
+    return ServeInheritedListeners();
+  }
   std::cout << "Running tests..." << std::endl;
 
   test_uri_path_to_lowercase();
@@ -90,6 +2319,41 @@ int main(void) {
   test_string_to_version();
   test_request_to_string();
   test_response_to_string();
+  test_string_to_request();
+  test_scan_kernels_match_scalar();
+  test_pack_upper();
+  test_listener_handoff();
+  test_request_arena();
+  test_form_urlencoded();
+  test_multipart_form();
+  test_output_chain();
+  test_json_writer();
+  test_load_shedder();
+  test_rate_limiter();
+  test_peer_address_to_string();
+  test_spsc_ring();
+  test_access_log();
+  test_tls();
+  test_tls_server();
+  test_listen_endpoint_parse();
+  test_socket_endpoints();
+  test_edge_triggered_connections();
+  test_spawned_successor();
+  test_graceful_stop();
+  test_adopted_listener_options();
+  test_rate_limited_requests();
+  test_overload_protection();
+  test_connection_balancing();
+  test_connection_migration();
+  test_streamed_responses();
+  test_request_priorities();
+  test_priority_scheduling();
+  test_cancellation_token();
+  test_request_deadlines();
+  test_event_messages();
+  test_event_streams();
+  test_slow_subscribers_disconnected();
+  test_tracer();
 
   std::cout << "All tests have finished. There were " << err
             << " errors in total" << std::endl;